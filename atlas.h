@@ -0,0 +1,221 @@
+#pragma once
+
+#include "blit.h"
+#include "image.h"
+#include <algorithm>
+#include <climits>
+#include <vector>
+
+// packs many small images (icons, glyphs, sprites) into one ColorImage so
+// drawing them touches one block of memory instead of hundreds.
+//
+// placement is a skyline: the top edge of the packed area kept as a list of
+// horizontal segments, each new rect going where its top ends lowest. every
+// image is surrounded by `padding` pixels copied from its own edges, so
+// filtered sampling near the border (warps, scaled draws) does not pick up
+// the neighbours. handles stay valid across repacks.
+
+class Atlas {
+public:
+  Atlas(int width, int height, int padding = 1)
+      : atlas(width, height), padding(std::max(0, padding)) {
+    clear();
+  }
+
+  // place a copy of im, returns its handle or -1 if there is no room
+  int add(const ColorImage &im) {
+    int w = im.GetWidth(), h = im.GetHeight();
+    int x, y;
+    if (w <= 0 || h <= 0 || !place(skyline, atlas.GetWidth(),
+                                   atlas.GetHeight(), w + 2 * padding,
+                                   h + 2 * padding, x, y))
+      return -1;
+
+    Entry e = {BlitRect{x + padding, y + padding, w, h}, true};
+    copyPadded(atlas, e.rect, im, BlitRect{0, 0, w, h});
+    entries.push_back(e);
+    used += (int64_t)(w + 2 * padding) * (h + 2 * padding);
+    return (int)entries.size() - 1;
+  }
+
+  // free a handle's space for the next repack
+  void remove(int id) {
+    if (!valid(id))
+      return;
+    Entry &e = entries[id];
+    e.live = false;
+    used -= (int64_t)(e.rect.width + 2 * padding) *
+            (e.rect.height + 2 * padding);
+  }
+
+  // pack every live image again from scratch, tallest first, into a
+  // width x height atlas (0 keeps the current size). this reclaims space
+  // left by removals and bad insertion orders. false, with nothing
+  // changed, if they do not fit
+  bool repack(int width = 0, int height = 0) {
+    width = width > 0 ? width : atlas.GetWidth();
+    height = height > 0 ? height : atlas.GetHeight();
+
+    std::vector<int> order;
+    for (int i = 0; i < (int)entries.size(); i++)
+      if (entries[i].live)
+        order.push_back(i);
+    std::sort(order.begin(), order.end(), [&](int a, int b) {
+      const BlitRect &ra = entries[a].rect, &rb = entries[b].rect;
+      return ra.height != rb.height ? ra.height > rb.height
+                                    : ra.width > rb.width;
+    });
+
+    std::vector<Segment> line = {{0, 0, width}};
+    std::vector<BlitRect> placed(entries.size());
+    for (int i : order) {
+      const BlitRect &r = entries[i].rect;
+      int x, y;
+      if (!place(line, width, height, r.width + 2 * padding,
+                 r.height + 2 * padding, x, y))
+        return false;
+      placed[i] = BlitRect{x + padding, y + padding, r.width, r.height};
+    }
+
+    ColorImage packed(width, height);
+    clearPixels(packed);
+    for (int i : order) {
+      copyPadded(packed, placed[i], atlas, entries[i].rect);
+      entries[i].rect = placed[i];
+    }
+    atlas = std::move(packed);
+    skyline = std::move(line);
+    return true;
+  }
+
+  // drop every image and handle
+  void clear() {
+    entries.clear();
+    skyline = {{0, 0, atlas.GetWidth()}};
+    used = 0;
+    clearPixels(atlas);
+  }
+
+  bool valid(int id) const {
+    return id >= 0 && id < (int)entries.size() && entries[id].live;
+  }
+
+  // where a handle's pixels are in image(), without the padding
+  BlitRect rect(int id) const { return entries[id].rect; }
+
+  const ColorImage &image() const { return atlas; }
+
+  // fraction of the atlas taken by live images and their padding
+  double occupancy() const {
+    return (double)used / ((double)atlas.GetWidth() * atlas.GetHeight());
+  }
+
+  void draw(ColorImage &dst, int id, int x, int y, float opacity = 1.0f,
+            int mode = BLEND_NORMAL) const {
+    blit(dst, atlas, x, y, rect(id), opacity, mode);
+  }
+
+  // tile a handle over the area of dst, starting at its top left corner
+  void fillPattern(ColorImage &dst, int id, BlitRect area,
+                   float opacity = 1.0f, int mode = BLEND_NORMAL) const {
+    BlitRect r = rect(id);
+    for (int y = 0; y < area.height; y += r.height)
+      for (int x = 0; x < area.width; x += r.width)
+        blit(dst, atlas, area.x + x, area.y + y,
+             BlitRect{r.x, r.y, std::min(r.width, area.width - x),
+                      std::min(r.height, area.height - y)},
+             opacity, mode);
+  }
+
+private:
+  // the top of the packed area over [x, x + width)
+  struct Segment {
+    int x, y, width;
+  };
+
+  struct Entry {
+    BlitRect rect;
+    bool live;
+  };
+
+  // bottom-left skyline placement: the lowest top edge wins, ties go to the
+  // narrower leftover segment so gaps fill up. updates line on success
+  static bool place(std::vector<Segment> &line, int atlasWidth,
+                    int atlasHeight, int w, int h, int &outX, int &outY) {
+    int bestTop = INT_MAX, bestWaste = INT_MAX, best = -1, bestY = 0;
+    for (size_t i = 0; i < line.size(); i++) {
+      int x = line[i].x;
+      if (x + w > atlasWidth)
+        break;
+      // the rect rests on the highest segment it spans
+      int y = 0, left = w;
+      for (size_t j = i; left > 0; j++) {
+        y = std::max(y, line[j].y);
+        left -= line[j].width;
+      }
+      if (y + h > atlasHeight)
+        continue;
+      int waste = line[i].width - w;
+      if (y + h < bestTop || (y + h == bestTop && waste < bestWaste)) {
+        bestTop = y + h;
+        bestWaste = waste;
+        best = (int)i;
+        bestY = y;
+      }
+    }
+    if (best < 0)
+      return false;
+
+    outX = line[best].x;
+    outY = bestY;
+
+    // the new segment replaces whatever it covers
+    Segment top = {outX, outY + h, w};
+    size_t i = best;
+    while (i < line.size() && line[i].x + line[i].width <= outX + w)
+      i++;
+    if (i < line.size() && line[i].x < outX + w) {
+      line[i].width -= outX + w - line[i].x;
+      line[i].x = outX + w;
+    }
+    line.erase(line.begin() + best, line.begin() + i);
+    line.insert(line.begin() + best, top);
+
+    // join neighbours at the same height
+    for (size_t j = 0; j + 1 < line.size();) {
+      if (line[j].y == line[j + 1].y) {
+        line[j].width += line[j + 1].width;
+        line.erase(line.begin() + j + 1);
+      } else {
+        j++;
+      }
+    }
+    return true;
+  }
+
+  static void clearPixels(ColorImage &im) {
+    for (int y = 0; y < im.GetHeight(); y++)
+      std::fill(im.Row(y), im.Row(y) + im.GetWidth(), RGBA(0, 0, 0, 0));
+  }
+
+  // copy the from rect of src to the to rect of dst, then repeat its edge
+  // pixels outwards over the padding
+  void copyPadded(ColorImage &dst, BlitRect to, const ColorImage &src,
+                  BlitRect from) const {
+    for (int y = -padding; y < to.height + padding; y++) {
+      int sy = from.y + std::min(std::max(y, 0), from.height - 1);
+      const RGBA *in = src.Row(sy) + from.x;
+      RGBA *out = dst.Row(to.y + y) + to.x;
+      std::copy(in, in + from.width, out);
+      std::fill(out - padding, out, in[0]);
+      std::fill(out + from.width, out + from.width + padding,
+                in[from.width - 1]);
+    }
+  }
+
+  ColorImage atlas;
+  int padding;
+  std::vector<Segment> skyline;
+  std::vector<Entry> entries;
+  int64_t used = 0;
+};
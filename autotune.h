@@ -0,0 +1,77 @@
+#pragma once
+
+#include "scene.h"
+#include <chrono>
+#include <iostream>
+
+// seconds taken by the fastest of a few renders of the scene. keeps going
+// until at least minTime has been spent so tiny scenes are not all noise
+double timeRender(ColorImage &image, const Scene &scene,
+                  const RenderSettings &settings, double minTime = 0.02) {
+  typedef std::chrono::steady_clock Clock;
+  double best = 1e30, total = 0;
+
+  renderScene(image, scene, settings); // warm up
+  for (int run = 0; run < 3 || (total < minTime && run < 50); run++) {
+    Clock::time_point start = Clock::now();
+    renderScene(image, scene, settings);
+    double t = std::chrono::duration<double>(Clock::now() - start).count();
+    best = std::min(best, t);
+    total += t;
+  }
+  return best;
+}
+
+// pick tile height, thread count and span kernel for this machine and scene.
+// one parameter is swept at a time with the others fixed at their best value
+// so far, which keeps the number of candidates small enough to finish in a
+// couple of seconds even on machines with many cores
+RenderSettings calibrate(const Scene &scene, bool verbose = true) {
+  RenderSettings best;
+  ColorImage image(scene.width, scene.height);
+  double bestTime = timeRender(image, scene, best);
+
+  auto tryCandidate = [&](RenderSettings s) {
+    double t = timeRender(image, scene, s);
+    if (verbose)
+      std::cout << "  tile " << s.tileHeight << ", threads " << s.threads
+                << ", kernel " << kernelName(s.kernel)
+                << ": " << t * 1000.0 << " ms" << std::endl;
+    if (t < bestTime) {
+      bestTime = t;
+      best = s;
+    }
+  };
+
+  int kernels[] = {KERNEL_SCALAR, KERNEL_SPAN};
+  for (int k : kernels) {
+    RenderSettings s = best;
+    s.kernel = k;
+    tryCandidate(s);
+  }
+
+  // powers of two up to the core count, plus the core count itself
+  std::vector<int> threadCounts;
+  for (int n = 1; n < HardwareThreads(); n *= 2)
+    threadCounts.push_back(n);
+  threadCounts.push_back(HardwareThreads());
+  for (int n : threadCounts) {
+    RenderSettings s = best;
+    s.threads = n;
+    tryCandidate(s);
+  }
+
+  int tileHeights[] = {4, 8, 16, 32, 64, 128, 256};
+  for (int h : tileHeights) {
+    RenderSettings s = best;
+    s.tileHeight = h;
+    tryCandidate(s);
+  }
+
+  if (verbose)
+    std::cout << "best: tile " << best.tileHeight << ", threads "
+              << best.threads << ", kernel "
+              << kernelName(best.kernel) << " ("
+              << bestTime * 1000.0 << " ms)" << std::endl;
+  return best;
+}
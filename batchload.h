@@ -0,0 +1,150 @@
+#pragma once
+
+#include "image.h"
+#include "parallel.h"
+#include <condition_variable>
+#include <exception>
+#include <fcntl.h>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unistd.h>
+
+// Loads a list of images in order with I/O and decoding overlapped.
+//
+// A reader thread asks the kernel to start reading files ahead
+// (posix_fadvise), reads each file into memory and hands it to the shared
+// pool to decode. Next returns the images in path order. At most `depth`
+// files are read or decoded ahead of the caller, which bounds memory.
+//
+//	BatchLoader loader(paths);
+//	ColorImage im;
+//	std::string path;
+//	while (loader.Next(im, &path)) { ... }
+class BatchLoader {
+public:
+
+	BatchLoader(const std::vector<std::string> &paths, int depth = 0) :
+		paths(paths), depth(depth > 0 ? depth : 2 * HardwareThreads()), slots(this->depth) {
+		reader = std::thread([this]() { Read(); });
+	}
+
+	~BatchLoader() {
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			stopping = true;
+		}
+		changed.notify_all();
+		reader.join();
+
+		// Decodes already submitted still write into the slots
+		std::unique_lock<std::mutex> lock(mutex);
+		changed.wait(lock, [this]() { return decoding == 0; });
+	}
+
+	// The next image in path order. Files that can not be read or decoded
+	// give an empty image. Returns false once every path has been returned.
+	bool Next(ColorImage &image, std::string *path = NULL) {
+		std::unique_lock<std::mutex> lock(mutex);
+		if (next >= paths.size()) return false;
+
+		Slot &slot = slots[next % depth];
+		changed.wait(lock, [&]() { return slot.ready; });
+		image = std::move(slot.image);
+		slot.image = ColorImage();
+		slot.ready = false;
+		if (path != NULL) *path = paths[next];
+		next++;
+		changed.notify_all();
+		return true;
+	}
+
+private:
+	struct Slot {
+		ColorImage image;
+		bool ready = false;
+	};
+
+	// Hint that a file will be read soon so the kernel reads it ahead
+	static void Prefetch(const std::string &path) {
+		int fd = open(path.c_str(), O_RDONLY);
+		if (fd < 0) return;
+		posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+		close(fd);
+	}
+
+	static bool ReadFile(const std::string &path, std::vector<Byte> &bytes) {
+		int fd = open(path.c_str(), O_RDONLY);
+		if (fd < 0) return false;
+		posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+		bytes.clear();
+		size_t used = 0;
+		for (;;) {
+			if (bytes.size() - used < 65536) bytes.resize(std::max<size_t>(2 * bytes.size(), 1 << 20));
+			ssize_t n = read(fd, bytes.data() + used, bytes.size() - used);
+			if (n < 0) {
+				close(fd);
+				return false;
+			}
+			if (n == 0) break;
+			used += n;
+		}
+		close(fd);
+		bytes.resize(used);
+		return true;
+	}
+
+	void Read() {
+		size_t prefetched = 0;
+		for (size_t i = 0; i < paths.size(); i++) {
+			{
+				// Wait for slot i % depth to be free
+				std::unique_lock<std::mutex> lock(mutex);
+				changed.wait(lock, [&]() { return stopping || i < next + depth; });
+				if (stopping) return;
+			}
+
+			// Keep the kernel a window ahead of the file being read
+			for (; prefetched < std::min(paths.size(), i + depth); prefetched++) {
+				Prefetch(paths[prefetched]);
+			}
+
+			std::shared_ptr<std::vector<Byte>> bytes = std::make_shared<std::vector<Byte>>();
+			bool ok = ReadFile(paths[i], *bytes);
+
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				decoding++;
+			}
+			SharedPool().Submit([this, i, ok, bytes]() {
+				// A decode that throws (bad_alloc on a huge header) gives an
+				// empty image like any other undecodable file
+				ColorImage image;
+				try {
+					if (!ok || !image.Decode(bytes->data(), bytes->size())) image = ColorImage();
+				}
+				catch (const std::exception &) {
+					image = ColorImage();
+				}
+
+				std::lock_guard<std::mutex> lock(mutex);
+				Slot &slot = slots[i % depth];
+				slot.image = std::move(image);
+				slot.ready = true;
+				decoding--;
+				changed.notify_all();
+			});
+		}
+	}
+
+	std::vector<std::string> paths;
+	size_t depth;
+	std::vector<Slot> slots;
+	size_t next = 0;	// index of the next image Next returns
+	int decoding = 0;
+	bool stopping = false;
+	std::mutex mutex;
+	std::condition_variable changed;
+	std::thread reader;
+};
@@ -0,0 +1,246 @@
+#pragma once
+
+#include "image.h"
+#include "parallel.h"
+#include "raster.h"
+#include <algorithm>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// draws one ColorImage onto another (sprites, icons, overlays) with any
+// BlendMode. the math is blend() done in 8 bit fixed point, so results are
+// within 1 of blending the pixels one by one, except that the destination
+// alpha is kept as source-over instead of forced to opaque:
+//
+//   k   = src.a * opacity
+//   rgb = dest.rgb + (mode(src, dest) - dest.rgb) * k
+//   a   = dest.a + (1 - dest.a) * k
+
+// part of an image, in pixels
+struct BlitRect {
+  int x, y, width, height;
+};
+
+// rows are split across threads once a blit covers this many pixels
+const int BLIT_PARALLEL_PIXELS = 1 << 16;
+
+// x / 255 rounded, exact for 0 <= x <= 255 * 255
+inline int div255(int x) {
+  x += 128;
+  return (x + (x >> 8)) >> 8;
+}
+
+// the blend mode applied to one 0-255 channel
+template <int Mode> inline int blendChannel(int s, int d) {
+  if (Mode == BLEND_MULTIPLY)
+    return div255(s * d);
+  if (Mode == BLEND_ADD)
+    return std::min(s + d, 255);
+  if (Mode == BLEND_DIFFERENCE)
+    return std::abs(s - d);
+  if (Mode == BLEND_OVERLAY)
+    return d < 128 ? div255(2 * d * s) : 255 - div255(2 * (255 - d) * (255 - s));
+  return s;
+}
+
+// opacity is 0-255
+template <int Mode>
+void blitPixel(RGBA &d, RGBA s, int opacity) {
+  int k = div255(s.a * opacity);
+  int ik = 255 - k;
+  d.r = div255(blendChannel<Mode>(s.r, d.r) * k + d.r * ik);
+  d.g = div255(blendChannel<Mode>(s.g, d.g) * k + d.g * ik);
+  d.b = div255(blendChannel<Mode>(s.b, d.b) * k + d.b * ik);
+  d.a = div255(255 * k + d.a * ik);
+}
+
+#ifdef __SSE2__
+// the same on eight 16 bit lanes, two pixels at a time
+inline __m128i div255x8(__m128i x) {
+  x = _mm_add_epi16(x, _mm_set1_epi16(128));
+  return _mm_srli_epi16(_mm_add_epi16(x, _mm_srli_epi16(x, 8)), 8);
+}
+
+template <int Mode> inline __m128i blendChannels(__m128i s, __m128i d) {
+  const __m128i c255 = _mm_set1_epi16(255);
+  if (Mode == BLEND_MULTIPLY)
+    return div255x8(_mm_mullo_epi16(s, d));
+  if (Mode == BLEND_ADD)
+    return _mm_min_epi16(_mm_add_epi16(s, d), c255);
+  if (Mode == BLEND_DIFFERENCE)
+    return _mm_sub_epi16(_mm_max_epi16(s, d), _mm_min_epi16(s, d));
+  if (Mode == BLEND_OVERLAY) {
+    // both halves are a product of two values that fit 255 * 254, picked
+    // per lane before multiplying so nothing overflows 16 bits
+    __m128i low = _mm_cmplt_epi16(d, _mm_set1_epi16(128));
+    __m128i invS = _mm_sub_epi16(c255, s);
+    __m128i invD = _mm_sub_epi16(c255, d);
+    __m128i a = _mm_or_si128(_mm_and_si128(low, s), _mm_andnot_si128(low, invS));
+    __m128i b = _mm_slli_epi16(
+        _mm_or_si128(_mm_and_si128(low, d), _mm_andnot_si128(low, invD)), 1);
+    __m128i p = div255x8(_mm_mullo_epi16(a, b));
+    return _mm_or_si128(_mm_and_si128(low, p),
+                        _mm_andnot_si128(low, _mm_sub_epi16(c255, p)));
+  }
+  return s;
+}
+
+template <int Mode>
+inline __m128i blitPixels2(__m128i s, __m128i d, __m128i opacity) {
+  const __m128i c255 = _mm_set1_epi16(255);
+  const __m128i alphaLanes = _mm_set_epi16(-1, 0, 0, 0, -1, 0, 0, 0);
+
+  // each pixel's alpha copied to its four lanes
+  __m128i sa = _mm_shufflehi_epi16(_mm_shufflelo_epi16(s, 0xff), 0xff);
+  __m128i k = div255x8(_mm_mullo_epi16(sa, opacity));
+  __m128i ik = _mm_sub_epi16(c255, k);
+
+  // the alpha lane blends towards 255, giving source-over coverage
+  __m128i f = blendChannels<Mode>(s, d);
+  f = _mm_or_si128(_mm_andnot_si128(alphaLanes, f),
+                   _mm_and_si128(alphaLanes, c255));
+  return div255x8(
+      _mm_add_epi16(_mm_mullo_epi16(f, k), _mm_mullo_epi16(d, ik)));
+}
+#endif
+
+template <int Mode>
+void blitRow(RGBA *dst, const RGBA *src, int n, int opacity) {
+  int x = 0;
+
+#ifdef __SSE2__
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i op = _mm_set1_epi16((short)opacity);
+  for (; x + 4 <= n; x += 4) {
+    __m128i s = _mm_loadu_si128((const __m128i *)(src + x));
+    // fully transparent source pixels leave the destination alone
+    if (_mm_movemask_epi8(_mm_cmpeq_epi32(_mm_srli_epi32(s, 24), zero)) ==
+        0xffff)
+      continue;
+    __m128i d = _mm_loadu_si128((const __m128i *)(dst + x));
+    __m128i lo = blitPixels2<Mode>(_mm_unpacklo_epi8(s, zero),
+                                   _mm_unpacklo_epi8(d, zero), op);
+    __m128i hi = blitPixels2<Mode>(_mm_unpackhi_epi8(s, zero),
+                                   _mm_unpackhi_epi8(d, zero), op);
+    _mm_storeu_si128((__m128i *)(dst + x), _mm_packus_epi16(lo, hi));
+  }
+#endif
+
+  for (; x < n; x++)
+    blitPixel<Mode>(dst[x], src[x], opacity);
+}
+
+// blitRow with the mode picked at run time
+void blitRow(RGBA *dst, const RGBA *src, int n, int opacity, int mode) {
+  switch (mode) {
+  case BLEND_MULTIPLY:
+    return blitRow<BLEND_MULTIPLY>(dst, src, n, opacity);
+  case BLEND_ADD:
+    return blitRow<BLEND_ADD>(dst, src, n, opacity);
+  case BLEND_DIFFERENCE:
+    return blitRow<BLEND_DIFFERENCE>(dst, src, n, opacity);
+  case BLEND_OVERLAY:
+    return blitRow<BLEND_OVERLAY>(dst, src, n, opacity);
+  default:
+    return blitRow<BLEND_NORMAL>(dst, src, n, opacity);
+  }
+}
+
+// draw a solid color through a row of 0-255 coverage, for shapes that
+// compute their own antialiasing
+void blendCoverage(RGBA *dst, const Byte *coverage, int n, RGBA color,
+                   int mode = BLEND_NORMAL) {
+  const int chunk = 256;
+  RGBA src[chunk];
+  for (int x0 = 0; x0 < n; x0 += chunk) {
+    int m = std::min(chunk, n - x0);
+    for (int i = 0; i < m; i++)
+      src[i] = RGBA(color.r, color.g, color.b,
+                    (Byte)div255(color.a * coverage[x0 + i]));
+    blitRow(dst + x0, src, m, 255, mode);
+  }
+}
+
+template <int Mode>
+void blitRows(ColorImage &dst, const ColorImage &src, int dx, int dy,
+              BlitRect r, int opacity) {
+  auto rows = [&](int y0, int y1) {
+    for (int y = y0; y < y1; y++)
+      blitRow<Mode>(dst.Row(dy + y) + dx, src.Row(r.y + y) + r.x, r.width,
+                    opacity);
+  };
+
+  if ((int64_t)r.width * r.height < BLIT_PARALLEL_PIXELS) {
+    rows(0, r.height);
+    return;
+  }
+  int bandRows = std::max(1, BLIT_PARALLEL_PIXELS / 4 / r.width);
+  int bands = (r.height + bandRows - 1) / bandRows;
+  ParallelFor(bands, HardwareThreads(), [&](int b) {
+    rows(b * bandRows, std::min(r.height, (b + 1) * bandRows));
+  });
+}
+
+// draw the srcRect part of src with its top left corner at (dx, dy) of dst.
+// the rect is clipped against both images; opacity scales the source alpha
+void blit(ColorImage &dst, const ColorImage &src, int dx, int dy,
+          BlitRect srcRect, float opacity = 1.0f, int mode = BLEND_NORMAL) {
+  // clip to the source, then to the destination, moving both corners
+  BlitRect r = srcRect;
+  if (r.x < 0) {
+    dx -= r.x;
+    r.width += r.x;
+    r.x = 0;
+  }
+  if (r.y < 0) {
+    dy -= r.y;
+    r.height += r.y;
+    r.y = 0;
+  }
+  if (dx < 0) {
+    r.x -= dx;
+    r.width += dx;
+    dx = 0;
+  }
+  if (dy < 0) {
+    r.y -= dy;
+    r.height += dy;
+    dy = 0;
+  }
+  r.width = std::min({r.width, src.GetWidth() - r.x, dst.GetWidth() - dx});
+  r.height = std::min({r.height, src.GetHeight() - r.y, dst.GetHeight() - dy});
+  int op = (int)(clamp_float(opacity, 0.0f, 1.0f) * 255.0f + 0.5f);
+  if (r.width <= 0 || r.height <= 0 || op == 0)
+    return;
+
+  // drawing an image onto itself reads from a copy
+  if (&src == &dst) {
+    ColorImage copy(r.width, r.height);
+    for (int y = 0; y < r.height; y++)
+      std::copy(src.Row(r.y + y) + r.x, src.Row(r.y + y) + r.x + r.width,
+                copy.Row(y));
+    blit(dst, copy, dx, dy, BlitRect{0, 0, r.width, r.height}, opacity, mode);
+    return;
+  }
+
+  switch (mode) {
+  case BLEND_MULTIPLY:
+    return blitRows<BLEND_MULTIPLY>(dst, src, dx, dy, r, op);
+  case BLEND_ADD:
+    return blitRows<BLEND_ADD>(dst, src, dx, dy, r, op);
+  case BLEND_DIFFERENCE:
+    return blitRows<BLEND_DIFFERENCE>(dst, src, dx, dy, r, op);
+  case BLEND_OVERLAY:
+    return blitRows<BLEND_OVERLAY>(dst, src, dx, dy, r, op);
+  default:
+    return blitRows<BLEND_NORMAL>(dst, src, dx, dy, r, op);
+  }
+}
+
+// the whole of src
+void blit(ColorImage &dst, const ColorImage &src, int dx, int dy,
+          float opacity = 1.0f, int mode = BLEND_NORMAL) {
+  blit(dst, src, dx, dy, BlitRect{0, 0, src.GetWidth(), src.GetHeight()},
+       opacity, mode);
+}
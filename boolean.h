@@ -0,0 +1,752 @@
+#pragma once
+
+#include "parallel.h"
+#include "raster.h"
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+#include <deque>
+#include <memory>
+#include <queue>
+#include <set>
+#include <vector>
+
+// union, intersection, difference and xor of polygons, for merging
+// overlapping shapes before they are filled so overlaps are drawn once.
+//
+// a sweep line in the style of Martinez, Rueda and Feito: segment endpoints
+// are events ordered left to right, and the segments crossing the sweep line
+// are kept sorted bottom to top. whenever two segments become neighbours
+// they are tested for an intersection and split there, so at the end no two
+// segments cross. a segment's neighbour below tells whether the regions
+// under it are inside each polygon, which decides whether it is on the
+// result's boundary. the boundary segments are then linked into contours.
+//
+// inputs are lists of closed contours filled with the even-odd rule, like
+// drawPolygon. O((n + k) log n) for n vertices and k crossings
+
+typedef std::vector<std::vector<Point>> Contours;
+
+enum BooleanOp {
+  BOOLEAN_UNION,
+  BOOLEAN_INTERSECTION,
+  BOOLEAN_DIFFERENCE, // subject minus clip
+  BOOLEAN_XOR
+};
+
+namespace sweep {
+
+struct Vec2 {
+  double x, y;
+
+  bool operator==(const Vec2 &o) const { return x == o.x && y == o.y; }
+  bool operator!=(const Vec2 &o) const { return !(*this == o); }
+};
+
+// twice the signed area of the triangle, > 0 when counterclockwise
+inline double signedArea(Vec2 p0, Vec2 p1, Vec2 p2) {
+  return (p0.x - p2.x) * (p1.y - p2.y) - (p1.x - p2.x) * (p0.y - p2.y);
+}
+
+// p comes before q in sweep order: left to right, then bottom to top
+inline bool before(Vec2 p, Vec2 q) {
+  return p.x < q.x || (p.x == q.x && p.y < q.y);
+}
+
+// an edge of the input. split segments remember it, since their rounded
+// split points are slightly off its line
+struct InputEdge {
+  Vec2 from, to; // in sweep order
+};
+
+// the input edges of two segments lie on one line, so the segments overlap
+// wherever they meet. exact for float inputs: their differences and
+// products fit a double
+inline bool sameLine(const InputEdge *a, const InputEdge *b) {
+  return a == b || (signedArea(a->from, a->to, b->from) == 0 &&
+                    signedArea(a->from, a->to, b->to) == 0);
+}
+
+// how a segment that overlaps another one contributes
+enum EdgeType { EDGE_NORMAL, EDGE_NON_CONTRIBUTING, EDGE_SAME, EDGE_DIFFERENT };
+
+struct Event;
+struct SegmentLess {
+  bool operator()(const Event *a, const Event *b) const;
+};
+typedef std::multiset<Event *, SegmentLess> Status;
+
+// one endpoint of a segment
+struct Event {
+  Vec2 point;
+  Event *other;   // the segment's other endpoint
+  bool left;      // the segment lies to the right of point
+  bool subject;   // from the subject (else from the clip)
+  int contour;    // input contour, to order overlapping edges
+  const InputEdge *edge; // the input edge it is part of
+  int type = EDGE_NORMAL;
+  bool inOut = false;      // the region below is outside this polygon
+  bool otherInOut = false; // the region below is outside the other polygon
+  bool inResult = false;
+  bool inStatus = false;
+  Status::iterator position; // in the status while inStatus
+
+  bool isBelow(Vec2 p) const {
+    return left ? signedArea(point, other->point, p) > 0
+                : signedArea(other->point, point, p) > 0;
+  }
+
+  bool isAbove(Vec2 p) const { return !isBelow(p); }
+
+  bool isVertical() const { return point.x == other->point.x; }
+};
+
+// 1 if a is processed after b, -1 if before
+inline int compareEvents(const Event *a, const Event *b) {
+  if (a->point.x != b->point.x)
+    return a->point.x > b->point.x ? 1 : -1;
+  if (a->point.y != b->point.y)
+    return a->point.y > b->point.y ? 1 : -1;
+  // same point: right endpoints first, then the lower segment first
+  if (a->left != b->left)
+    return a->left ? 1 : -1;
+  if (signedArea(a->point, a->other->point, b->other->point) != 0 &&
+      !sameLine(a->edge, b->edge))
+    return a->isBelow(b->other->point) ? -1 : 1;
+  if (a->subject != b->subject)
+    return a->subject ? -1 : 1;
+  return a < b ? -1 : 1;
+}
+
+// -1 if segment a is below segment b on the sweep line
+inline int compareSegments(const Event *a, const Event *b) {
+  if (a == b)
+    return 0;
+  if ((signedArea(a->point, a->other->point, b->point) != 0 ||
+       signedArea(a->point, a->other->point, b->other->point) != 0) &&
+      !sameLine(a->edge, b->edge)) {
+    // not collinear. pieces of edges on one line count as collinear even
+    // once rounded split points move them slightly off it
+    if (a->point == b->point)
+      return a->isBelow(b->other->point) ? -1 : 1;
+    if (a->point.x == b->point.x)
+      return a->point.y < b->point.y ? -1 : 1;
+    // compare at the left end of whichever was inserted later
+    if (compareEvents(a, b) == 1)
+      return b->isAbove(a->point) ? -1 : 1;
+    return a->isBelow(b->point) ? -1 : 1;
+  }
+
+  // collinear
+  if (a->subject != b->subject)
+    return a->subject ? -1 : 1;
+  if (a->point == b->point) {
+    // overlapping edges of one polygon: any consistent order will do. exact
+    // copies are both kept, and cancel out under the even-odd rule
+    if (a->contour != b->contour)
+      return a->contour > b->contour ? 1 : -1;
+    return a < b ? -1 : 1;
+  }
+  return compareEvents(a, b) == 1 ? 1 : -1;
+}
+
+inline bool SegmentLess::operator()(const Event *a, const Event *b) const {
+  return compareSegments(a, b) < 0;
+}
+
+// the priority queue pops the first event, so "less" means "later"
+struct EventLater {
+  bool operator()(const Event *a, const Event *b) const {
+    return compareEvents(a, b) > 0;
+  }
+};
+
+// events are allocated in blocks and freed together when the sweep ends
+class EventArena {
+public:
+  Event *make(Vec2 point, bool left, Event *other, const Event &from) {
+    if (used == BLOCK) {
+      blocks.emplace_back(new Event[BLOCK]);
+      used = 0;
+    }
+    Event *e = &blocks.back()[used++];
+    *e = Event();
+    e->point = point;
+    e->left = left;
+    e->other = other;
+    e->subject = from.subject;
+    e->contour = from.contour;
+    e->edge = from.edge;
+    return e;
+  }
+
+private:
+  static const int BLOCK = 4096;
+  std::vector<std::unique_ptr<Event[]>> blocks;
+  int used = BLOCK;
+};
+
+typedef std::priority_queue<Event *, std::vector<Event *>, EventLater> Queue;
+
+class Sweep {
+public:
+  Sweep(int op) : op(op) {}
+
+  void addContours(const Contours &contours, bool subject) {
+    for (const std::vector<Point> &c : contours) {
+      Event from;
+      from.subject = subject;
+      from.contour = contourCount++;
+      for (size_t i = 0; i < c.size(); i++) {
+        Vec2 a = {c[i].x, c[i].y};
+        Vec2 b = {c[(i + 1) % c.size()].x, c[(i + 1) % c.size()].y};
+        if (a == b)
+          continue;
+        edges.push_back(before(a, b) ? InputEdge{a, b} : InputEdge{b, a});
+        from.edge = &edges.back();
+
+        Event *e1 = arena.make(a, false, nullptr, from);
+        Event *e2 = arena.make(b, false, e1, from);
+        e1->other = e2;
+        (before(a, b) ? e1 : e2)->left = true;
+        initial.push_back(e1);
+        initial.push_back(e2);
+
+        Bounds &box = subject ? subjectBox : clipBox;
+        box.add(a);
+        box.add(b);
+      }
+    }
+  }
+
+  // the result's boundary as segments
+  void run(std::vector<std::pair<Vec2, Vec2>> &segments) {
+    // past the end of either input nothing more can be in an intersection,
+    // past the subject nothing more can be in a difference
+    double stopX = 1e300;
+    if (op == BOOLEAN_INTERSECTION)
+      stopX = std::min(subjectBox.maxX, clipBox.maxX);
+    else if (op == BOOLEAN_DIFFERENCE)
+      stopX = subjectBox.maxX;
+
+    // the input's events are sorted once; only those made by splitting
+    // segments go through the queue
+    std::sort(initial.begin(), initial.end(),
+              [](const Event *a, const Event *b) {
+                return compareEvents(a, b) < 0;
+              });
+    size_t next = 0;
+    std::vector<Event *> inserted;
+    while (next < initial.size() || !queue.empty()) {
+      Event *e;
+      if (next < initial.size() &&
+          (queue.empty() || compareEvents(initial[next], queue.top()) < 0)) {
+        e = initial[next++];
+      } else {
+        e = queue.top();
+        queue.pop();
+      }
+      if (e->point.x > stopX)
+        break;
+      if (!e->left)
+        remove(e->other);
+      else if (insert(e))
+        inserted.push_back(e);
+      else
+        queue.push(e); // again once what runs through its left end is split
+      settleSplits();
+    }
+
+    for (Event *e : inserted)
+      if (e->inResult)
+        segments.push_back({e->point, e->other->point});
+  }
+
+private:
+  struct Bounds {
+    double maxX = -1e300;
+    void add(Vec2 p) { maxX = std::max(maxX, p.x); }
+  };
+
+  // place left event e in the status. false if a segment running through
+  // its left end (a vertex on an edge) had to be split there first, and e
+  // must wait until the first half has left
+  bool insert(Event *e) {
+    e->position = status.insert(e);
+    e->inStatus = true;
+    Event *prev = below(e), *next = above(e);
+    bool throughPrev = passesThrough(prev, e->point);
+    if (passesThrough(next, e->point) | throughPrev) {
+      status.erase(e->position);
+      e->inStatus = false;
+      return false;
+    }
+
+    computeFields(e, prev);
+    if (next && meet(e, next))
+      return true;
+    if (prev)
+      meet(prev, e);
+    return true;
+  }
+
+  void remove(Event *l) {
+    if (!l->inStatus)
+      return;
+    Event *prev = below(l), *next = above(l);
+    status.erase(l->position);
+    l->inStatus = false;
+    if (prev && next)
+      meet(prev, next);
+  }
+
+  // possibleIntersection of neighbours low and high, and what its result
+  // needs. true if they cancelled out and left the status
+  bool meet(Event *low, Event *high) {
+    int m = possibleIntersection(low, high);
+    if (m == MEET_CANCEL) {
+      cancelPair(low, high);
+      return true;
+    }
+    if (m == MEET_SHARED_START) {
+      computeFields(low, below(low));
+      computeFields(high, low);
+    }
+    return false;
+  }
+
+  // a segment split while in the status can become an exact copy of a
+  // neighbour that was compared with it before, when it was longer
+  void settleSplits() {
+    while (!splitInStatus.empty()) {
+      Event *t = splitInStatus.back();
+      splitInStatus.pop_back();
+      if (!t->inStatus)
+        continue;
+      auto same = [&](const Event *n) {
+        return n && n->point == t->point && n->other->point == t->other->point;
+      };
+      Event *n = above(t);
+      if (same(n) && n->type == EDGE_NORMAL && t->type == EDGE_NORMAL) {
+        meet(t, n);
+        continue;
+      }
+      n = below(t);
+      if (same(n) && n->type == EDGE_NORMAL && t->type == EDGE_NORMAL)
+        meet(n, t);
+    }
+  }
+
+  Event *below(Event *e) {
+    if (e->position == status.begin())
+      return nullptr;
+    return *std::prev(e->position);
+  }
+
+  Event *above(Event *e) {
+    Status::iterator next = std::next(e->position);
+    return next == status.end() ? nullptr : *next;
+  }
+
+  // split t at p if p lies inside it, up to the rounding of t's ends
+  bool passesThrough(Event *t, Vec2 p) {
+    if (!t || !before(t->point, p) || !before(p, t->other->point))
+      return false;
+    Vec2 d = {t->other->point.x - t->point.x, t->other->point.y - t->point.y};
+    double area = std::fabs(signedArea(t->point, t->other->point, p));
+    if (area > snapTolerance(p) * std::sqrt(d.x * d.x + d.y * d.y))
+      return false;
+    divideWithTwins(t, p);
+    return true;
+  }
+
+  bool inResult(const Event *e) const {
+    switch (e->type) {
+    case EDGE_NORMAL:
+      switch (op) {
+      case BOOLEAN_INTERSECTION:
+        return !e->otherInOut;
+      case BOOLEAN_UNION:
+        return e->otherInOut;
+      case BOOLEAN_DIFFERENCE:
+        return e->subject == e->otherInOut;
+      default:
+        return true;
+      }
+    case EDGE_SAME:
+      return op == BOOLEAN_INTERSECTION || op == BOOLEAN_UNION;
+    case EDGE_DIFFERENT:
+      return op == BOOLEAN_DIFFERENCE;
+    default:
+      return false;
+    }
+  }
+
+  // inside/outside flags of the regions below e, from the segment below it
+  void computeFields(Event *e, const Event *prev) {
+    if (!prev) {
+      e->inOut = false;
+      e->otherInOut = true;
+    } else if (e->subject == prev->subject) {
+      e->inOut = !prev->inOut;
+      e->otherInOut = prev->otherInOut;
+    } else {
+      e->inOut = !prev->otherInOut;
+      e->otherInOut = prev->isVertical() ? !prev->inOut : prev->inOut;
+    }
+    e->inResult = inResult(e);
+  }
+
+  // split the segment of left event e at p, which lies inside it
+  void divideSegment(Event *e, Vec2 p) {
+    Event *r = arena.make(p, false, e, *e);
+    Event *l = arena.make(p, true, e->other, *e);
+    // rounding can put p past the right end; keep the halves left to right
+    if (compareEvents(l, e->other) > 0) {
+      e->other->left = true;
+      l->left = false;
+    }
+    e->other->other = l;
+    e->other = r;
+    queue.push(l);
+    queue.push(r);
+    if (e->inStatus)
+      splitInStatus.push_back(e);
+  }
+
+  // split e at p unless p is an endpoint, along with the collinear segments
+  // next to it in the status that also pass through p. otherwise a copy of
+  // e is only split later, against the rounded halves of what crossed it
+  void divideWithTwins(Event *e, Vec2 p) {
+    if (e->point == p || e->other->point == p)
+      return;
+    auto passes = [&](const Event *t) {
+      return sameLine(t->edge, e->edge) && before(t->point, p) &&
+             before(p, t->other->point);
+    };
+
+    std::vector<Event *> &twins = twinScratch;
+    twins.clear();
+    if (e->inStatus) {
+      for (Status::iterator i = e->position; i != status.begin();) {
+        Event *t = *--i;
+        if (!passes(t))
+          break;
+        twins.push_back(t);
+      }
+      for (Status::iterator i = std::next(e->position); i != status.end();
+           ++i) {
+        if (!passes(*i))
+          break;
+        twins.push_back(*i);
+      }
+    }
+    divideSegment(e, p);
+    for (Event *t : twins)
+      divideSegment(t, p);
+  }
+
+  // points this close are the same point moved by rounding: a few steps of
+  // float precision, which all the points are rounded to
+  static double snapTolerance(Vec2 p) {
+    return 4 * FLT_EPSILON * (std::fabs(p.x) + std::fabs(p.y) + 1);
+  }
+
+  // where lines u0-u1 and v0-v1 cross, rounded to float like the inputs,
+  // so crossings that land on a representable point (as on grid aligned
+  // shapes) come out exact, and three edges through one point meet there.
+  // false for parallel lines
+  static bool crossLines(std::pair<Vec2, Vec2> u, std::pair<Vec2, Vec2> v,
+                         Vec2 &p) {
+    Vec2 vu = {u.second.x - u.first.x, u.second.y - u.first.y};
+    Vec2 vv = {v.second.x - v.first.x, v.second.y - v.first.y};
+    double kross = vu.x * vv.y - vu.y * vv.x;
+    if (kross == 0)
+      return false;
+    double s = ((v.first.x - u.first.x) * vv.y -
+                (v.first.y - u.first.y) * vv.x) / kross;
+    p = {(float)(u.first.x + s * vu.x), (float)(u.first.y + s * vu.y)};
+    // a crossing on a horizontal or vertical edge stays exactly on it
+    if (vu.y == 0 || vv.y == 0)
+      p.y = vu.y == 0 ? u.first.y : v.first.y;
+    if (vu.x == 0 || vv.x == 0)
+      p.x = vu.x == 0 ? u.first.x : v.first.x;
+    return true;
+  }
+
+  // 0, 1 or 2 points where segments a0-a1 and b0-b1 meet (2 when they
+  // overlap). a crossing is where the input edges u and v the segments are
+  // pieces of cross, and within rounding error of an endpoint it is moved
+  // onto it, so a third edge crossing two copies of an edge splits both at
+  // the same point and they stay exact copies
+  static int intersect(Vec2 a0, Vec2 a1, Vec2 b0, Vec2 b1,
+                       std::pair<Vec2, Vec2> u, std::pair<Vec2, Vec2> v,
+                       Vec2 out[2]) {
+    Vec2 va = {a1.x - a0.x, a1.y - a0.y}, vb = {b1.x - b0.x, b1.y - b0.y};
+    Vec2 e = {b0.x - a0.x, b0.y - a0.y};
+    double kross = va.x * vb.y - va.y * vb.x;
+
+    if (kross != 0) {
+      double s = (e.x * vb.y - e.y * vb.x) / kross;
+      double t = (e.x * va.y - e.y * va.x) / kross;
+      // ends moved by rounding can make a touch look like a near miss, so
+      // slightly outside counts when it snaps onto an endpoint
+      const double slack = 1e-6;
+      if (s < -slack || s > 1 + slack || t < -slack || t > 1 + slack)
+        return 0;
+      Vec2 p;
+      if (!crossLines(u, v, p))
+        crossLines({a0, a1}, {b0, b1}, p);
+      double tolerance = snapTolerance(p);
+      bool snapped = false;
+      for (Vec2 q : {a0, a1, b0, b1})
+        if (std::fabs(q.x - p.x) <= tolerance &&
+            std::fabs(q.y - p.y) <= tolerance) {
+          p = q;
+          snapped = true;
+        }
+      if (!snapped && (s < 0 || s > 1 || t < 0 || t > 1))
+        return 0;
+      out[0] = p;
+      return 1;
+    }
+
+    // parallel: overlapping only if collinear. the overlap's ends are
+    // endpoints of one or the other
+    if (e.x * va.y - e.y * va.x != 0)
+      return 0;
+    double lenA = va.x * va.x + va.y * va.y;
+    double sa = (va.x * e.x + va.y * e.y) / lenA;
+    double sb = sa + (va.x * vb.x + va.y * vb.y) / lenA;
+    double smin = std::min(sa, sb), smax = std::max(sa, sb);
+    if (smin > 1 || smax < 0)
+      return 0;
+    if (smin == 1) {
+      out[0] = a1;
+      return 1;
+    }
+    if (smax == 0) {
+      out[0] = a0;
+      return 1;
+    }
+    out[0] = smin > 0 ? (sa < sb ? b0 : b1) : a0;
+    out[1] = smax < 1 ? (sa < sb ? b1 : b0) : a1;
+    return 2;
+  }
+
+  // what possibleIntersection did to two neighbouring segments
+  enum Meet {
+    MEET_NONE,
+    MEET_SPLIT,        // split where they cross or overlap
+    MEET_SHARED_START, // overlap from a shared left end: recompute fields
+    MEET_CANCEL        // equal pieces of one polygon: remove both
+  };
+
+  // split the segments of left events a and b, a below b, where they meet
+  int possibleIntersection(Event *a, Event *b) {
+    Vec2 p[2];
+    int n;
+    if (sameLine(a->edge, b->edge))
+      // pieces of one line overlap unless one ends where the other starts
+      n = before(a->point, b->other->point) && before(b->point, a->other->point)
+              ? 2
+              : 0;
+    else {
+      // crossings come from the input edges, not from pieces whose ends
+      // were already rounded, so error does not build up as edges split
+      // and the same two edges always cross at the same point
+      const InputEdge *ea = a->edge, *eb = b->edge;
+      bool aFirst = before(ea->from, eb->from) ||
+                    (ea->from == eb->from && before(ea->to, eb->to));
+      const InputEdge *u = aFirst ? a->edge : b->edge;
+      const InputEdge *v = aFirst ? b->edge : a->edge;
+      n = intersect(a->point, a->other->point, b->point, b->other->point,
+                    {u->from, u->to}, {v->from, v->to}, p);
+    }
+    if (n == 0)
+      return MEET_NONE;
+    if (n == 1 && (a->point == b->point || a->other->point == b->other->point))
+      return MEET_NONE;
+
+    if (n == 1) {
+      divideWithTwins(a, p[0]);
+      divideWithTwins(b, p[0]);
+      return MEET_SPLIT;
+    }
+
+    // overlapping: order the four endpoints
+    Event *ev[4];
+    int count = 0;
+    bool leftCoincide = a->point == b->point;
+    bool rightCoincide = a->other->point == b->other->point;
+    if (!leftCoincide) {
+      bool aLater = compareEvents(a, b) == 1;
+      ev[count++] = aLater ? b : a;
+      ev[count++] = aLater ? a : b;
+    }
+    if (!rightCoincide) {
+      bool aLater = compareEvents(a->other, b->other) == 1;
+      ev[count++] = aLater ? b->other : a->other;
+      ev[count++] = aLater ? a->other : b->other;
+    }
+
+    if (leftCoincide) {
+      if (!rightCoincide)
+        divideSegment(ev[1]->other, ev[0]->point);
+      // a polygon overlapping itself: the shared part cancels out
+      if (a->subject == b->subject)
+        return MEET_CANCEL;
+      // the shared part is drawn once, from a
+      b->type = EDGE_NON_CONTRIBUTING;
+      a->type = b->inOut == a->inOut ? EDGE_SAME : EDGE_DIFFERENT;
+      return MEET_SHARED_START;
+    }
+    if (rightCoincide) {
+      divideSegment(ev[0], ev[1]->point);
+      return MEET_SPLIT;
+    }
+    if (ev[0] != ev[3]->other) {
+      // partial overlap
+      divideSegment(ev[0], ev[1]->point);
+      divideSegment(ev[1], ev[2]->point);
+      return MEET_SPLIT;
+    }
+    // one contains the other
+    divideSegment(ev[0], ev[1]->point);
+    divideSegment(ev[3]->other, ev[2]->point);
+    return MEET_SPLIT;
+  }
+
+  // two equal pieces of one polygon, low just below high, cancel under the
+  // even-odd rule. both leave the status, and a piece of the other polygon
+  // that was marked as overlapping one of them is counted on its own again
+  void cancelPair(Event *low, Event *high) {
+    Event *prev = below(low), *next = above(high);
+    for (Event *e : {low, high}) {
+      status.erase(e->position);
+      e->inStatus = false;
+      e->type = EDGE_NON_CONTRIBUTING;
+      e->inResult = false;
+    }
+    for (Event *t : {prev, next})
+      if (t && t->type != EDGE_NORMAL && t->point == low->point &&
+          sameLine(t->edge, low->edge)) {
+        t->type = EDGE_NORMAL;
+        computeFields(t, below(t));
+      }
+    if (prev && next)
+      meet(prev, next);
+  }
+
+  int op;
+  int contourCount = 0;
+  std::deque<InputEdge> edges; // events point into it
+  EventArena arena;
+  std::vector<Event *> initial;
+  Queue queue;
+  Status status;
+  Bounds subjectBox, clipBox;
+  std::vector<Event *> twinScratch;
+  std::vector<Event *> splitInStatus;
+};
+
+// join segments that share endpoints into closed contours. any pairing at a
+// vertex where several meet gives the same even-odd fill
+inline Contours linkSegments(const std::vector<std::pair<Vec2, Vec2>> &segs) {
+  // end 2 * i is the first point of segment i, 2 * i + 1 its second. sorted,
+  // the ends at one point sit next to each other
+  auto point = [&](int end) {
+    return end & 1 ? segs[end >> 1].second : segs[end >> 1].first;
+  };
+  int ends = (int)segs.size() * 2;
+  std::vector<int> order(ends), slot(ends);
+  for (int i = 0; i < ends; i++)
+    order[i] = i;
+  std::sort(order.begin(), order.end(),
+            [&](int a, int b) { return before(point(a), point(b)); });
+  for (int i = 0; i < ends; i++)
+    slot[order[i]] = i;
+
+  std::vector<bool> used(segs.size(), false);
+  // an end of an unused segment at the same point as end, or -1
+  auto unusedAt = [&](int end) {
+    Vec2 p = point(end);
+    for (int i = slot[end] + 1; i < ends && point(order[i]) == p; i++)
+      if (!used[order[i] >> 1])
+        return order[i];
+    for (int i = slot[end] - 1; i >= 0 && point(order[i]) == p; i--)
+      if (!used[order[i] >> 1])
+        return order[i];
+    return -1;
+  };
+
+  Contours out;
+  for (int start = 0; start < (int)segs.size(); start++) {
+    if (used[start])
+      continue;
+    std::vector<Point> contour;
+    Vec2 first = segs[start].first;
+    used[start] = true;
+    contour.push_back({(float)first.x, (float)first.y});
+    for (int end = 2 * start + 1; point(end) != first;) {
+      Vec2 p = point(end);
+      contour.push_back({(float)p.x, (float)p.y});
+      int next = unusedAt(end);
+      if (next < 0)
+        break; // open chain from rounding, close it as is
+      used[next >> 1] = true;
+      end = next ^ 1;
+    }
+    if (contour.size() >= 3)
+      out.push_back(std::move(contour));
+  }
+  return out;
+}
+
+} // namespace sweep
+
+// subject op clip, both even-odd contour lists
+Contours polygonBoolean(const Contours &subject, const Contours &clip,
+                        int op) {
+  sweep::Sweep s(op);
+  s.addContours(subject, true);
+  s.addContours(clip, false);
+  std::vector<std::pair<sweep::Vec2, sweep::Vec2>> segments;
+  s.run(segments);
+  return sweep::linkSegments(segments);
+}
+
+// union of many shapes, which may overlap each other, merged pairwise in a
+// balanced tree with each level's merges in parallel
+Contours polygonUnion(std::vector<Contours> shapes) {
+  if (shapes.empty())
+    return Contours();
+  while (shapes.size() > 1) {
+    size_t pairs = shapes.size() / 2;
+    std::vector<Contours> merged(pairs);
+    ParallelFor((int)pairs, HardwareThreads(), [&](int i) {
+      merged[i] =
+          polygonBoolean(shapes[2 * i], shapes[2 * i + 1], BOOLEAN_UNION);
+    });
+    if (shapes.size() % 2)
+      merged.push_back(std::move(shapes.back()));
+    shapes = std::move(merged);
+  }
+  return shapes[0];
+}
+
+// all contours as one vertex list for drawPolygon. contours are joined by
+// bridges walked once each way, which cancel under the even-odd rule
+std::vector<Point> joinContours(const Contours &contours) {
+  std::vector<Point> out;
+  for (const std::vector<Point> &c : contours) {
+    if (c.empty())
+      continue;
+    Point anchor = out.empty() ? c[0] : out[0];
+    out.insert(out.end(), c.begin(), c.end());
+    out.push_back(c[0]);
+    if (!(anchor.x == c[0].x && anchor.y == c[0].y))
+      out.push_back(anchor);
+  }
+  return out;
+}
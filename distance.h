@@ -0,0 +1,195 @@
+#pragma once
+
+#include "image.h"
+#include "parallel.h"
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+// Euclidean distance transforms of masks, for glows, outlines and distance
+// field generation.
+//
+// Exact in linear time (Felzenszwalb and Huttenlocher): the squared distance
+// is separable, so a 1D transform (the lower envelope of parabolas rooted at
+// every pixel) runs along every row, and then along every column. Columns
+// are done as rows of the transposed image, so both passes stream through
+// memory. The transposes go in 32 x 32 tiles so reads and writes both stay
+// in cache, and every pass is split across threads.
+
+// One float per pixel
+class FloatImage {
+public:
+
+	FloatImage() :
+		width(0), height(0) { }
+
+	FloatImage(int width, int height, float value = 0) :
+		width(width), height(height), data((size_t)width * height, value) { }
+
+	float &operator()(int x, int y) {
+		return data[x + (size_t)y * width];
+	}
+
+	float operator()(int x, int y) const {
+		return data[x + (size_t)y * width];
+	}
+
+	int GetWidth() const { return width; }
+
+	int GetHeight() const { return height; }
+
+	float *Row(int y) { return data.data() + (size_t)y * width; }
+
+	const float *Row(int y) const { return data.data() + (size_t)y * width; }
+
+private:
+	int width, height;
+	std::vector<float> data;
+};
+
+// Squared distance standing in for "no feature pixel at all"
+const float EDT_INFINITY = 1e20f;
+
+// Rows per task in the parallel passes
+const int EDT_BAND_ROWS = 16;
+
+// 1D squared distance transform of f (n values) into d. v and z are scratch
+// of n and n + 1 entries.
+void DistanceTransform1D(const float *f, float *d, int n, int *v, float *z) {
+	if (n <= 0) return;
+	int k = 0;
+	v[0] = 0;
+	z[0] = -EDT_INFINITY;
+	z[1] = EDT_INFINITY;
+	for (int q = 1; q < n; q++) {
+		// Drop the parabolas the new one hides, then add it to the envelope.
+		// z[0] is far enough below any intersection that this stops at k = 0
+		float fq = f[q] + (float)q * q;
+		float s = (fq - (f[v[k]] + (float)v[k] * v[k])) / (2.0f * (q - v[k]));
+		while (s <= z[k]) {
+			k--;
+			s = (fq - (f[v[k]] + (float)v[k] * v[k])) / (2.0f * (q - v[k]));
+		}
+		k++;
+		v[k] = q;
+		z[k] = s;
+		z[k + 1] = EDT_INFINITY;
+	}
+
+	k = 0;
+	for (int q = 0; q < n; q++) {
+		while (z[k + 1] < q) k++;
+		float dq = (float)(q - v[k]);
+		d[q] = dq * dq + f[v[k]];
+	}
+}
+
+// Transform every row of im in place, rows in parallel
+void DistanceTransformRows(FloatImage &im) {
+	int w = im.GetWidth(), h = im.GetHeight();
+	int bands = (h + EDT_BAND_ROWS - 1) / EDT_BAND_ROWS;
+	ParallelFor(bands, HardwareThreads(), [&](int b) {
+		std::vector<float> line(w), z(w + 1);
+		std::vector<int> v(w);
+		for (int y = b * EDT_BAND_ROWS; y < std::min(h, (b + 1) * EDT_BAND_ROWS); y++) {
+			std::copy(im.Row(y), im.Row(y) + w, line.begin());
+			DistanceTransform1D(line.data(), im.Row(y), w, v.data(), z.data());
+		}
+	});
+}
+
+// out becomes the transpose of in, 32 x 32 tiles at a time
+void Transpose(const FloatImage &in, FloatImage &out) {
+	const int TILE = 32;
+	int w = in.GetWidth(), h = in.GetHeight();
+	if (out.GetWidth() != h || out.GetHeight() != w) out = FloatImage(h, w);
+
+	int tileRows = (h + TILE - 1) / TILE;
+	ParallelFor(tileRows, HardwareThreads(), [&](int t) {
+		int y0 = t * TILE, y1 = std::min(h, y0 + TILE);
+		for (int x0 = 0; x0 < w; x0 += TILE) {
+			int x1 = std::min(w, x0 + TILE);
+			for (int y = y0; y < y1; y++) {
+				const float *src = in.Row(y);
+				for (int x = x0; x < x1; x++) {
+					out(y, x) = src[x];
+				}
+			}
+		}
+	});
+}
+
+// Squared distance from every pixel to the nearest pixel where feature is
+// true, EDT_INFINITY or more if there is none
+template <typename FeatureFn>
+FloatImage SquaredDistanceTransform(int width, int height, FeatureFn feature) {
+	FloatImage f(width, height), t;
+	if (width <= 0 || height <= 0) return f;
+	ParallelFor(height, HardwareThreads(), [&](int y) {
+		float *row = f.Row(y);
+		for (int x = 0; x < width; x++) {
+			row[x] = feature(x, y) ? 0 : EDT_INFINITY;
+		}
+	});
+
+	DistanceTransformRows(f);
+	Transpose(f, t);
+	DistanceTransformRows(t);
+	Transpose(t, f);
+	return f;
+}
+
+// Distance in pixels from every pixel to the nearest one at or above the
+// threshold; 0 on those pixels, infinite if the mask has none
+FloatImage DistanceTransform(const GrayscaleImage &mask, Byte threshold = 128) {
+	FloatImage d = SquaredDistanceTransform(mask.GetWidth(), mask.GetHeight(),
+		[&](int x, int y) { return mask.Row(y)[x] >= threshold; });
+
+	ParallelFor(d.GetHeight(), HardwareThreads(), [&](int y) {
+		float *row = d.Row(y);
+		for (int x = 0; x < d.GetWidth(); x++) {
+			row[x] = row[x] >= EDT_INFINITY ? INFINITY : std::sqrt(row[x]);
+		}
+	});
+	return d;
+}
+
+// Signed distance to the mask's outline in pixels: negative inside (at or
+// above the threshold), positive outside. The outline is taken halfway
+// between inside and outside pixel centers, so a pixel next to the edge is
+// -0.5 or 0.5 like a distance field for coverage
+FloatImage SignedDistanceTransform(const GrayscaleImage &mask, Byte threshold = 128) {
+	int w = mask.GetWidth(), h = mask.GetHeight();
+	FloatImage toInside = SquaredDistanceTransform(w, h,
+		[&](int x, int y) { return mask.Row(y)[x] >= threshold; });
+	FloatImage toOutside = SquaredDistanceTransform(w, h,
+		[&](int x, int y) { return mask.Row(y)[x] < threshold; });
+
+	ParallelFor(h, HardwareThreads(), [&](int y) {
+		float *in = toInside.Row(y);
+		const float *out = toOutside.Row(y);
+		for (int x = 0; x < w; x++) {
+			if (in[x] > 0) {
+				in[x] = in[x] >= EDT_INFINITY ? INFINITY : std::sqrt(in[x]) - 0.5f;
+			}
+			else {
+				in[x] = out[x] >= EDT_INFINITY ? -INFINITY : 0.5f - std::sqrt(out[x]);
+			}
+		}
+	});
+	return toInside;
+}
+
+// 8 bit image of scale * d + offset, clamped to 0-255
+GrayscaleImage ToGrayscaleImage(const FloatImage &d, float scale = 1, float offset = 0) {
+	GrayscaleImage out(d.GetWidth(), d.GetHeight());
+	ParallelFor(d.GetHeight(), HardwareThreads(), [&](int y) {
+		const float *row = d.Row(y);
+		Byte *dst = out.Row(y);
+		for (int x = 0; x < d.GetWidth(); x++) {
+			float v = row[x] * scale + offset;
+			dst[x] = v <= 0 ? 0 : v >= 255 ? 255 : (Byte)(v + 0.5f);
+		}
+	});
+	return out;
+}
@@ -0,0 +1,299 @@
+#pragma once
+
+#include <algorithm>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <string>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// Streaming XXH64 (https://github.com/Cyan4973/xxHash). Feed bytes with
+// Update in any number of pieces, the digest only depends on the bytes.
+class Hasher64 {
+public:
+
+	Hasher64(uint64_t seed = 0) : seed(seed), total(0), buffered(0) {
+		acc[0] = seed + PRIME1 + PRIME2;
+		acc[1] = seed + PRIME2;
+		acc[2] = seed;
+		acc[3] = seed - PRIME1;
+	}
+
+	void Update(const void *data, size_t length) {
+		const unsigned char *p = (const unsigned char*)data;
+		const unsigned char *end = p + length;
+		total += length;
+
+		// Top up a partial stripe left over from the previous call
+		if (buffered > 0) {
+			size_t take = std::min(length, 32 - buffered);
+			memcpy(buffer + buffered, p, take);
+			buffered += take;
+			p += take;
+			if (buffered < 32) return;
+			Stripe(buffer);
+			buffered = 0;
+		}
+
+		while (end - p >= 32) {
+			Stripe(p);
+			p += 32;
+		}
+
+		memcpy(buffer, p, end - p);
+		buffered = end - p;
+	}
+
+	void Update(const std::string &s) { Update(s.data(), s.size()); }
+
+	uint64_t Digest() const {
+		uint64_t h;
+		if (total >= 32) {
+			h = Rotl(acc[0], 1) + Rotl(acc[1], 7) + Rotl(acc[2], 12) + Rotl(acc[3], 18);
+			for (int i = 0; i < 4; i++) {
+				h ^= Round(0, acc[i]);
+				h = h * PRIME1 + PRIME4;
+			}
+		}
+		else {
+			h = seed + PRIME5;
+		}
+		h += total;
+
+		const unsigned char *p = buffer;
+		size_t left = buffered;
+		for (; left >= 8; p += 8, left -= 8) {
+			h ^= Round(0, Read64(p));
+			h = Rotl(h, 27) * PRIME1 + PRIME4;
+		}
+		if (left >= 4) {
+			uint32_t k;
+			memcpy(&k, p, 4);
+			h ^= k * PRIME1;
+			h = Rotl(h, 23) * PRIME2 + PRIME3;
+			p += 4;
+			left -= 4;
+		}
+		for (; left > 0; p++, left--) {
+			h ^= *p * PRIME5;
+			h = Rotl(h, 11) * PRIME1;
+		}
+
+		h ^= h >> 33;
+		h *= PRIME2;
+		h ^= h >> 29;
+		h *= PRIME3;
+		h ^= h >> 32;
+		return h;
+	}
+
+private:
+	static const uint64_t PRIME1 = 0x9E3779B185EBCA87ULL;
+	static const uint64_t PRIME2 = 0xC2B2AE3D27D4EB4FULL;
+	static const uint64_t PRIME3 = 0x165667B19E3779F9ULL;
+	static const uint64_t PRIME4 = 0x85EBCA77C2B2AE63ULL;
+	static const uint64_t PRIME5 = 0x27D4EB2F165667C5ULL;
+
+	static uint64_t Rotl(uint64_t x, int r) { return (x << r) | (x >> (64 - r)); }
+
+	static uint64_t Read64(const unsigned char *p) {
+		uint64_t v;
+		memcpy(&v, p, 8);
+		return v;
+	}
+
+	static uint64_t Round(uint64_t acc, uint64_t input) {
+		acc += input * PRIME2;
+		acc = Rotl(acc, 31);
+		return acc * PRIME1;
+	}
+
+	// The four lanes are independent, which lets the compiler keep them in
+	// separate registers and overlap the multiplies.
+	void Stripe(const unsigned char *p) {
+		acc[0] = Round(acc[0], Read64(p));
+		acc[1] = Round(acc[1], Read64(p + 8));
+		acc[2] = Round(acc[2], Read64(p + 16));
+		acc[3] = Round(acc[3], Read64(p + 24));
+	}
+
+	uint64_t seed;
+	uint64_t acc[4];
+	uint64_t total;
+	unsigned char buffer[32];
+	size_t buffered;
+};
+
+// Wide streaming hash for bulk data, built like XXH3's long input loop:
+// eight 64 bit lanes take a 64 byte stripe at a time with one 32x32->64
+// multiply each, which SSE2 does two lanes per instruction. Every 16
+// stripes the lanes are scrambled so they cannot drift into a weak state,
+// and the digest runs the lanes and the unprocessed tail through XXH64. The
+// SSE2 and plain paths give identical digests.
+class StripeHasher64 {
+public:
+
+	StripeHasher64(uint64_t seed = 0) : seed(seed), total(0), stripe(0), buffered(0) {
+		// Per seed keys, from splitmix64 so nearby seeds share nothing
+		uint64_t x = seed;
+		for (int i = 0; i < KEYS; i++) {
+			uint64_t z = (x += 0x9E3779B97F4A7C15ULL);
+			z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+			z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+			keys[i] = z ^ (z >> 31);
+		}
+		static const uint64_t init[LANES] = {
+			0xC2B2AE3DULL, 0x9E3779B185EBCA87ULL, 0xC2B2AE3D27D4EB4FULL, 0x165667B19E3779F9ULL,
+			0x85EBCA77C2B2AE63ULL, 0x85EBCA77ULL, 0x27D4EB2F165667C5ULL, 0x9E3779B1ULL
+		};
+		memcpy(acc, init, sizeof(acc));
+	}
+
+	void Update(const void *data, size_t length) {
+		const unsigned char *p = (const unsigned char*)data;
+		const unsigned char *end = p + length;
+		total += length;
+
+		// Top up a partial stripe left over from the previous call
+		if (buffered > 0) {
+			size_t take = std::min(length, STRIPE - buffered);
+			memcpy(buffer + buffered, p, take);
+			buffered += take;
+			p += take;
+			if (buffered < STRIPE) return;
+			Stripes(buffer, 1);
+			buffered = 0;
+		}
+
+		size_t whole = (end - p) / STRIPE;
+		Stripes(p, whole);
+		p += whole * STRIPE;
+
+		memcpy(buffer, p, end - p);
+		buffered = end - p;
+	}
+
+	uint64_t Digest() const {
+		Hasher64 h(seed);
+		h.Update(acc, sizeof(acc));
+		h.Update(&total, sizeof(total));
+		h.Update(buffer, buffered);
+		return h.Digest();
+	}
+
+private:
+	static constexpr int LANES = 8;
+	static constexpr size_t STRIPE = LANES * 8;
+	static constexpr int BLOCK_STRIPES = 16;
+	// Stripe s of a block uses keys [s, s + 8), the scramble the last 8
+	static constexpr int KEYS = BLOCK_STRIPES - 1 + 2 * LANES;
+	static constexpr uint64_t SCRAMBLE_PRIME = 0x9E3779B1ULL;
+
+	void Stripes(const unsigned char *p, size_t count) {
+		while (count > 0) {
+			size_t n = std::min(count, (size_t)(BLOCK_STRIPES - stripe));
+			Accumulate(p, n);
+			p += n * STRIPE;
+			count -= n;
+			stripe += (int)n;
+			if (stripe == BLOCK_STRIPES) {
+				Scramble();
+				stripe = 0;
+			}
+		}
+	}
+
+#ifdef __SSE2__
+	void Accumulate(const unsigned char *p, size_t n) {
+		__m128i a[LANES / 2];
+		for (int j = 0; j < LANES / 2; j++) a[j] = _mm_loadu_si128((const __m128i*)(acc + 2 * j));
+		for (size_t s = 0; s < n; s++, p += STRIPE) {
+			const uint64_t *key = keys + stripe + s;
+			for (int j = 0; j < LANES / 2; j++) {
+				__m128i d = _mm_loadu_si128((const __m128i*)(p + 16 * j));
+				__m128i k = _mm_xor_si128(d, _mm_loadu_si128((const __m128i*)(key + 2 * j)));
+				// Low half of each key lane times its high half
+				__m128i product = _mm_mul_epu32(k, _mm_shuffle_epi32(k, _MM_SHUFFLE(0, 3, 0, 1)));
+				// Each lane also gets its neighbour's input added in
+				__m128i swapped = _mm_shuffle_epi32(d, _MM_SHUFFLE(1, 0, 3, 2));
+				a[j] = _mm_add_epi64(a[j], _mm_add_epi64(product, swapped));
+			}
+		}
+		for (int j = 0; j < LANES / 2; j++) _mm_storeu_si128((__m128i*)(acc + 2 * j), a[j]);
+	}
+
+	void Scramble() {
+		const __m128i prime = _mm_set1_epi32((int)SCRAMBLE_PRIME);
+		const uint64_t *key = keys + BLOCK_STRIPES - 1 + LANES;
+		for (int j = 0; j < LANES / 2; j++) {
+			__m128i a = _mm_loadu_si128((const __m128i*)(acc + 2 * j));
+			a = _mm_xor_si128(a, _mm_srli_epi64(a, 47));
+			a = _mm_xor_si128(a, _mm_loadu_si128((const __m128i*)(key + 2 * j)));
+			// 64 bit times 32 bit from two 32x32->64 multiplies
+			__m128i lo = _mm_mul_epu32(a, prime);
+			__m128i hi = _mm_mul_epu32(_mm_srli_epi64(a, 32), prime);
+			_mm_storeu_si128((__m128i*)(acc + 2 * j), _mm_add_epi64(lo, _mm_slli_epi64(hi, 32)));
+		}
+	}
+#else
+	void Accumulate(const unsigned char *p, size_t n) {
+		for (size_t s = 0; s < n; s++, p += STRIPE) {
+			const uint64_t *key = keys + stripe + s;
+			for (int i = 0; i < LANES; i++) {
+				uint64_t d;
+				memcpy(&d, p + 8 * i, 8);
+				uint64_t k = d ^ key[i];
+				acc[i ^ 1] += d;
+				acc[i] += (k & 0xFFFFFFFF) * (k >> 32);
+			}
+		}
+	}
+
+	void Scramble() {
+		const uint64_t *key = keys + BLOCK_STRIPES - 1 + LANES;
+		for (int i = 0; i < LANES; i++) {
+			uint64_t a = acc[i];
+			a ^= a >> 47;
+			a ^= key[i];
+			acc[i] = a * SCRAMBLE_PRIME;
+		}
+	}
+#endif
+
+	uint64_t seed;
+	uint64_t acc[LANES];
+	uint64_t keys[KEYS];
+	uint64_t total;
+	int stripe; // position within the current block
+	unsigned char buffer[STRIPE];
+	size_t buffered;
+};
+
+// One-shot XXH64
+uint64_t Hash64(const void *data, size_t length, uint64_t seed = 0) {
+	Hasher64 h(seed);
+	h.Update(data, length);
+	return h.Digest();
+}
+
+// 128 bit hash as two independently seeded XXH64 digests
+const uint64_t HASH128_SEED = 0x9E3779B97F4A7C15ULL;
+
+struct Hash128 {
+	uint64_t lo, hi;
+
+	bool operator==(const Hash128 &o) const { return lo == o.lo && hi == o.hi; }
+	bool operator!=(const Hash128 &o) const { return !(*this == o); }
+
+	std::string Hex() const {
+		char s[33];
+		snprintf(s, sizeof(s), "%016llx%016llx", (unsigned long long)hi, (unsigned long long)lo);
+		return s;
+	}
+};
+
+Hash128 HashString128(const std::string &s) {
+	return Hash128{ Hash64(s.data(), s.size(), 0), Hash64(s.data(), s.size(), HASH128_SEED) };
+}
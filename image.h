@@ -1,12 +1,19 @@
 #pragma once
 
 #include <stdio.h>
+#include <stdint.h>
+#include <string.h>
 #include <vector>
 #include "png.h"
+#include <zlib.h>
 #include <iostream>
 #include <string>
 #include <algorithm>
 #include <math.h>
+#include "parallel.h"
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 typedef unsigned char Byte;
 
@@ -22,16 +29,262 @@ struct RGBA {
 	Byte r, g, b, a;
 };
 
+// Destination callbacks for encoding PNGs into a std::vector
+void PngAppend(png_structp png_ptr, png_bytep bytes, png_size_t length) {
+	std::vector<Byte> *out = (std::vector<Byte>*)png_get_io_ptr(png_ptr);
+	out->insert(out->end(), bytes, bytes + length);
+}
+
+void PngFlush(png_structp) { }
+
+// How pixels are laid out in a PNG being written
+struct PngFormat {
+	int color_type = PNG_COLOR_TYPE_RGBA;
+	int bit_depth = 8;
+	std::vector<png_color> palette;
+	std::vector<png_byte> trans;	// palette alpha, trailing opaque entries left out
+};
+
+// Write a PNG, either to fp or, when fp is NULL, appended to out. row(y,
+// scratch) returns row y in the output layout, one byte per sample (indices
+// are packed for bit depths below 8, 16 bit samples are two big endian
+// bytes), converting into scratch if the pixels are not stored that way.
+// Scratch holds 8 bytes per pixel. Returns false on failure.
+template <typename RowFn>
+bool WritePNG(FILE *fp, std::vector<Byte> *out, int width, int height,
+	const PngFormat &format, RowFn row) {
+	png_structp png_ptr = NULL;
+	png_infop info_ptr = NULL;
+	std::vector<Byte> scratch((size_t)width * 8);
+	bool ok = false;
+
+	// Initialize write structure
+	png_ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+	if (png_ptr == NULL) {
+		fprintf(stderr, "Could not allocate write struct\n");
+		goto finalise;
+	}
+
+	// Initialize info structure
+	info_ptr = png_create_info_struct(png_ptr);
+	if (info_ptr == NULL) {
+		fprintf(stderr, "Could not allocate info struct\n");
+		goto finalise;
+	}
+
+	// Setup Exception handling
+	if (setjmp(png_jmpbuf(png_ptr))) {
+		fprintf(stderr, "Error during png creation\n");
+		goto finalise;
+	}
+
+	if (fp != NULL)
+		png_init_io(png_ptr, fp);
+	else
+		png_set_write_fn(png_ptr, out, PngAppend, PngFlush);
+
+	png_set_IHDR(png_ptr, info_ptr, width, height,
+		format.bit_depth, format.color_type, PNG_INTERLACE_NONE,
+		PNG_COMPRESSION_TYPE_BASE, PNG_FILTER_TYPE_BASE);
+
+	if (format.color_type == PNG_COLOR_TYPE_PALETTE) {
+		png_set_PLTE(png_ptr, info_ptr, format.palette.data(), (int)format.palette.size());
+		if (!format.trans.empty())
+			png_set_tRNS(png_ptr, info_ptr, format.trans.data(), (int)format.trans.size(), NULL);
+	}
+
+	png_write_info(png_ptr, info_ptr);
+
+	if (format.bit_depth < 8)
+		png_set_packing(png_ptr);
+
+	for (int y = 0; y < height; y++) {
+		png_write_row(png_ptr, (png_const_bytep)row(y, scratch.data()));
+	}
+
+
+	// End write
+	png_write_end(png_ptr, NULL);
+	ok = true;
+
+finalise:
+	if (png_ptr != NULL) png_destroy_write_struct(&png_ptr, &info_ptr);
+	return ok;
+}
+
+void PutBigEndian32(std::vector<Byte> &out, unsigned v) {
+	out.push_back(v >> 24);
+	out.push_back(v >> 16);
+	out.push_back(v >> 8);
+	out.push_back(v);
+}
+
+uint32_t PackRGBA(RGBA c) {
+	return (uint32_t)c.r | (uint32_t)c.g << 8 | (uint32_t)c.b << 16 | (uint32_t)c.a << 24;
+}
+
+// Small open addressing map from colours to palette indices, used to spot
+// images with few enough colours for an indexed PNG
+class ColorTable {
+public:
+
+	ColorTable() : slots(SIZE, EMPTY) { }
+
+	// Index of the colour, added if not seen before. Returns -1 instead of
+	// adding a colour beyond the 256th.
+	int Insert(uint32_t c) {
+		for (uint32_t i = Hash(c); ; i = (i + 1) & (SIZE - 1)) {
+			if (slots[i] == EMPTY) {
+				if (colors.size() == 256) return -1;
+				slots[i] = (uint32_t)colors.size();
+				colors.push_back(c);
+				return slots[i];
+			}
+			if (colors[slots[i]] == c) return slots[i];
+		}
+	}
+
+	int Find(uint32_t c) const {
+		for (uint32_t i = Hash(c); ; i = (i + 1) & (SIZE - 1)) {
+			if (slots[i] == EMPTY) return -1;
+			if (colors[slots[i]] == c) return slots[i];
+		}
+	}
+
+	std::vector<uint32_t> colors;
+
+private:
+	// Four times the most colours ever stored keeps probe chains short
+	static constexpr uint32_t SIZE = 1024;
+	static constexpr uint32_t EMPTY = 0xFFFFFFFF;
+
+	static uint32_t Hash(uint32_t c) { return (c * 0x9E3779B1u) >> 22; }
+
+	std::vector<uint32_t> slots;
+};
+
+// Palette for the pixels if they hold at most 256 distinct colours. Stops
+// scanning at the 257th. Runs of one colour only cost a compare.
+bool FindPalette(const RGBA *pixels, size_t count, ColorTable &table) {
+	uint32_t last = 0;
+	for (size_t i = 0; i < count; i++) {
+		uint32_t c = PackRGBA(pixels[i]);
+		if (i > 0 && c == last) continue;
+		if (table.Insert(c) < 0) return false;
+		last = c;
+	}
+	return true;
+}
+
+// Find out whether every pixel is opaque and whether every pixel is gray
+// (r == g == b), so Save can drop channels. Stops as soon as both are known
+// to be false.
+void AnalyzePixels(const RGBA *pixels, size_t count, bool &opaque, bool &gray) {
+	opaque = gray = true;
+	size_t i = 0;
+
+#ifdef __SSE2__
+	const __m128i ones = _mm_set1_epi32(-1);
+	const __m128i notAlpha = _mm_set1_epi32(0x00FFFFFF);
+	while (i + 4 <= count && (opaque || gray)) {
+		// Check a block at a time, the flags only need looking at between
+		// blocks
+		__m128i allOpaque = ones, allGray = ones;
+		size_t end = std::min(count, i + 1024) & ~(size_t)3;
+		for (; i < end; i += 4) {
+			__m128i v = _mm_loadu_si128((const __m128i*)(pixels + i));
+			allOpaque = _mm_and_si128(allOpaque, _mm_or_si128(v, notAlpha));
+			// Byte k of each pixel against byte k - 1: g == r and b == g
+			allGray = _mm_and_si128(allGray, _mm_cmpeq_epi8(v, _mm_slli_epi32(v, 8)));
+		}
+		opaque = opaque && _mm_movemask_epi8(_mm_cmpeq_epi8(allOpaque, ones)) == 0xFFFF;
+		gray = gray && (_mm_movemask_epi8(allGray) & 0x6666) == 0x6666;
+	}
+#endif
+
+	for (; i < count && (opaque || gray); i++) {
+		opaque = opaque && pixels[i].a == 255;
+		gray = gray && pixels[i].r == pixels[i].g && pixels[i].g == pixels[i].b;
+	}
+}
+
+// Fill in PLTE/tRNS for up to 256 packed colours. Translucent entries are
+// put first so tRNS can stop at the last of them; remap[i] is the new
+// position of colour i. The bit depth is the smallest that fits.
+void MakePaletteFormat(const std::vector<uint32_t> &colors, PngFormat &format, std::vector<Byte> &remap) {
+	int n = (int)colors.size();
+	std::vector<int> order(n);
+	for (int i = 0; i < n; i++) order[i] = i;
+	std::stable_sort(order.begin(), order.end(), [&](int a, int b) {
+		return (colors[a] >> 24) < (colors[b] >> 24);
+	});
+
+	format.color_type = PNG_COLOR_TYPE_PALETTE;
+	format.bit_depth = n <= 2 ? 1 : n <= 4 ? 2 : n <= 16 ? 4 : 8;
+	format.palette.resize(n);
+	format.trans.clear();
+	remap.resize(n);
+
+	for (int i = 0; i < n; i++) {
+		uint32_t c = colors[order[i]];
+		format.palette[i].red = c & 0xFF;
+		format.palette[i].green = (c >> 8) & 0xFF;
+		format.palette[i].blue = (c >> 16) & 0xFF;
+		if ((c >> 24) != 255) format.trans.push_back(c >> 24);
+		remap[order[i]] = i;
+	}
+}
+
+// Read any color_type into 8bit depth, RGBA format.
+// See http://www.libpng.org/pub/png/libpng-manual.txt
+void SetRGBA8Transforms(png_structp png, png_infop info) {
+	int color_type = png_get_color_type(png, info);
+	int bit_depth = png_get_bit_depth(png, info);
+
+	if (bit_depth == 16)
+		png_set_strip_16(png);
+
+	if (color_type == PNG_COLOR_TYPE_PALETTE)
+		png_set_palette_to_rgb(png);
+
+	// PNG_COLOR_TYPE_GRAY_ALPHA is always 8 or 16bit depth.
+	if (color_type == PNG_COLOR_TYPE_GRAY && bit_depth < 8)
+		png_set_expand_gray_1_2_4_to_8(png);
+
+	if (png_get_valid(png, info, PNG_INFO_tRNS))
+		png_set_tRNS_to_alpha(png);
+
+	// These color_type don't have an alpha channel then fill it with 0xff.
+	if (color_type == PNG_COLOR_TYPE_RGB ||
+		color_type == PNG_COLOR_TYPE_GRAY ||
+		color_type == PNG_COLOR_TYPE_PALETTE)
+		png_set_filler(png, 0xFF, PNG_FILLER_AFTER);
+
+	if (color_type == PNG_COLOR_TYPE_GRAY ||
+		color_type == PNG_COLOR_TYPE_GRAY_ALPHA)
+		png_set_gray_to_rgb(png);
+}
+
 class GrayscaleImage;
 
+// Rows per independently compressed band of a seekable PNG
+const int SEEKABLE_BAND_ROWS = 128;
+
+// Largest seekable PNG decoded in parallel, bigger ones go through libpng
+const uint64_t MAX_SEEKABLE_PIXELS = (uint64_t)1 << 28;
+
+// Deflate never expands data by more than about 1032 to 1
+const uint64_t MAX_DEFLATE_RATIO = 1032;
+
 class ColorImage {
 public:
+	typedef RGBA Pixel;
 
 	ColorImage() :
 		width(0), height(0) { }
 
 	ColorImage(int width, int height) :
-		width(width), height(height), data(width*height) { }
+		width(width), height(height), data((size_t)width * height) { }
 
 	ColorImage(const GrayscaleImage &);
 
@@ -62,72 +315,171 @@ public:
 
 	int GetHeight() const { return height; }
 
-	void Save(std::string filename) {
-		FILE *fp = NULL;
-		png_structp png_ptr = NULL;
-		png_infop info_ptr = NULL;
+	// Pointer to the first pixel of row y, rows are GetWidth() pixels apart
+	RGBA *Row(int y) { return data.data() + (size_t)y * width; }
+
+	const RGBA *Row(int y) const { return data.data() + (size_t)y * width; }
 
+	void Save(std::string filename) {
 		// Open file for writing (binary mode)
-		fp = fopen(filename.c_str(), "wb");
+		FILE *fp = fopen(filename.c_str(), "wb");
 		if (fp == NULL) {
 			fprintf(stderr, "Could not open file %s for writing\n", filename.c_str());
-			goto finalise;
+			return;
 		}
 
-		// Initialize write structure
-		png_ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
-		if (png_ptr == NULL) {
-			fprintf(stderr, "Could not allocate write struct\n");
-			goto finalise;
-		}
+		WriteTo(fp, NULL);
+		fclose(fp);
+	}
 
-		// Initialize info structure
-		info_ptr = png_create_info_struct(png_ptr);
-		if (info_ptr == NULL) {
-			fprintf(stderr, "Could not allocate info struct\n");
-			goto finalise;
-		}
+	// Encode as PNG into memory, replacing the contents of out
+	bool Encode(std::vector<Byte> &out) const {
+		out.clear();
+		return WriteTo(NULL, &out);
+	}
 
-		// Setup Exception handling
-		if (setjmp(png_jmpbuf(png_ptr))) {
-			fprintf(stderr, "Error during png creation\n");
-			goto finalise;
-		}
+	// PNG that Load can decode in parallel, see EncodeSeekable
+	bool SaveSeekable(std::string filename, int bandRows = SEEKABLE_BAND_ROWS) const;
 
-		png_init_io(png_ptr, fp);
+	bool EncodeSeekable(std::vector<Byte> &out, int bandRows = SEEKABLE_BAND_ROWS) const;
 
-		// Write header (8 bit colour depth)
-		png_set_IHDR(png_ptr, info_ptr, width, height,
-			8, PNG_COLOR_TYPE_RGBA, PNG_INTERLACE_NONE,
-			PNG_COMPRESSION_TYPE_BASE, PNG_FILTER_TYPE_BASE);
+	// Decode a PNG written by SaveSeekable with its bands in parallel.
+	// Returns false, leaving the image alone, for any other PNG.
+	bool LoadSeekable(std::string filename) {
+		FILE *fp = fopen(filename.c_str(), "rb");
+		if (fp == NULL) return false;
+		bool ok = ReadSeekable(fp);
+		fclose(fp);
+		return ok;
+	}
 
-		png_write_info(png_ptr, info_ptr);
+	void Load(std::string filename) {
+		FILE *fp = fopen(filename.c_str(), "rb");
+		if (fp == NULL) return;
+		ReadFrom(fp);
+		fclose(fp);
+	}
 
+	// Decode a PNG held in memory
+	bool Decode(const Byte *bytes, size_t length) {
+		FILE *fp = fmemopen((void*)bytes, length, "rb");
+		if (fp == NULL) return false;
+		bool ok = ReadFrom(fp);
+		fclose(fp);
+		return ok;
+	}
 
-		for (int y = 0; y < height; y++) {
-			png_write_row(png_ptr, (unsigned char*)&data[y*width]);
-		}
+	// Decode only the rect x0, y0, w x h (clipped to the image), averaging
+	// each factor x factor block into one pixel. Rows are read one at a
+	// time and rows past the rect are never decompressed, so memory is one
+	// source row plus the output (interlaced files need the rect's rows for
+	// all passes). Returns false if nothing could be read.
+	bool LoadRegion(std::string filename, int x0, int y0, int w, int h, int factor = 1) {
+		FILE *fp = fopen(filename.c_str(), "rb");
+		if (fp == NULL) return false;
+
+		png_structp png = NULL;
+		png_infop info = NULL;
+		std::vector<Byte> rows;
+		std::vector<uint32_t> sums;
+		bool ok = false;
+		int fullWidth, fullHeight, passes, x1, y1, pendingRows = 0;
+		size_t rowBytes;
+
+		png = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+		if (png == NULL) goto finalise;
+
+		info = png_create_info_struct(png);
+		if (info == NULL) goto finalise;
+
+		if (setjmp(png_jmpbuf(png))) goto finalise;
 
+		png_init_io(png, fp);
+		png_read_info(png, info);
+
+		fullWidth = png_get_image_width(png, info);
+		fullHeight = png_get_image_height(png, info);
+		factor = std::max(factor, 1);
+		x1 = (int)std::min<int64_t>(fullWidth, (int64_t)x0 + w);
+		y1 = (int)std::min<int64_t>(fullHeight, (int64_t)y0 + h);
+		x0 = std::max(x0, 0);
+		y0 = std::max(y0, 0);
+		if (x0 >= x1 || y0 >= y1) goto finalise;
+
+		SetRGBA8Transforms(png, info);
+		passes = png_set_interlace_handling(png);
+		png_read_update_info(png, info);
 
-		// End write
-		png_write_end(png_ptr, NULL);
+		rowBytes = png_get_rowbytes(png, info);
+		if (rowBytes != (size_t)fullWidth * 4) goto finalise;
+
+		width = (x1 - x0 + factor - 1) / factor;
+		height = (y1 - y0 + factor - 1) / factor;
+		data.assign((size_t)width * height, RGBA());
+		sums.assign((size_t)width * 4, 0);
+
+		if (passes == 1) {
+			// Sequential rows: keep one, stop after the last wanted row
+			rows.resize(rowBytes);
+			for (int y = 0; y < y1; y++) {
+				png_read_row(png, rows.data(), NULL);
+				if (y >= y0) {
+					AccumulateRow(rows.data(), x0, x1, factor, sums);
+					if (++pendingRows == factor || y == y1 - 1) {
+						EmitRow((y - y0) / factor, x0, x1, factor, pendingRows, sums);
+						pendingRows = 0;
+					}
+				}
+			}
+		}
+		else {
+			// Every pass covers the whole image, keep the rect's rows
+			rows.resize(rowBytes * (y1 - y0));
+			std::vector<Byte> discard(rowBytes);
+			for (int pass = 0; pass < passes; pass++) {
+				for (int y = 0; y < fullHeight; y++) {
+					png_read_row(png, y >= y0 && y < y1 ? &rows[(y - y0) * rowBytes] : discard.data(), NULL);
+				}
+			}
+			for (int y = y0; y < y1; y++) {
+				AccumulateRow(&rows[(y - y0) * rowBytes], x0, x1, factor, sums);
+				if (++pendingRows == factor || y == y1 - 1) {
+					EmitRow((y - y0) / factor, x0, x1, factor, pendingRows, sums);
+					pendingRows = 0;
+				}
+			}
+		}
+		ok = true;
 
 	finalise:
-		if (fp != NULL) fclose(fp);
-		if (info_ptr != NULL) png_free_data(png_ptr, info_ptr, PNG_FREE_ALL, -1);
-		if (png_ptr != NULL) png_destroy_write_struct(&png_ptr, (png_infopp)NULL);
+		png_destroy_read_struct(&png, &info, NULL);
+		fclose(fp);
+		return ok;
 	}
 
-	void Load(std::string filename) {
-		FILE *fp = fopen(filename.c_str(), "rb");
+	// Decode the whole image at 1 / factor of the size
+	bool LoadScaled(std::string filename, int factor) {
+		return LoadRegion(filename, 0, 0, INT32_MAX, INT32_MAX, factor);
+	}
 
-		png_structp png = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
-		if (!png) return;
+private:
+	// Seekable PNGs in parallel, anything else through libpng
+	bool ReadFrom(FILE *fp) {
+		if (ReadSeekable(fp)) return true;
+		if (fseek(fp, 0, SEEK_SET) != 0) return false;
 
-		png_infop info = png_create_info_struct(png);
-		if (!info) return;
+		png_structp png = NULL;
+		png_infop info = NULL;
+		std::vector<png_bytep> row_pointers;
+		bool ok = false;
 
-		if (setjmp(png_jmpbuf(png))) return;
+		png = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+		if (png == NULL) goto finalise;
+
+		info = png_create_info_struct(png);
+		if (info == NULL) goto finalise;
+
+		if (setjmp(png_jmpbuf(png))) goto finalise;
 
 		png_init_io(png, fp);
 
@@ -135,54 +487,112 @@ public:
 
 		width = png_get_image_width(png, info);
 		height = png_get_image_height(png, info);
-		int color_type = png_get_color_type(png, info);
-		int bit_depth = png_get_bit_depth(png, info);
 
-		data.resize(width*height);
+		data.resize((size_t)width * height);
 
-		// Read any color_type into 8bit depth, RGBA format.
-		// See http://www.libpng.org/pub/png/libpng-manual.txt
+		SetRGBA8Transforms(png, info);
+		png_read_update_info(png, info);
 
-		if (bit_depth == 16)
-			png_set_strip_16(png);
+		if (png_get_rowbytes(png, info) != width * 4) {
+			data.resize(data.size() + png_get_rowbytes(png, info) - width * 4);
+		}
 
-		if (color_type == PNG_COLOR_TYPE_PALETTE)
-			png_set_palette_to_rgb(png);
+		row_pointers.resize(height);
+		for (int y = 0; y < height; y++) {
+			row_pointers[y] = (unsigned char*)&data[y*width];
+		}
 
-		// PNG_COLOR_TYPE_GRAY_ALPHA is always 8 or 16bit depth.
-		if (color_type == PNG_COLOR_TYPE_GRAY && bit_depth < 8)
-			png_set_expand_gray_1_2_4_to_8(png);
+		png_read_image(png, row_pointers.data());
+		ok = true;
 
-		if (png_get_valid(png, info, PNG_INFO_tRNS))
-			png_set_tRNS_to_alpha(png);
+	finalise:
+		png_destroy_read_struct(&png, &info, NULL);
+		return ok;
+	}
 
-		// These color_type don't have an alpha channel then fill it with 0xff.
-		if (color_type == PNG_COLOR_TYPE_RGB ||
-			color_type == PNG_COLOR_TYPE_GRAY ||
-			color_type == PNG_COLOR_TYPE_PALETTE)
-			png_set_filler(png, 0xFF, PNG_FILLER_AFTER);
+	bool ReadSeekable(FILE *fp);
 
-		if (color_type == PNG_COLOR_TYPE_GRAY ||
-			color_type == PNG_COLOR_TYPE_GRAY_ALPHA)
-			png_set_gray_to_rgb(png);
+	// Add pixels [x0, x1) of an RGBA row into per output column sums
+	void AccumulateRow(const Byte *row, int x0, int x1, int factor, std::vector<uint32_t> &sums) const {
+		for (int x = x0; x < x1; x++) {
+			uint32_t *s = &sums[(size_t)((x - x0) / factor) * 4];
+			const Byte *p = row + (size_t)x * 4;
+			s[0] += p[0]; s[1] += p[1]; s[2] += p[2]; s[3] += p[3];
+		}
+	}
 
-		png_read_update_info(png, info);
+	// Average the sums of `rows` source rows into output row y and reset them
+	void EmitRow(int y, int x0, int x1, int factor, int rows, std::vector<uint32_t> &sums) {
+		for (int x = 0; x < width; x++) {
+			int cols = std::min(factor, x1 - x0 - x * factor);
+			uint32_t n = (uint32_t)(cols * rows);
+			uint32_t *s = &sums[(size_t)x * 4];
+			data[(size_t)y * width + x] = RGBA((s[0] + n / 2) / n, (s[1] + n / 2) / n, (s[2] + n / 2) / n, (s[3] + n / 2) / n);
+			s[0] = s[1] = s[2] = s[3] = 0;
+		}
+	}
 
-		if (png_get_rowbytes(png, info) != width * 4) {
-			data.resize(data.size() + png_get_rowbytes(png, info) - width * 4);
+	// Use the smallest PNG layout that holds the pixels exactly: gray when
+	// r == g == b, indexed for at most 256 colours, no alpha channel when
+	// everything is opaque. Rows are converted as they are written.
+	bool WriteTo(FILE *fp, std::vector<Byte> *out) const {
+		PngFormat format;
+		ColorTable table;
+		bool opaque, gray;
+		AnalyzePixels(data.data(), data.size(), opaque, gray);
+
+		// Gray beats a palette unless the palette allows packing pixels
+		bool palette = FindPalette(data.data(), data.size(), table);
+		if (palette && (!gray || table.colors.size() <= 16)) {
+			std::vector<Byte> remap;
+			MakePaletteFormat(table.colors, format, remap);
+			return WritePNG(fp, out, width, height, format, [&](int y, Byte *scratch) {
+				const RGBA *row = Row(y);
+				uint32_t last = PackRGBA(row[0]);
+				Byte index = remap[table.Find(last)];
+				for (int x = 0; x < width; x++) {
+					uint32_t c = PackRGBA(row[x]);
+					if (c != last) {
+						last = c;
+						index = remap[table.Find(c)];
+					}
+					scratch[x] = index;
+				}
+				return (const Byte*)scratch;
+			});
 		}
 
-		unsigned char **row_pointers = new unsigned char*[height];
-		for (int y = 0; y < height; y++) {
-			row_pointers[y] = (unsigned char*)&data[y*width];
+		if (gray) {
+			format.color_type = opaque ? PNG_COLOR_TYPE_GRAY : PNG_COLOR_TYPE_GRAY_ALPHA;
+			return WritePNG(fp, out, width, height, format, [&](int y, Byte *scratch) {
+				const RGBA *row = Row(y);
+				Byte *p = scratch;
+				for (int x = 0; x < width; x++) {
+					*p++ = row[x].r;
+					if (!opaque) *p++ = row[x].a;
+				}
+				return (const Byte*)scratch;
+			});
 		}
 
-		png_read_image(png, row_pointers);
+		if (opaque) {
+			format.color_type = PNG_COLOR_TYPE_RGB;
+			return WritePNG(fp, out, width, height, format, [&](int y, Byte *scratch) {
+				const RGBA *row = Row(y);
+				for (int x = 0; x < width; x++) {
+					scratch[3 * x] = row[x].r;
+					scratch[3 * x + 1] = row[x].g;
+					scratch[3 * x + 2] = row[x].b;
+				}
+				return (const Byte*)scratch;
+			});
+		}
 
-		fclose(fp);
+		return WritePNG(fp, out, width, height, format, [&](int y, Byte *) {
+			return (const Byte*)Row(y);
+		});
 	}
 
-private:
 	std::vector<RGBA> data;
 	int width, height;
 };
@@ -195,12 +605,12 @@ public:
 		width(0), height(0) { }
 
 	GrayscaleImage(int width, int height) :
-		width(width), height(height), data(width*height) { }
+		width(width), height(height), data((size_t)width * height) { }
 
 	GrayscaleImage(const ColorImage &im) {
 		width = im.GetWidth();
 		height = im.GetHeight();
-		data.resize(width*height);
+		data.resize((size_t)width * height);
 
 		for (int y = 0; y < height; y++) {
 			for (int x = 0; x < width; x++) {
@@ -212,6 +622,11 @@ public:
 
 	int GetHeight() const { return height; }
 
+	// Pointer to the first pixel of row y, rows are GetWidth() pixels apart
+	Byte *Row(int y) { return data.data() + (size_t)y * width; }
+
+	const Byte *Row(int y) const { return data.data() + (size_t)y * width; }
+
 	Byte &operator()(int x, int y) {
 		return data[x + y * width];
 	}
@@ -236,59 +651,21 @@ public:
 	}
 
 	void Save(std::string filename) {
-		FILE *fp = NULL;
-		png_structp png_ptr = NULL;
-		png_infop info_ptr = NULL;
-
 		// Open file for writing (binary mode)
-		fp = fopen(filename.c_str(), "wb");
+		FILE *fp = fopen(filename.c_str(), "wb");
 		if (fp == NULL) {
 			fprintf(stderr, "Could not open file %s for writing\n", filename.c_str());
-			goto finalise;
-		}
-
-		// Initialize write structure
-		png_ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
-		if (png_ptr == NULL) {
-			fprintf(stderr, "Could not allocate write struct\n");
-			goto finalise;
+			return;
 		}
 
-		// Initialize info structure
-		info_ptr = png_create_info_struct(png_ptr);
-		if (info_ptr == NULL) {
-			fprintf(stderr, "Could not allocate info struct\n");
-			goto finalise;
-		}
-
-		// Setup Exception handling
-		if (setjmp(png_jmpbuf(png_ptr))) {
-			fprintf(stderr, "Error during png creation\n");
-			goto finalise;
-		}
-
-		png_init_io(png_ptr, fp);
-
-		// Write header (8 bit colour depth)
-		png_set_IHDR(png_ptr, info_ptr, width, height,
-			8, PNG_COLOR_TYPE_GRAY, PNG_INTERLACE_NONE,
-			PNG_COMPRESSION_TYPE_BASE, PNG_FILTER_TYPE_BASE);
-
-		png_write_info(png_ptr, info_ptr);
-
-
-		for (int y = 0; y < height; y++) {
-			png_write_row(png_ptr, (unsigned char*)&data[y*width]);
-		}
-
-
-		// End write
-		png_write_end(png_ptr, NULL);
+		WriteTo(fp, NULL);
+		fclose(fp);
+	}
 
-	finalise:
-		if (fp != NULL) fclose(fp);
-		if (info_ptr != NULL) png_free_data(png_ptr, info_ptr, PNG_FREE_ALL, -1);
-		if (png_ptr != NULL) png_destroy_write_struct(&png_ptr, (png_infopp)NULL);
+	// Encode as PNG into memory, replacing the contents of out
+	bool Encode(std::vector<Byte> &out) const {
+		out.clear();
+		return WriteTo(NULL, &out);
 	}
 
 	void Load(std::string filename) {
@@ -311,7 +688,7 @@ public:
 		int color_type = png_get_color_type(png, info);
 		int bit_depth = png_get_bit_depth(png, info);
 
-		data.resize(width*height);
+		data.resize((size_t)width * height);
 
 
 
@@ -359,6 +736,14 @@ public:
 	}
 
 private:
+	bool WriteTo(FILE *fp, std::vector<Byte> *out) const {
+		PngFormat format;
+		format.color_type = PNG_COLOR_TYPE_GRAY;
+		return WritePNG(fp, out, width, height, format, [&](int y, Byte *) {
+			return Row(y);
+		});
+	}
+
 	std::vector<Byte> data;
 	int width, height;
 };
@@ -411,7 +796,7 @@ void SaveHist(const ColorImage &im, std::string filename, double scale = 0.05) {
 ColorImage::ColorImage(const GrayscaleImage &im) {
 	width = im.GetWidth();
 	height = im.GetHeight();
-	data.resize(width*height);
+	data.resize((size_t)width * height);
 
 	for (int y = 0; y < height; y++) {
 		for (int x = 0; x < width; x++) {
@@ -420,6 +805,337 @@ ColorImage::ColorImage(const GrayscaleImage &im) {
 	}
 }
 
+// Seekable PNGs.
+//
+// The image data is compressed in bands of rows. Every band starts with an
+// empty deflate dictionary (what a Z_FULL_FLUSH leaves behind) and its first
+// row uses a filter that does not look at the row above, so a band can be
+// inflated and unfiltered knowing nothing but where it starts. Those start
+// offsets, counted in the zlib stream made of all the IDAT data, go in a
+// private "rbIX" chunk:
+//
+//   uint32 rows per band, then per band uint32 offset (big endian)
+//
+// The chunk is ancillary, so other readers skip it, and unsafe to copy, so
+// editors that rewrite the image data drop it. Bands are also compressed in
+// parallel, each by its own deflate stream ending in a full flush.
+
+const Byte PNG_SIGNATURE[8] = { 137, 80, 78, 71, 13, 10, 26, 10 };
+
+void PutPngChunk(std::vector<Byte> &out, const char *type, const Byte *data, size_t length) {
+	PutBigEndian32(out, (unsigned)length);
+	size_t start = out.size();
+	out.insert(out.end(), type, type + 4);
+	out.insert(out.end(), data, data + length);
+	PutBigEndian32(out, (unsigned)crc32(0, &out[start], (uInt)(length + 4)));
+}
+
+uint32_t GetBigEndian32(const Byte *p) {
+	return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+}
+
+int PaethPredictor(int a, int b, int c) {
+	int p = a + b - c;
+	int pa = abs(p - a), pb = abs(p - b), pc = abs(p - c);
+	if (pa <= pb && pa <= pc) return a;
+	return pb <= pc ? b : c;
+}
+
+// Apply or undo PNG filter type, writing row. prev is the unfiltered row
+// above, NULL for none. When applying, src holds the unfiltered bytes;
+// when undoing src is row itself. Each filter has its own loop so the Sub,
+// Up and Avg ones vectorize.
+template <bool Apply>
+void PngFilter(int type, const Byte *src, Byte *row, const Byte *prev, size_t rowBytes, int bpp) {
+	// The left neighbour is always unfiltered: src[] when applying, the
+	// already restored row[] when undoing
+	const Byte *left = Apply ? src : row;
+	auto out = [](Byte v, int predicted) { return (Byte)(Apply ? v - predicted : v + predicted); };
+	size_t i = 0;
+	switch (type) {
+	case 0:
+		if (Apply) memcpy(row, src, rowBytes);
+		break;
+	case 1:
+		if (Apply) memcpy(row, src, bpp);
+		for (i = bpp; i < rowBytes; i++) row[i] = out(src[i], left[i - bpp]);
+		break;
+	case 2:
+		for (i = 0; i < rowBytes; i++) row[i] = out(src[i], prev[i]);
+		break;
+	case 3:
+		for (i = 0; i < (size_t)bpp; i++) row[i] = out(src[i], prev[i] >> 1);
+		for (; i < rowBytes; i++) row[i] = out(src[i], (left[i - bpp] + prev[i]) >> 1);
+		break;
+	case 4:
+		for (i = 0; i < (size_t)bpp; i++) row[i] = out(src[i], prev[i]);
+		for (; i < rowBytes; i++) row[i] = out(src[i], PaethPredictor(left[i - bpp], prev[i], prev[i - bpp]));
+		break;
+	}
+}
+
+// Filter row (rowBytes bytes, bpp per pixel) against prev (NULL for none)
+// into out, filter type byte first. Tries every filter allowed and keeps
+// the one with the smallest sum of absolute values, like libpng.
+void FilterRow(const Byte *row, const Byte *prev, size_t rowBytes, int bpp, Byte *out) {
+	std::vector<Byte> candidate(rowBytes);
+	uint64_t best = UINT64_MAX;
+
+	for (int type = 0; type <= 4; type++) {
+		if (prev == NULL && type >= 2) break;
+		PngFilter<true>(type, row, candidate.data(), prev, rowBytes, bpp);
+		uint64_t cost = 0;
+		for (size_t i = 0; i < rowBytes; i++) {
+			cost += candidate[i] < 128 ? candidate[i] : 256 - candidate[i];
+		}
+		if (cost < best) {
+			best = cost;
+			out[0] = type;
+			memcpy(out + 1, candidate.data(), rowBytes);
+		}
+	}
+}
+
+// Undo a filter in place, prev being the unfiltered row above or NULL
+bool UnfilterRow(int type, Byte *row, const Byte *prev, size_t rowBytes, int bpp) {
+	if (type > 4 || (prev == NULL && type >= 2)) return false;
+	PngFilter<false>(type, row, row, prev, rowBytes, bpp);
+	return true;
+}
+
+bool ColorImage::EncodeSeekable(std::vector<Byte> &out, int bandRows) const {
+	out.clear();
+	if (width <= 0 || height <= 0) return false;
+	bandRows = std::max(bandRows, 1);
+
+	// RGB when everything is opaque, RGBA otherwise
+	bool opaque, gray;
+	AnalyzePixels(data.data(), data.size(), opaque, gray);
+	int bpp = opaque ? 3 : 4;
+	size_t rowBytes = (size_t)width * bpp;
+
+	int bands = (height + bandRows - 1) / bandRows;
+	std::vector<std::vector<Byte>> compressed(bands);
+	std::vector<uLong> adlers(bands);
+	std::vector<char> failed(bands, 0);
+
+	ParallelFor(bands, HardwareThreads(), [&](int band) {
+		int y0 = band * bandRows, y1 = std::min(height, y0 + bandRows);
+		std::vector<Byte> filtered((size_t)(y1 - y0) * (rowBytes + 1));
+		std::vector<Byte> row(rowBytes), prev(rowBytes);
+
+		for (int y = y0; y < y1; y++) {
+			const RGBA *src = Row(y);
+			for (int x = 0; x < width; x++) {
+				memcpy(&row[(size_t)x * bpp], &src[x], bpp);
+			}
+			FilterRow(row.data(), y > y0 ? prev.data() : NULL, rowBytes, bpp, &filtered[(y - y0) * (rowBytes + 1)]);
+			std::swap(row, prev);
+		}
+		adlers[band] = adler32(1, filtered.data(), (uInt)filtered.size());
+
+		// Raw deflate, the zlib header and checksum are added around the bands
+		z_stream z = {};
+		if (deflateInit2(&z, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+			failed[band] = 1;
+			return;
+		}
+		std::vector<Byte> &dst = compressed[band];
+		dst.resize(deflateBound(&z, filtered.size()) + 16);
+		z.next_in = filtered.data();
+		z.avail_in = (uInt)filtered.size();
+		z.next_out = dst.data();
+		z.avail_out = (uInt)dst.size();
+		int status = deflate(&z, band == bands - 1 ? Z_FINISH : Z_FULL_FLUSH);
+		bool done = band == bands - 1 ? status == Z_STREAM_END : status == Z_OK && z.avail_in == 0 && z.avail_out > 0;
+		dst.resize(z.total_out);
+		deflateEnd(&z);
+		if (!done) failed[band] = 1;
+	});
+
+	for (int band = 0; band < bands; band++) {
+		if (failed[band]) return false;
+	}
+
+	// zlib stream: header, the bands back to back, adler32 of everything
+	std::vector<Byte> stream = { 0x78, 0x9C };
+	std::vector<Byte> index;
+	PutBigEndian32(index, bandRows);
+	uLong adler = 1;
+	for (int band = 0; band < bands; band++) {
+		PutBigEndian32(index, (unsigned)stream.size());
+		stream.insert(stream.end(), compressed[band].begin(), compressed[band].end());
+		int y0 = band * bandRows, y1 = std::min(height, y0 + bandRows);
+		adler = adler32_combine(adler, adlers[band], (z_off_t)((y1 - y0) * (rowBytes + 1)));
+	}
+	PutBigEndian32(stream, (unsigned)adler);
+
+	out.insert(out.end(), PNG_SIGNATURE, PNG_SIGNATURE + 8);
+	std::vector<Byte> header;
+	PutBigEndian32(header, width);
+	PutBigEndian32(header, height);
+	header.push_back(8);
+	header.push_back(opaque ? PNG_COLOR_TYPE_RGB : PNG_COLOR_TYPE_RGBA);
+	header.push_back(0);	// compression
+	header.push_back(0);	// filter
+	header.push_back(0);	// interlace
+	PutPngChunk(out, "IHDR", header.data(), header.size());
+	PutPngChunk(out, "rbIX", index.data(), index.size());
+
+	const size_t IDAT_BYTES = 1 << 20;
+	for (size_t i = 0; i < stream.size(); i += IDAT_BYTES) {
+		PutPngChunk(out, "IDAT", &stream[i], std::min(IDAT_BYTES, stream.size() - i));
+	}
+	PutPngChunk(out, "IEND", NULL, 0);
+	return true;
+}
+
+bool ColorImage::SaveSeekable(std::string filename, int bandRows) const {
+	std::vector<Byte> png;
+	if (!EncodeSeekable(png, bandRows)) return false;
+	FILE *fp = fopen(filename.c_str(), "wb");
+	if (fp == NULL) {
+		fprintf(stderr, "Could not open file %s for writing\n", filename.c_str());
+		return false;
+	}
+	bool ok = fwrite(png.data(), 1, png.size(), fp) == png.size();
+	return fclose(fp) == 0 && ok;
+}
+
+bool ColorImage::ReadSeekable(FILE *fp) {
+	// Walk the chunks, giving up at the first IDAT if there was no index,
+	// so ordinary PNGs cost a few small reads
+	Byte head[8];
+	uint32_t w = 0, h = 0;
+	int colorType = -1, bandRows = 0;
+	std::vector<uint32_t> offsets;
+	std::vector<Byte> stream, chunk;
+	// Chunk lengths are checked against what is left of the file before
+	// anything is allocated for them
+	bool ok = fseek(fp, 0, SEEK_END) == 0;
+	long fileSize = ok ? ftell(fp) : -1;
+	ok = fileSize >= 0 && fseek(fp, 0, SEEK_SET) == 0 &&
+		fread(head, 1, 8, fp) == 8 && memcmp(head, PNG_SIGNATURE, 8) == 0;
+
+	while (ok && fread(head, 1, 8, fp) == 8) {
+		uint32_t length = GetBigEndian32(head);
+		std::string type((const char*)head + 4, 4);
+		bool wanted = type == "IHDR" || type == "rbIX" || type == "IDAT";
+
+		if (type == "IDAT" && offsets.empty()) ok = false;
+		if (type == "IEND" || !ok) break;
+		if (!wanted) {
+			ok = fseek(fp, (long)length + 4, SEEK_CUR) == 0;
+			continue;
+		}
+
+		long left = fileSize - ftell(fp);
+		ok = length < (1u << 31) && (long)length + 4 <= left;
+		if (!ok) break;
+		chunk.resize(length + 4);
+		ok = fread(chunk.data(), 1, length + 4, fp) == length + 4;
+		if (!ok) break;
+		uLong crc = crc32(crc32(0, head + 4, 4), chunk.data(), length);
+		ok = crc == GetBigEndian32(&chunk[length]);
+		if (!ok) break;
+
+		if (type == "IHDR") {
+			// 8 bit RGB or RGBA, standard compression and filters, no interlace
+			ok = length == 13 && chunk[8] == 8 && (chunk[9] == PNG_COLOR_TYPE_RGB || chunk[9] == PNG_COLOR_TYPE_RGBA) &&
+				chunk[10] == 0 && chunk[11] == 0 && chunk[12] == 0;
+			w = GetBigEndian32(&chunk[0]);
+			h = GetBigEndian32(&chunk[4]);
+			colorType = chunk[9];
+			ok = ok && w > 0 && h > 0 && w < (1u << 24) && h < (1u << 24);
+		}
+		else if (type == "rbIX") {
+			ok = colorType >= 0 && length >= 8 && length % 4 == 0;
+			bandRows = ok ? (int)GetBigEndian32(&chunk[0]) : 0;
+			for (uint32_t i = 4; ok && i < length; i += 4) {
+				offsets.push_back(GetBigEndian32(&chunk[i]));
+			}
+			ok = ok && bandRows > 0 && offsets.size() == (h + bandRows - 1) / bandRows;
+		}
+		else {
+			stream.insert(stream.end(), chunk.begin(), chunk.begin() + length);
+		}
+	}
+	if (!ok || offsets.empty() || stream.size() < 6) return false;
+
+	for (size_t band = 0; band < offsets.size(); band++) {
+		uint32_t end = band + 1 < offsets.size() ? offsets[band + 1] : (uint32_t)stream.size() - 4;
+		if (offsets[band] < 2 || offsets[band] > end || end > stream.size() - 4) return false;
+	}
+
+	int bpp = colorType == PNG_COLOR_TYPE_RGB ? 3 : 4;
+	size_t rowBytes = (size_t)w * bpp;
+	// The header alone must not decide how much is allocated: the stream has
+	// to be long enough to hold that many rows
+	uint64_t filteredBytes = ((uint64_t)rowBytes + 1) * h;
+	if ((uint64_t)w * h > MAX_SEEKABLE_PIXELS || filteredBytes > MAX_DEFLATE_RATIO * stream.size()) return false;
+
+	int bands = (int)offsets.size();
+	std::vector<RGBA> pixels((size_t)w * h);
+	std::vector<uLong> adlers(bands);
+	std::vector<char> failed(bands, 0);
+
+	ParallelFor(bands, HardwareThreads(), [&](int band) {
+		int y0 = band * bandRows, y1 = std::min((int)h, y0 + bandRows);
+		uint32_t begin = offsets[band];
+		uint32_t end = band + 1 < bands ? offsets[band + 1] : (uint32_t)stream.size() - 4;
+		std::vector<Byte> filtered((size_t)(y1 - y0) * (rowBytes + 1));
+
+		z_stream z = {};
+		if (inflateInit2(&z, -15) != Z_OK) {
+			failed[band] = 1;
+			return;
+		}
+		z.next_in = &stream[begin];
+		z.avail_in = end - begin;
+		z.next_out = filtered.data();
+		z.avail_out = (uInt)filtered.size();
+		int status = inflate(&z, Z_SYNC_FLUSH);
+		bool done = z.avail_out == 0 && (status == Z_OK || status == Z_STREAM_END);
+		inflateEnd(&z);
+		if (!done) {
+			failed[band] = 1;
+			return;
+		}
+		adlers[band] = adler32(1, filtered.data(), (uInt)filtered.size());
+
+		for (int y = y0; y < y1; y++) {
+			Byte *row = &filtered[(y - y0) * (rowBytes + 1)];
+			const Byte *prev = y > y0 ? row - rowBytes : NULL;
+			if (!UnfilterRow(row[0], row + 1, prev, rowBytes, bpp)) {
+				failed[band] = 1;
+				return;
+			}
+			RGBA *dst = &pixels[(size_t)y * w];
+			if (bpp == 4) {
+				memcpy((void*)dst, row + 1, rowBytes);
+				continue;
+			}
+			for (uint32_t x = 0; x < w; x++) {
+				const Byte *p = row + 1 + (size_t)x * 3;
+				dst[x] = RGBA(p[0], p[1], p[2]);
+			}
+		}
+	});
+
+	uLong adler = 1;
+	for (int band = 0; band < bands; band++) {
+		if (failed[band]) return false;
+		int y0 = band * bandRows, y1 = std::min((int)h, y0 + bandRows);
+		adler = adler32_combine(adler, adlers[band], (z_off_t)((y1 - y0) * (rowBytes + 1)));
+	}
+	if (adler != GetBigEndian32(&stream[stream.size() - 4])) return false;
+
+	width = w;
+	height = h;
+	data.swap(pixels);
+	return true;
+}
+
 int car(double val, int limit) {
 	return std::clamp((int)std::round(val), 0, limit);
 }
\ No newline at end of file
@@ -0,0 +1,334 @@
+#pragma once
+
+#include "image.h"
+#include <stdint.h>
+#include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// 16 bit per channel images, for output that needs more than 8 bits of
+// precision (print) without the memory of a float framebuffer. Samples are
+// stored in native byte order and swapped to and from the big endian order
+// of PNG a row at a time.
+
+struct RGBA16 {
+	RGBA16() : r(0), g(0), b(0), a(65535) { }
+	RGBA16(uint16_t r, uint16_t g, uint16_t b, uint16_t a = 65535) : r(r), g(g), b(b), a(a) { }
+	RGBA16(uint16_t lum) : r(lum), g(lum), b(lum), a(65535) { }
+
+	// 8 bit samples scale by 257 so 255 becomes 65535
+	RGBA16(RGBA c) : r(c.r * 257), g(c.g * 257), b(c.b * 257), a(c.a * 257) { }
+
+	uint16_t luminance() const {
+		return 0.299*r + 0.587*g + 0.114*b;
+	}
+
+	uint16_t r, g, b, a;
+};
+
+// Swap the bytes of count 16 bit samples in place. Converts between native
+// and big endian order on little endian machines, does nothing otherwise.
+void SwapBytes16(uint16_t *samples, size_t count) {
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+	(void)samples;
+	(void)count;
+#else
+	size_t i = 0;
+
+#ifdef __SSE2__
+	for (; i + 8 <= count; i += 8) {
+		__m128i v = _mm_loadu_si128((const __m128i*)(samples + i));
+		v = _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+		_mm_storeu_si128((__m128i*)(samples + i), v);
+	}
+#endif
+
+	for (; i < count; i++) {
+		samples[i] = (uint16_t)(samples[i] << 8 | samples[i] >> 8);
+	}
+#endif
+}
+
+// Read a PNG of any layout and depth as 16 bit samples, channels being 4
+// (RGBA) or 1 (gray). 8 bit and smaller samples are scaled up exactly, 16 bit
+// samples are kept as they are. Returns false if the file can not be read,
+// in which case width, height and data may hold partial results.
+bool ReadPNG16(std::string filename, int channels, int &width, int &height, std::vector<uint16_t> &data) {
+	FILE *fp = fopen(filename.c_str(), "rb");
+	if (fp == NULL) return false;
+
+	png_structp png = NULL;
+	png_infop info = NULL;
+	std::vector<png_bytep> rows;
+	bool ok = false;
+	int color_type;
+
+	png = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+	if (png == NULL) goto finalise;
+
+	info = png_create_info_struct(png);
+	if (info == NULL) goto finalise;
+
+	if (setjmp(png_jmpbuf(png))) goto finalise;
+
+	png_init_io(png, fp);
+	png_read_info(png, info);
+
+	width = png_get_image_width(png, info);
+	height = png_get_image_height(png, info);
+	color_type = png_get_color_type(png, info);
+
+	// Palette to RGB, small gray depths to 8 bits, tRNS to alpha, then
+	// everything up to 16 bits
+	png_set_expand(png);
+	png_set_expand_16(png);
+
+	if (channels == 4) {
+		if (!(color_type & PNG_COLOR_MASK_ALPHA) && !png_get_valid(png, info, PNG_INFO_tRNS))
+			png_set_filler(png, 0xFFFF, PNG_FILLER_AFTER);
+		if (!(color_type & PNG_COLOR_MASK_COLOR))
+			png_set_gray_to_rgb(png);
+	}
+	else {
+		if (color_type & PNG_COLOR_MASK_COLOR)
+			png_set_rgb_to_gray_fixed(png, 1, -1, -1);
+		if ((color_type & PNG_COLOR_MASK_ALPHA) || png_get_valid(png, info, PNG_INFO_tRNS))
+			png_set_strip_alpha(png);
+	}
+
+	png_read_update_info(png, info);
+
+	if (png_get_rowbytes(png, info) != (size_t)width * channels * 2) {
+		fprintf(stderr, "Unexpected row size reading %s\n", filename.c_str());
+		goto finalise;
+	}
+
+	data.resize((size_t)width * height * channels);
+	rows.resize(height);
+	for (int y = 0; y < height; y++) {
+		rows[y] = (png_bytep)&data[(size_t)y * width * channels];
+	}
+
+	png_read_image(png, rows.data());
+	SwapBytes16(data.data(), data.size());
+	ok = true;
+
+finalise:
+	png_destroy_read_struct(&png, &info, NULL);
+	fclose(fp);
+	return ok;
+}
+
+class ColorImage16 {
+public:
+	typedef RGBA16 Pixel;
+
+	ColorImage16() :
+		width(0), height(0) { }
+
+	ColorImage16(int width, int height) :
+		width(width), height(height), data((size_t)width * height) { }
+
+	ColorImage16(const ColorImage &im) :
+		width(im.GetWidth()), height(im.GetHeight()), data((size_t)width * height) {
+		for (int y = 0; y < height; y++) {
+			const RGBA *src = im.Row(y);
+			RGBA16 *dst = Row(y);
+			for (int x = 0; x < width; x++) {
+				dst[x] = src[x];
+			}
+		}
+	}
+
+	RGBA16 &operator()(int x, int y) {
+		return data[x + (size_t)y * width];
+	}
+
+	RGBA16 operator()(int x, int y) const {
+		return data[x + (size_t)y * width];
+	}
+
+	RGBA16 Get(int x, int y) const {
+		if (x < 0 || x >= width || y < 0 || y >= height) {
+			return RGBA16(0, 0, 0, 0);
+		}
+		else {
+			return data[x + (size_t)y * width];
+		}
+	}
+
+	void Clear() {
+		std::fill(data.begin(), data.end(), RGBA16(0));
+	}
+
+	int GetWidth() const { return width; }
+
+	int GetHeight() const { return height; }
+
+	RGBA16 *Row(int y) { return data.data() + (size_t)y * width; }
+
+	const RGBA16 *Row(int y) const { return data.data() + (size_t)y * width; }
+
+	void Save(std::string filename) const {
+		FILE *fp = fopen(filename.c_str(), "wb");
+		if (fp == NULL) {
+			fprintf(stderr, "Could not open file %s for writing\n", filename.c_str());
+			return;
+		}
+
+		WriteTo(fp, NULL);
+		fclose(fp);
+	}
+
+	bool Encode(std::vector<Byte> &out) const {
+		out.clear();
+		return WriteTo(NULL, &out);
+	}
+
+	// Leaves the image alone if the file can not be read
+	void Load(std::string filename) {
+		int w, h;
+		std::vector<uint16_t> samples;
+		if (!ReadPNG16(filename, 4, w, h, samples)) return;
+		data.resize((size_t)w * h);
+		memcpy((void*)data.data(), samples.data(), samples.size() * sizeof(uint16_t));
+		width = w;
+		height = h;
+	}
+
+private:
+	bool WriteTo(FILE *fp, std::vector<Byte> *out) const {
+		PngFormat format;
+		format.bit_depth = 16;
+		return WritePNG(fp, out, width, height, format, [&](int y, Byte *scratch) {
+			memcpy(scratch, Row(y), (size_t)width * sizeof(RGBA16));
+			SwapBytes16((uint16_t*)scratch, (size_t)width * 4);
+			return (const Byte*)scratch;
+		});
+	}
+
+	int width, height;
+	std::vector<RGBA16> data;
+};
+
+class GrayscaleImage16 {
+public:
+	typedef uint16_t Pixel;
+
+	GrayscaleImage16() :
+		width(0), height(0) { }
+
+	GrayscaleImage16(int width, int height) :
+		width(width), height(height), data((size_t)width * height) { }
+
+	GrayscaleImage16(const GrayscaleImage &im) :
+		width(im.GetWidth()), height(im.GetHeight()), data((size_t)width * height) {
+		for (int y = 0; y < height; y++) {
+			const Byte *src = im.Row(y);
+			uint16_t *dst = Row(y);
+			for (int x = 0; x < width; x++) {
+				dst[x] = src[x] * 257;
+			}
+		}
+	}
+
+	uint16_t &operator()(int x, int y) {
+		return data[x + (size_t)y * width];
+	}
+
+	uint16_t operator()(int x, int y) const {
+		return data[x + (size_t)y * width];
+	}
+
+	uint16_t Get(int x, int y) const {
+		if (x < 0 || x >= width || y < 0 || y >= height) {
+			return 0;
+		}
+		else {
+			return data[x + (size_t)y * width];
+		}
+	}
+
+	void Clear() {
+		std::fill(data.begin(), data.end(), 0);
+	}
+
+	int GetWidth() const { return width; }
+
+	int GetHeight() const { return height; }
+
+	uint16_t *Row(int y) { return data.data() + (size_t)y * width; }
+
+	const uint16_t *Row(int y) const { return data.data() + (size_t)y * width; }
+
+	void Save(std::string filename) const {
+		FILE *fp = fopen(filename.c_str(), "wb");
+		if (fp == NULL) {
+			fprintf(stderr, "Could not open file %s for writing\n", filename.c_str());
+			return;
+		}
+
+		WriteTo(fp, NULL);
+		fclose(fp);
+	}
+
+	bool Encode(std::vector<Byte> &out) const {
+		out.clear();
+		return WriteTo(NULL, &out);
+	}
+
+	// Leaves the image alone if the file can not be read
+	void Load(std::string filename) {
+		int w, h;
+		std::vector<uint16_t> samples;
+		if (!ReadPNG16(filename, 1, w, h, samples)) return;
+		width = w;
+		height = h;
+		data.swap(samples);
+	}
+
+private:
+	bool WriteTo(FILE *fp, std::vector<Byte> *out) const {
+		PngFormat format;
+		format.color_type = PNG_COLOR_TYPE_GRAY;
+		format.bit_depth = 16;
+		return WritePNG(fp, out, width, height, format, [&](int y, Byte *scratch) {
+			memcpy(scratch, Row(y), (size_t)width * sizeof(uint16_t));
+			SwapBytes16((uint16_t*)scratch, width);
+			return (const Byte*)scratch;
+		});
+	}
+
+	int width, height;
+	std::vector<uint16_t> data;
+};
+
+// Round 16 bit samples to the nearest 8 bit value
+inline Byte To8(uint16_t v) {
+	return (Byte)((v * 255u + 32767u) / 65535u);
+}
+
+ColorImage ToColorImage(const ColorImage16 &im) {
+	ColorImage out(im.GetWidth(), im.GetHeight());
+	for (int y = 0; y < im.GetHeight(); y++) {
+		const RGBA16 *src = im.Row(y);
+		RGBA *dst = out.Row(y);
+		for (int x = 0; x < im.GetWidth(); x++) {
+			dst[x] = RGBA(To8(src[x].r), To8(src[x].g), To8(src[x].b), To8(src[x].a));
+		}
+	}
+	return out;
+}
+
+GrayscaleImage ToGrayscaleImage(const GrayscaleImage16 &im) {
+	GrayscaleImage out(im.GetWidth(), im.GetHeight());
+	for (int y = 0; y < im.GetHeight(); y++) {
+		const uint16_t *src = im.Row(y);
+		Byte *dst = out.Row(y);
+		for (int x = 0; x < im.GetWidth(); x++) {
+			dst[x] = To8(src[x]);
+		}
+	}
+	return out;
+}
@@ -0,0 +1,222 @@
+#pragma once
+
+#include "image.h"
+#include <atomic>
+#include <exception>
+#include <future>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <sys/stat.h>
+#include <unordered_map>
+
+// Process wide cache of decoded images, for files that are loaded over and
+// over (background plates, patterns).
+//
+// Entries are keyed by path and only match while the file's modification
+// time and size are unchanged. Images are shared and immutable, so callers
+// hold them as long as they like and eviction never invalidates them. Paths
+// are spread over shards, each with its own lock and LRU list. The byte
+// budget is shared by all shards: once it is exceeded the least recently
+// used entry of any shard goes, so a few large plates that happen to share
+// a shard do not push each other out. A file requested by several threads
+// at once is decoded by the first of them while the others wait for its
+// result.
+
+typedef std::shared_ptr<const ColorImage> ImageRef;
+
+struct ImageCacheStats {
+	long long hits = 0, misses = 0, waits = 0, evictions = 0;
+	long long entries = 0, bytes = 0;
+};
+
+class ImageCache {
+public:
+
+	ImageCache(size_t maxBytes, int shardCount = 16) :
+		shards(std::max(shardCount, 1)), maxBytes(maxBytes) { }
+
+	// The decoded image, or nullptr if the file can not be read
+	ImageRef Get(const std::string &path) {
+		struct stat st;
+		if (stat(path.c_str(), &st) != 0) return nullptr;
+		Version version = { (long long)st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec, (long long)st.st_size };
+
+		Shard &shard = shards[std::hash<std::string>()(path) % shards.size()];
+		std::promise<ImageRef> promise;
+		{
+			std::unique_lock<std::mutex> lock(shard.mutex);
+
+			auto it = shard.index.find(path);
+			if (it != shard.index.end()) {
+				if (it->second->version == version) {
+					it->second->lastUse = ++clock;
+					shard.lru.splice(shard.lru.begin(), shard.lru, it->second);
+					shard.stats.hits++;
+					return it->second->image;
+				}
+				Remove(shard, it);	// file changed since it was decoded
+			}
+
+			auto pending = shard.decoding.find(path);
+			if (pending != shard.decoding.end() && pending->second.version == version) {
+				std::shared_future<ImageRef> result = pending->second.result;
+				shard.stats.waits++;
+				lock.unlock();
+				return result.get();
+			}
+
+			shard.stats.misses++;
+			shard.decoding[path] = { version, promise.get_future().share() };
+		}
+
+		// Whatever happens to the decode, the pending entry goes away and the
+		// waiters get its outcome, or later calls would block forever
+		auto finishDecode = [&]() {
+			auto pending = shard.decoding.find(path);
+			if (pending != shard.decoding.end() && pending->second.version == version) {
+				shard.decoding.erase(pending);
+			}
+		};
+
+		ImageRef image;
+		try {
+			std::shared_ptr<ColorImage> decoded = std::make_shared<ColorImage>();
+			decoded->Load(path);
+			if (decoded->GetWidth() > 0 && decoded->GetHeight() > 0) image = decoded;
+		}
+		catch (...) {
+			{
+				std::lock_guard<std::mutex> lock(shard.mutex);
+				finishDecode();
+			}
+			promise.set_exception(std::current_exception());
+			throw;
+		}
+
+		{
+			std::lock_guard<std::mutex> lock(shard.mutex);
+			finishDecode();
+			if (image && shard.index.find(path) == shard.index.end()) {
+				size_t bytes = (size_t)image->GetWidth() * image->GetHeight() * sizeof(RGBA);
+				shard.lru.push_front({ path, version, image, bytes, ++clock });
+				shard.index[path] = shard.lru.begin();
+				shard.bytes += bytes;
+				totalBytes += bytes;
+			}
+		}
+		Evict();
+		promise.set_value(image);
+		return image;
+	}
+
+	// Drop every entry. Images already handed out stay valid.
+	void Clear() {
+		for (Shard &shard : shards) {
+			std::lock_guard<std::mutex> lock(shard.mutex);
+			totalBytes -= shard.bytes;
+			shard.lru.clear();
+			shard.index.clear();
+			shard.bytes = 0;
+		}
+	}
+
+	ImageCacheStats Stats() const {
+		ImageCacheStats total;
+		for (const Shard &shard : shards) {
+			std::lock_guard<std::mutex> lock(shard.mutex);
+			total.hits += shard.stats.hits;
+			total.misses += shard.stats.misses;
+			total.waits += shard.stats.waits;
+			total.evictions += shard.stats.evictions;
+			total.entries += shard.lru.size();
+			total.bytes += shard.bytes;
+		}
+		return total;
+	}
+
+private:
+	struct Version {
+		long long mtime, size;
+
+		bool operator==(const Version &other) const {
+			return mtime == other.mtime && size == other.size;
+		}
+	};
+
+	struct Entry {
+		std::string path;
+		Version version;
+		ImageRef image;
+		size_t bytes;
+		uint64_t lastUse;	// from clock, larger is more recent
+	};
+
+	struct Pending {
+		Version version;
+		std::shared_future<ImageRef> result;
+	};
+
+	struct Shard {
+		mutable std::mutex mutex;
+		std::list<Entry> lru;	// most recently used first
+		std::unordered_map<std::string, std::list<Entry>::iterator> index;
+		std::unordered_map<std::string, Pending> decoding;
+		size_t bytes = 0;
+		ImageCacheStats stats;
+	};
+
+	typedef std::unordered_map<std::string, std::list<Entry>::iterator>::iterator IndexRef;
+
+	// Caller holds shard.mutex
+	void Remove(Shard &shard, IndexRef it) {
+		shard.bytes -= it->second->bytes;
+		totalBytes -= it->second->bytes;
+		shard.lru.erase(it->second);
+		shard.index.erase(it);
+	}
+
+	// Drop the least recently used entries of the whole cache until it is
+	// within budget. Shards are locked one at a time, never two at once, so
+	// this can not deadlock against Get. The newest entry is kept even if
+	// it alone is over budget, so a single huge image is still shared while
+	// it is in use.
+	void Evict() {
+		while (totalBytes > maxBytes) {
+			Shard *victim = NULL;
+			uint64_t oldest = UINT64_MAX;
+			size_t entries = 0;
+			for (Shard &shard : shards) {
+				std::lock_guard<std::mutex> lock(shard.mutex);
+				entries += shard.lru.size();
+				if (!shard.lru.empty() && shard.lru.back().lastUse < oldest) {
+					oldest = shard.lru.back().lastUse;
+					victim = &shard;
+				}
+			}
+			if (victim == NULL || entries <= 1) return;
+
+			// Unless another thread got there first or the entry was used
+			// meanwhile, in which case the search starts over
+			std::lock_guard<std::mutex> lock(victim->mutex);
+			if (!victim->lru.empty() && victim->lru.back().lastUse == oldest) {
+				Remove(*victim, victim->index.find(victim->lru.back().path));
+				victim->stats.evictions++;
+			}
+		}
+	}
+
+	std::vector<Shard> shards;
+	size_t maxBytes;
+	std::atomic<size_t> totalBytes{ 0 };
+	std::atomic<uint64_t> clock{ 0 };
+};
+
+// Cache shared by the whole process
+const size_t IMAGE_CACHE_BYTES = (size_t)512 << 20;
+
+ImageCache &SharedImageCache() {
+	static ImageCache cache(IMAGE_CACHE_BYTES);
+	return cache;
+}
@@ -0,0 +1,126 @@
+#pragma once
+
+#include "hash.h"
+#include "image.h"
+#include "parallel.h"
+#include <atomic>
+
+// Content hashing and comparison of images.
+//
+// Everything works row by row through a row accessor, so padded or strided
+// views can be hashed and compared as long as they can hand out row
+// pointers. Large images are split into fixed bands of rows that are
+// processed in parallel; the band size does not depend on the thread count,
+// so the same pixels always give the same hash. Row bytes go through the
+// SIMD StripeHasher64, only the short list of band digests through XXH64.
+
+const int HASH_BAND_ROWS = 64;
+
+// Images below this many bytes are handled on the calling thread only
+const size_t PARALLEL_MIN_BYTES = 1 << 20;
+
+int ThreadsFor(size_t bytes) {
+	return bytes < PARALLEL_MIN_BYTES ? 1 : HardwareThreads();
+}
+
+// Hash height rows of rowBytes bytes each, row(y) returning a pointer to row
+// y. Each band of rows is hashed on its own and the band digests, together
+// with the dimensions, are hashed again to give the result.
+template <typename RowFn>
+uint64_t HashRows(int height, size_t rowBytes, RowFn row, uint64_t seed = 0) {
+	int bands = (height + HASH_BAND_ROWS - 1) / HASH_BAND_ROWS;
+	std::vector<uint64_t> digests(bands);
+
+	ParallelFor(bands, ThreadsFor(rowBytes * height), [&](int b) {
+		StripeHasher64 h(seed);
+		int end = std::min(height, (b + 1) * HASH_BAND_ROWS);
+		for (int y = b * HASH_BAND_ROWS; y < end; y++) {
+			h.Update(row(y), rowBytes);
+		}
+		digests[b] = h.Digest();
+	});
+
+	Hasher64 h(seed);
+	uint64_t dims[2] = { (uint64_t)height, (uint64_t)rowBytes };
+	h.Update(dims, sizeof(dims));
+	h.Update(digests.data(), digests.size() * sizeof(uint64_t));
+	return h.Digest();
+}
+
+uint64_t HashImage(const ColorImage &im, uint64_t seed = 0) {
+	return HashRows(im.GetHeight(), (size_t)im.GetWidth() * sizeof(RGBA),
+		[&](int y) { return (const void*)im.Row(y); }, seed);
+}
+
+uint64_t HashImage(const GrayscaleImage &im, uint64_t seed = 0) {
+	return HashRows(im.GetHeight(), (size_t)im.GetWidth(),
+		[&](int y) { return (const void*)im.Row(y); }, seed);
+}
+
+// 128 bit variants for deduplicating large collections, where 64 bits make
+// accidental collisions plausible
+template <typename Image>
+Hash128 HashImage128(const Image &im) {
+	return Hash128{ HashImage(im, 0), HashImage(im, HASH128_SEED) };
+}
+
+// Find the first row (lowest y) at which two row sets differ, or -1. Bands
+// are searched in parallel and a band stops as soon as an earlier band has
+// already found a difference.
+template <typename RowFnA, typename RowFnB>
+int FirstDifferentRow(int height, size_t rowBytes, RowFnA rowA, RowFnB rowB) {
+	std::atomic<int> first(height);
+	int bands = (height + HASH_BAND_ROWS - 1) / HASH_BAND_ROWS;
+
+	ParallelFor(bands, ThreadsFor(rowBytes * height * 2), [&](int b) {
+		int end = std::min(height, (b + 1) * HASH_BAND_ROWS);
+		for (int y = b * HASH_BAND_ROWS; y < end && y < first; y++) {
+			if (memcmp(rowA(y), rowB(y), rowBytes) != 0) {
+				int current = first;
+				while (y < current && !first.compare_exchange_weak(current, y)) { }
+				return;
+			}
+		}
+	});
+
+	return first < height ? (int)first : -1;
+}
+
+// Position of the first differing pixel in row-major order. Returns false if
+// the images are identical. Images of different sizes differ at (0, 0).
+template <typename Image>
+bool FirstDifference(const Image &a, const Image &b, int &x, int &y) {
+	x = y = 0;
+	if (a.GetWidth() != b.GetWidth() || a.GetHeight() != b.GetHeight()) return true;
+
+	size_t pixelBytes = sizeof(*a.Row(0));
+	size_t rowBytes = (size_t)a.GetWidth() * pixelBytes;
+	auto rowA = [&](int r) { return (const void*)a.Row(r); };
+	auto rowB = [&](int r) { return (const void*)b.Row(r); };
+	y = FirstDifferentRow(a.GetHeight(), rowBytes, rowA, rowB);
+	if (y < 0) {
+		y = 0;
+		return false;
+	}
+
+	// Skip equal 8 byte words before looking at single pixels
+	const Byte *pa = (const Byte*)a.Row(y), *pb = (const Byte*)b.Row(y);
+	size_t i = 0;
+	for (; i + 8 <= rowBytes; i += 8) {
+		uint64_t wa, wb;
+		memcpy(&wa, pa + i, 8);
+		memcpy(&wb, pb + i, 8);
+		if (wa != wb) break;
+	}
+	x = (int)(i / pixelBytes);
+	while (memcmp(pa + x * pixelBytes, pb + x * pixelBytes, pixelBytes) == 0) {
+		x++;
+	}
+	return true;
+}
+
+template <typename Image>
+bool Equal(const Image &a, const Image &b) {
+	int x, y;
+	return !FirstDifference(a, b, x, y);
+}
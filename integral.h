@@ -0,0 +1,148 @@
+#pragma once
+
+#include "image.h"
+#include "parallel.h"
+#include <stdint.h>
+
+// Summed-area table of one 8 bit channel, plus optionally of its squares, for
+// constant time sums, means and variances over any rectangle.
+//
+// Tables are (width + 1) x (height + 1) with a zero first row and column so
+// queries need no edge cases. Construction is two passes: prefix sums along
+// each row (rows in parallel), then running sums down the columns, done as
+// whole-row additions that vectorize, with column blocks in parallel.
+class IntegralImage {
+public:
+
+	IntegralImage() :
+		width(0), height(0) { }
+
+	IntegralImage(const GrayscaleImage &im, bool squares = true) {
+		Build(im.GetWidth(), im.GetHeight(), squares,
+			[&](int y, int x) { return im.Row(y)[x]; });
+	}
+
+	// channel 0-3 picks r, g, b or a
+	IntegralImage(const ColorImage &im, int channel, bool squares = true) {
+		Build(im.GetWidth(), im.GetHeight(), squares,
+			[&](int y, int x) { return ((const Byte*)&im.Row(y)[x])[channel]; });
+	}
+
+	int GetWidth() const { return width; }
+
+	int GetHeight() const { return height; }
+
+	// Sum over x0 <= x < x1, y0 <= y < y1, clipped to the image
+	uint64_t Sum(int x0, int y0, int x1, int y1) const {
+		return Query(sum, x0, y0, x1, y1);
+	}
+
+	uint64_t SumSquares(int x0, int y0, int x1, int y1) const {
+		return Query(sq, x0, y0, x1, y1);
+	}
+
+	// Number of pixels of the rectangle inside the image
+	int64_t Area(int x0, int y0, int x1, int y1) const {
+		Clip(x0, y0, x1, y1);
+		return (int64_t)(x1 - x0) * (y1 - y0);
+	}
+
+	double Mean(int x0, int y0, int x1, int y1) const {
+		int64_t n = Area(x0, y0, x1, y1);
+		return n > 0 ? (double)Sum(x0, y0, x1, y1) / n : 0;
+	}
+
+	// Population variance, needs the squares table
+	double Variance(int x0, int y0, int x1, int y1) const {
+		int64_t n = Area(x0, y0, x1, y1);
+		if (n == 0 || sq.empty()) return 0;
+		double mean = (double)Sum(x0, y0, x1, y1) / n;
+		return std::max(0.0, (double)SumSquares(x0, y0, x1, y1) / n - mean * mean);
+	}
+
+private:
+	template <typename PixelFn>
+	void Build(int w, int h, bool squares, PixelFn pixel) {
+		width = w;
+		height = h;
+		size_t stride = width + 1;
+		sum.assign(stride * (height + 1), 0);
+		if (squares) sq.assign(stride * (height + 1), 0);
+
+		ParallelFor(height, HardwareThreads(), [&](int y) {
+			uint64_t *s = &sum[(y + 1) * stride];
+			uint64_t *q = squares ? &sq[(y + 1) * stride] : NULL;
+			uint64_t runS = 0, runQ = 0;
+			for (int x = 0; x < width; x++) {
+				uint64_t v = pixel(y, x);
+				runS += v;
+				s[x + 1] = runS;
+				if (q) {
+					runQ += v * v;
+					q[x + 1] = runQ;
+				}
+			}
+		});
+
+		const int BLOCK = 1024;
+		int blocks = (int)((stride + BLOCK - 1) / BLOCK);
+		ParallelFor(blocks, HardwareThreads(), [&](int b) {
+			size_t x0 = (size_t)b * BLOCK, x1 = std::min(stride, x0 + BLOCK);
+			for (int y = 2; y <= height; y++) {
+				AddRow(&sum[y * stride], &sum[(y - 1) * stride], x0, x1);
+				if (squares) AddRow(&sq[y * stride], &sq[(y - 1) * stride], x0, x1);
+			}
+		});
+	}
+
+	static void AddRow(uint64_t *row, const uint64_t *above, size_t x0, size_t x1) {
+		for (size_t x = x0; x < x1; x++) {
+			row[x] += above[x];
+		}
+	}
+
+	void Clip(int &x0, int &y0, int &x1, int &y1) const {
+		x0 = std::clamp(x0, 0, width);
+		x1 = std::clamp(x1, x0, width);
+		y0 = std::clamp(y0, 0, height);
+		y1 = std::clamp(y1, y0, height);
+	}
+
+	uint64_t Query(const std::vector<uint64_t> &t, int x0, int y0, int x1, int y1) const {
+		if (t.empty()) return 0;
+		Clip(x0, y0, x1, y1);
+		size_t stride = width + 1;
+		return t[y1 * stride + x1] - t[y0 * stride + x1] - t[y1 * stride + x0] + t[y0 * stride + x0];
+	}
+
+	int width, height;
+	std::vector<uint64_t> sum, sq;
+};
+
+// Mean over the (2 * radius + 1)^2 box around every pixel, windows clipped at
+// the borders. Cost does not depend on the radius.
+GrayscaleImage BoxBlur(const GrayscaleImage &im, int radius) {
+	IntegralImage table(im, false);
+	GrayscaleImage out(im.GetWidth(), im.GetHeight());
+
+	ParallelFor(im.GetHeight(), HardwareThreads(), [&](int y) {
+		for (int x = 0; x < im.GetWidth(); x++) {
+			out(x, y) = car(table.Mean(x - radius, y - radius, x + radius + 1, y + radius + 1), 255);
+		}
+	});
+	return out;
+}
+
+ColorImage BoxBlur(const ColorImage &im, int radius) {
+	ColorImage out(im.GetWidth(), im.GetHeight());
+
+	for (int c = 0; c < 4; c++) {
+		IntegralImage table(im, c, false);
+		ParallelFor(im.GetHeight(), HardwareThreads(), [&](int y) {
+			for (int x = 0; x < im.GetWidth(); x++) {
+				((Byte*)&out(x, y))[c] = car(table.Mean(x - radius, y - radius, x + radius + 1, y + radius + 1), 255);
+			}
+		});
+	}
+	return out;
+}
@@ -0,0 +1,231 @@
+#pragma once
+
+#include "image.h"
+#include <stdint.h>
+#include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// Mask images: AlphaImage holds 8 bit coverage (A8), BitMask one bit per
+// pixel for binary masks, packed 64 pixels to a word so boolean operations
+// and area counts work a word at a time.
+
+class AlphaImage {
+public:
+	typedef Byte Pixel;
+
+	AlphaImage() :
+		width(0), height(0) { }
+
+	AlphaImage(int width, int height) :
+		width(width), height(height), data((size_t)width * height, 0) { }
+
+	AlphaImage(const GrayscaleImage &im) :
+		width(im.GetWidth()), height(im.GetHeight()), data((size_t)width * height) {
+		for (int y = 0; y < height; y++) {
+			memcpy(Row(y), im.Row(y), width);
+		}
+	}
+
+	Byte &operator()(int x, int y) {
+		return data[x + (size_t)y * width];
+	}
+
+	Byte operator()(int x, int y) const {
+		return data[x + (size_t)y * width];
+	}
+
+	Byte Get(int x, int y) const {
+		if (x < 0 || x >= width || y < 0 || y >= height) {
+			return 0;
+		}
+		else {
+			return data[x + (size_t)y * width];
+		}
+	}
+
+	void Clear() {
+		std::fill(data.begin(), data.end(), 0);
+	}
+
+	int GetWidth() const { return width; }
+
+	int GetHeight() const { return height; }
+
+	Byte *Row(int y) { return data.data() + (size_t)y * width; }
+
+	const Byte *Row(int y) const { return data.data() + (size_t)y * width; }
+
+private:
+	int width, height;
+	std::vector<Byte> data;
+};
+
+GrayscaleImage ToGrayscaleImage(const AlphaImage &im) {
+	GrayscaleImage out(im.GetWidth(), im.GetHeight());
+	for (int y = 0; y < im.GetHeight(); y++) {
+		memcpy(out.Row(y), im.Row(y), im.GetWidth());
+	}
+	return out;
+}
+
+// Bit x % 64 of word x / 64 of a row is pixel x. Bits past the width are
+// always zero, so whole words can be counted and compared.
+class BitMask {
+public:
+
+	BitMask() :
+		width(0), height(0), stride(0) { }
+
+	BitMask(int width, int height) :
+		width(width), height(height), stride((width + 63) / 64), words((size_t)stride * height, 0) { }
+
+	// Set where the pixel is at least threshold
+	BitMask(const GrayscaleImage &im, Byte threshold = 128) :
+		BitMask(im.GetWidth(), im.GetHeight()) {
+		for (int y = 0; y < height; y++) {
+			PackRow(im.Row(y), threshold, Row(y));
+		}
+	}
+
+	BitMask(const AlphaImage &im, Byte threshold = 128) :
+		BitMask(im.GetWidth(), im.GetHeight()) {
+		for (int y = 0; y < height; y++) {
+			PackRow(im.Row(y), threshold, Row(y));
+		}
+	}
+
+	bool Get(int x, int y) const {
+		if (x < 0 || x >= width || y < 0 || y >= height) return false;
+		return Row(y)[x >> 6] >> (x & 63) & 1;
+	}
+
+	void Set(int x, int y, bool on) {
+		uint64_t bit = (uint64_t)1 << (x & 63);
+		uint64_t &w = Row(y)[x >> 6];
+		w = on ? w | bit : w & ~bit;
+	}
+
+	// Set or clear pixels [x0, x1) of row y, clipped to the mask
+	void SetSpan(int y, int x0, int x1, bool on = true) {
+		x0 = std::max(x0, 0);
+		x1 = std::min(x1, width);
+		if (y < 0 || y >= height || x0 >= x1) return;
+
+		uint64_t *row = Row(y);
+		int first = x0 >> 6, last = (x1 - 1) >> 6;
+		uint64_t head = ~(uint64_t)0 << (x0 & 63);
+		uint64_t tail = ~(uint64_t)0 >> (63 - ((x1 - 1) & 63));
+		for (int i = first; i <= last; i++) {
+			uint64_t m = ~(uint64_t)0;
+			if (i == first) m &= head;
+			if (i == last) m &= tail;
+			row[i] = on ? row[i] | m : row[i] & ~m;
+		}
+	}
+
+	void Clear() {
+		std::fill(words.begin(), words.end(), 0);
+	}
+
+	int GetWidth() const { return width; }
+
+	int GetHeight() const { return height; }
+
+	// Words per row
+	int GetStride() const { return stride; }
+
+	uint64_t *Row(int y) { return words.data() + (size_t)y * stride; }
+
+	const uint64_t *Row(int y) const { return words.data() + (size_t)y * stride; }
+
+	// Boolean operations with a mask of the same size, in place
+	void And(const BitMask &other) {
+		for (size_t i = 0; i < words.size(); i++) words[i] &= other.words[i];
+	}
+
+	void Or(const BitMask &other) {
+		for (size_t i = 0; i < words.size(); i++) words[i] |= other.words[i];
+	}
+
+	void Xor(const BitMask &other) {
+		for (size_t i = 0; i < words.size(); i++) words[i] ^= other.words[i];
+	}
+
+	// Pixels set here but not in other
+	void AndNot(const BitMask &other) {
+		for (size_t i = 0; i < words.size(); i++) words[i] &= ~other.words[i];
+	}
+
+	void Not() {
+		if (stride == 0) return;
+		uint64_t tail = width % 64 ? ((uint64_t)1 << (width % 64)) - 1 : ~(uint64_t)0;
+		for (int y = 0; y < height; y++) {
+			uint64_t *row = Row(y);
+			for (int i = 0; i < stride; i++) row[i] = ~row[i];
+			row[stride - 1] &= tail;
+		}
+	}
+
+	// Number of set pixels
+	int64_t Area() const {
+		int64_t count = 0;
+		for (uint64_t w : words) count += __builtin_popcountll(w);
+		return count;
+	}
+
+	bool operator==(const BitMask &other) const {
+		return width == other.width && height == other.height && words == other.words;
+	}
+
+	bool operator!=(const BitMask &other) const { return !(*this == other); }
+
+private:
+	// Pack a row of bytes into bits, 16 pixels per compare with SSE2
+	void PackRow(const Byte *src, Byte threshold, uint64_t *dst) const {
+		int x = 0;
+
+#ifdef __SSE2__
+		const __m128i t = _mm_set1_epi8((char)threshold);
+		for (; x + 64 <= width; x += 64) {
+			uint64_t w = 0;
+			for (int k = 0; k < 4; k++) {
+				__m128i v = _mm_loadu_si128((const __m128i*)(src + x + 16 * k));
+				// v >= t unsigned is max(v, t) == v
+				uint64_t bits = (uint16_t)_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_max_epu8(v, t), v));
+				w |= bits << (16 * k);
+			}
+			dst[x >> 6] = w;
+		}
+#endif
+
+		for (; x < width; x++) {
+			if (src[x] >= threshold) dst[x >> 6] |= (uint64_t)1 << (x & 63);
+		}
+	}
+
+	int width, height, stride;
+	std::vector<uint64_t> words;
+};
+
+// 255 where the mask is set, 0 elsewhere
+GrayscaleImage ToGrayscaleImage(const BitMask &mask) {
+	GrayscaleImage out(mask.GetWidth(), mask.GetHeight());
+	for (int y = 0; y < mask.GetHeight(); y++) {
+		const uint64_t *row = mask.Row(y);
+		Byte *dst = out.Row(y);
+		for (int x0 = 0; x0 < mask.GetWidth(); x0 += 64) {
+			uint64_t w = row[x0 >> 6];
+			int n = std::min(64, mask.GetWidth() - x0);
+			if (w == 0 || w == ~(uint64_t)0) {
+				memset(dst + x0, w ? 255 : 0, n);
+				continue;
+			}
+			for (int i = 0; i < n; i++) {
+				dst[x0 + i] = (w >> i & 1) ? 255 : 0;
+			}
+		}
+	}
+	return out;
+}
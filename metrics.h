@@ -0,0 +1,244 @@
+#pragma once
+
+#include "image.h"
+#include "parallel.h"
+#include <limits>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// Image quality metrics for measuring what an approximation costs: MSE, PSNR,
+// maximum absolute error, SSIM and per-tile error maps. Colour images are
+// compared on R, G and B (alpha is ignored), SSIM on luminance.
+
+struct ImageError {
+	double mse;
+	double psnr;     // dB, infinite for identical images
+	int maxAbsError;
+};
+
+// Rows per parallel work item
+const int METRIC_BAND_ROWS = 32;
+
+// Add the squared differences of n bytes to sumSq and raise maxAbs to the
+// largest absolute difference. With skipAlpha every fourth byte is ignored.
+void ByteErrors(const Byte *a, const Byte *b, size_t n, bool skipAlpha, uint64_t &sumSq, int &maxAbs) {
+	size_t i = 0;
+
+#ifdef __SSE2__
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i mask = _mm_set1_epi32(skipAlpha ? 0x00FFFFFF : -1);
+	__m128i maxV = zero;
+
+	while (i + 16 <= n) {
+		// 32 bit lanes gain at most 2 * 2 * 255^2 per step, flush well before
+		// they could overflow
+		__m128i acc = zero;
+		for (int steps = 0; steps < 4096 && i + 16 <= n; steps++, i += 16) {
+			__m128i va = _mm_and_si128(_mm_loadu_si128((const __m128i*)(a + i)), mask);
+			__m128i vb = _mm_and_si128(_mm_loadu_si128((const __m128i*)(b + i)), mask);
+			__m128i d = _mm_or_si128(_mm_subs_epu8(va, vb), _mm_subs_epu8(vb, va));
+			maxV = _mm_max_epu8(maxV, d);
+			__m128i lo = _mm_unpacklo_epi8(d, zero);
+			__m128i hi = _mm_unpackhi_epi8(d, zero);
+			acc = _mm_add_epi32(acc, _mm_add_epi32(_mm_madd_epi16(lo, lo), _mm_madd_epi16(hi, hi)));
+		}
+		uint32_t lanes[4];
+		_mm_storeu_si128((__m128i*)lanes, acc);
+		sumSq += (uint64_t)lanes[0] + lanes[1] + lanes[2] + lanes[3];
+	}
+
+	Byte maxBytes[16];
+	_mm_storeu_si128((__m128i*)maxBytes, maxV);
+	for (int k = 0; k < 16; k++) {
+		maxAbs = std::max(maxAbs, (int)maxBytes[k]);
+	}
+#endif
+
+	for (; i < n; i++) {
+		if (skipAlpha && i % 4 == 3) continue;
+		int d = std::abs((int)a[i] - (int)b[i]);
+		sumSq += d * d;
+		maxAbs = std::max(maxAbs, d);
+	}
+}
+
+// Whether every fourth byte of a row is alpha, which metrics skip
+bool HasAlpha(const ColorImage &) { return true; }
+bool HasAlpha(const GrayscaleImage &) { return false; }
+
+template <typename Image>
+ImageError CompareImages(const Image &a, const Image &b) {
+	ImageError result;
+	if (a.GetWidth() != b.GetWidth() || a.GetHeight() != b.GetHeight()) {
+		result.mse = std::numeric_limits<double>::infinity();
+		result.psnr = 0;
+		result.maxAbsError = 255;
+		return result;
+	}
+
+	int height = a.GetHeight();
+	size_t rowBytes = (size_t)a.GetWidth() * sizeof(*a.Row(0));
+	bool skipAlpha = HasAlpha(a);
+	int bands = (height + METRIC_BAND_ROWS - 1) / METRIC_BAND_ROWS;
+	std::vector<uint64_t> sums(bands, 0);
+	std::vector<int> maxima(bands, 0);
+
+	ParallelFor(bands, HardwareThreads(), [&](int band) {
+		int end = std::min(height, (band + 1) * METRIC_BAND_ROWS);
+		for (int y = band * METRIC_BAND_ROWS; y < end; y++) {
+			ByteErrors((const Byte*)a.Row(y), (const Byte*)b.Row(y), rowBytes, skipAlpha, sums[band], maxima[band]);
+		}
+	});
+
+	uint64_t sumSq = 0;
+	result.maxAbsError = 0;
+	for (int band = 0; band < bands; band++) {
+		sumSq += sums[band];
+		result.maxAbsError = std::max(result.maxAbsError, maxima[band]);
+	}
+
+	double samples = (double)a.GetWidth() * height * (skipAlpha ? 3 : 1);
+	result.mse = samples > 0 ? sumSq / samples : 0;
+	result.psnr = result.mse > 0 ? 10.0 * log10(255.0 * 255.0 / result.mse)
+		: std::numeric_limits<double>::infinity();
+	return result;
+}
+
+// Luminance of row y, either the row itself or converted into scratch
+const Byte *LumaRow(const GrayscaleImage &im, int y, Byte *) {
+	return im.Row(y);
+}
+
+const Byte *LumaRow(const ColorImage &im, int y, Byte *scratch) {
+	const RGBA *row = im.Row(y);
+	for (int x = 0; x < im.GetWidth(); x++) {
+		scratch[x] = row[x].luminance();
+	}
+	return scratch;
+}
+
+// Mean SSIM over every window x window square (box weighted, stride 1).
+//
+// Window sums are never recomputed from scratch: per column sums over the
+// window's rows are kept and slid down one row at a time, and each output
+// row slides a horizontal sum across them. Every band of output rows keeps
+// its own column sums and a ring of the last `window` luminance rows, so
+// memory is O(width) per thread however large the image.
+template <typename Image>
+double SSIM(const Image &a, const Image &b, int window = 8) {
+	int width = a.GetWidth(), height = a.GetHeight();
+	if (width != b.GetWidth() || height != b.GetHeight()) return 0;
+	window = std::min(window, std::min(width, height));
+	if (window <= 0) return 1;
+
+	const double C1 = (0.01 * 255) * (0.01 * 255);
+	const double C2 = (0.03 * 255) * (0.03 * 255);
+	const double n = (double)window * window;
+
+	int outRows = height - window + 1, outCols = width - window + 1;
+	int bands = (outRows + METRIC_BAND_ROWS - 1) / METRIC_BAND_ROWS;
+	std::vector<double> bandSums(bands, 0);
+
+	ParallelFor(bands, HardwareThreads(), [&](int band) {
+		int y0 = band * METRIC_BAND_ROWS;
+		int y1 = std::min(outRows, y0 + METRIC_BAND_ROWS);
+
+		std::vector<uint32_t> sa(width, 0), sb(width, 0), saa(width, 0), sbb(width, 0), sab(width, 0);
+		std::vector<Byte> ringA((size_t)window * width), ringB((size_t)window * width);
+		std::vector<Byte> scratchA(width), scratchB(width);
+
+		// Add (sign 1) or remove (sign -1) row y from the column sums. Rows
+		// are kept in ring slot y % window so they can be removed later.
+		auto addRow = [&](int y, int sign) {
+			Byte *ra = &ringA[(size_t)(y % window) * width];
+			Byte *rb = &ringB[(size_t)(y % window) * width];
+			if (sign > 0) {
+				memcpy(ra, LumaRow(a, y, scratchA.data()), width);
+				memcpy(rb, LumaRow(b, y, scratchB.data()), width);
+			}
+			for (int x = 0; x < width; x++) {
+				uint32_t va = ra[x], vb = rb[x];
+				sa[x] += sign * va;
+				sb[x] += sign * vb;
+				saa[x] += sign * va * va;
+				sbb[x] += sign * vb * vb;
+				sab[x] += sign * va * vb;
+			}
+		};
+
+		for (int y = y0; y < y0 + window; y++) {
+			addRow(y, 1);
+		}
+
+		double total = 0;
+		for (int y = y0; y < y1; y++) {
+			if (y > y0) {
+				addRow(y - 1, -1);
+				addRow(y + window - 1, 1);
+			}
+
+			int64_t ha = 0, hb = 0, haa = 0, hbb = 0, hab = 0;
+			for (int x = 0; x < window; x++) {
+				ha += sa[x]; hb += sb[x]; haa += saa[x]; hbb += sbb[x]; hab += sab[x];
+			}
+
+			for (int x = 0; ; x++) {
+				double ma = ha / n, mb = hb / n;
+				double va = haa / n - ma * ma, vb = hbb / n - mb * mb;
+				double cov = hab / n - ma * mb;
+				total += ((2 * ma * mb + C1) * (2 * cov + C2)) /
+					((ma * ma + mb * mb + C1) * (va + vb + C2));
+
+				if (x + 1 >= outCols) break;
+				ha += (int64_t)sa[x + window] - sa[x];
+				hb += (int64_t)sb[x + window] - sb[x];
+				haa += (int64_t)saa[x + window] - saa[x];
+				hbb += (int64_t)sbb[x + window] - sbb[x];
+				hab += (int64_t)sab[x + window] - sab[x];
+			}
+		}
+		bandSums[band] = total;
+	});
+
+	double total = 0;
+	for (int band = 0; band < bands; band++) {
+		total += bandSums[band];
+	}
+	return total / ((double)outRows * outCols);
+}
+
+// One pixel per tileSize x tileSize tile holding the tile's root mean square
+// error times gain (clamped to 255), ready to be written with Save
+template <typename Image>
+GrayscaleImage ErrorMap(const Image &a, const Image &b, int tileSize = 16, double gain = 4.0) {
+	if (a.GetWidth() != b.GetWidth() || a.GetHeight() != b.GetHeight() || tileSize <= 0) {
+		return GrayscaleImage();
+	}
+
+	int tilesX = (a.GetWidth() + tileSize - 1) / tileSize;
+	int tilesY = (a.GetHeight() + tileSize - 1) / tileSize;
+	size_t pixelBytes = sizeof(*a.Row(0));
+	bool skipAlpha = HasAlpha(a);
+	GrayscaleImage map(tilesX, tilesY);
+
+	ParallelFor(tilesY, HardwareThreads(), [&](int ty) {
+		int y0 = ty * tileSize, y1 = std::min(a.GetHeight(), y0 + tileSize);
+		for (int tx = 0; tx < tilesX; tx++) {
+			int x0 = tx * tileSize, x1 = std::min(a.GetWidth(), x0 + tileSize);
+			uint64_t sumSq = 0;
+			int maxAbs = 0;
+			for (int y = y0; y < y1; y++) {
+				ByteErrors((const Byte*)a.Row(y) + x0 * pixelBytes, (const Byte*)b.Row(y) + x0 * pixelBytes,
+					(x1 - x0) * pixelBytes, skipAlpha, sumSq, maxAbs);
+			}
+			double samples = (double)(x1 - x0) * (y1 - y0) * (skipAlpha ? 3 : 1);
+			map(tx, ty) = car(sqrt(sumSq / samples) * gain, 255);
+		}
+	});
+
+	return map;
+}
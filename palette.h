@@ -0,0 +1,222 @@
+#pragma once
+
+#include "image.h"
+#include <stdint.h>
+
+// Median cut colour quantization with optional Floyd-Steinberg dithering,
+// for writing images with too many colours as small indexed PNGs.
+
+// Colours are binned at 5 bits for r, g, b and 3 bits for alpha
+const int QUANT_BINS = 1 << 18;
+
+int QuantBin(int r, int g, int b, int a) {
+	return (r >> 3) << 13 | (g >> 3) << 8 | (b >> 3) << 3 | (a >> 5);
+}
+
+struct QuantizedImage {
+	int width = 0, height = 0;
+	std::vector<uint32_t> palette;	// packed RGBA, see PackRGBA
+	std::vector<Byte> indices;		// row-major, one per pixel
+
+	void Save(std::string filename) const {
+		FILE *fp = fopen(filename.c_str(), "wb");
+		if (fp == NULL) {
+			fprintf(stderr, "Could not open file %s for writing\n", filename.c_str());
+			return;
+		}
+		WriteTo(fp, NULL);
+		fclose(fp);
+	}
+
+	bool Encode(std::vector<Byte> &out) const {
+		out.clear();
+		return WriteTo(NULL, &out);
+	}
+
+private:
+	bool WriteTo(FILE *fp, std::vector<Byte> *out) const {
+		PngFormat format;
+		std::vector<Byte> remap;
+		MakePaletteFormat(palette, format, remap);
+		return WritePNG(fp, out, width, height, format, [&](int y, Byte *scratch) {
+			for (int x = 0; x < width; x++) {
+				scratch[x] = remap[indices[(size_t)y * width + x]];
+			}
+			return (const Byte*)scratch;
+		});
+	}
+};
+
+// Up to `colors` representative colours. The occupied histogram bins are
+// recursively split at the median of the box with the most pixels times
+// widest extent, along that extent, and every final box contributes the
+// pixel weighted mean of its bins.
+std::vector<uint32_t> MedianCutPalette(const ColorImage &im, int colors) {
+	struct Bin {
+		uint32_t count;
+		uint64_t sum[4];
+		float mean[4];
+	};
+
+	std::vector<Bin> bins;
+	{
+		std::vector<int> slot(QUANT_BINS, -1);
+		for (int y = 0; y < im.GetHeight(); y++) {
+			const RGBA *row = im.Row(y);
+			for (int x = 0; x < im.GetWidth(); x++) {
+				RGBA c = row[x];
+				int &s = slot[QuantBin(c.r, c.g, c.b, c.a)];
+				if (s < 0) {
+					s = (int)bins.size();
+					bins.push_back(Bin());
+				}
+				Bin &b = bins[s];
+				b.count++;
+				b.sum[0] += c.r; b.sum[1] += c.g; b.sum[2] += c.b; b.sum[3] += c.a;
+			}
+		}
+	}
+	for (Bin &b : bins) {
+		for (int k = 0; k < 4; k++) b.mean[k] = (float)b.sum[k] / b.count;
+	}
+
+	struct Box {
+		int begin, end;
+		uint64_t count;
+		int axis;
+		float extent;
+	};
+	auto measure = [&](Box &box) {
+		float lo[4] = { 255, 255, 255, 255 }, hi[4] = { 0, 0, 0, 0 };
+		box.count = 0;
+		for (int i = box.begin; i < box.end; i++) {
+			box.count += bins[i].count;
+			for (int k = 0; k < 4; k++) {
+				lo[k] = std::min(lo[k], bins[i].mean[k]);
+				hi[k] = std::max(hi[k], bins[i].mean[k]);
+			}
+		}
+		box.axis = 0;
+		for (int k = 1; k < 4; k++) {
+			if (hi[k] - lo[k] > hi[box.axis] - lo[box.axis]) box.axis = k;
+		}
+		box.extent = hi[box.axis] - lo[box.axis];
+	};
+
+	std::vector<Box> boxes;
+	if (!bins.empty()) {
+		boxes.push_back(Box{ 0, (int)bins.size(), 0, 0, 0 });
+		measure(boxes[0]);
+	}
+
+	while ((int)boxes.size() < colors) {
+		int pick = -1;
+		double best = 0;
+		for (int i = 0; i < (int)boxes.size(); i++) {
+			double score = (double)boxes[i].count * boxes[i].extent;
+			if (boxes[i].end - boxes[i].begin > 1 && score > best) {
+				best = score;
+				pick = i;
+			}
+		}
+		if (pick < 0) break;
+
+		Box box = boxes[pick];
+		int axis = box.axis;
+		std::sort(bins.begin() + box.begin, bins.begin() + box.end,
+			[axis](const Bin &a, const Bin &b) { return a.mean[axis] < b.mean[axis]; });
+
+		// First bin past half the pixels, keeping both halves non-empty
+		uint64_t seen = 0;
+		int split = box.begin + 1;
+		for (int i = box.begin; i < box.end - 1; i++) {
+			seen += bins[i].count;
+			split = i + 1;
+			if (seen * 2 >= box.count) break;
+		}
+
+		Box low{ box.begin, split, 0, 0, 0 }, high{ split, box.end, 0, 0, 0 };
+		measure(low);
+		measure(high);
+		boxes[pick] = low;
+		boxes.push_back(high);
+	}
+
+	std::vector<uint32_t> palette;
+	for (const Box &box : boxes) {
+		uint64_t sum[4] = { 0, 0, 0, 0 };
+		for (int i = box.begin; i < box.end; i++) {
+			for (int k = 0; k < 4; k++) sum[k] += bins[i].sum[k];
+		}
+		palette.push_back(PackRGBA(RGBA(
+			(sum[0] + box.count / 2) / box.count, (sum[1] + box.count / 2) / box.count,
+			(sum[2] + box.count / 2) / box.count, (sum[3] + box.count / 2) / box.count)));
+	}
+	return palette;
+}
+
+// Map every pixel to its nearest palette colour, diffusing the error to the
+// neighbours when dithering. Nearest colours are looked up once per
+// histogram bin and cached, so the palette search is not paid per pixel.
+QuantizedImage Quantize(const ColorImage &im, int colors = 256, bool dither = true) {
+	QuantizedImage q;
+	q.width = im.GetWidth();
+	q.height = im.GetHeight();
+	q.palette = MedianCutPalette(im, std::clamp(colors, 1, 256));
+	q.indices.resize((size_t)q.width * q.height);
+	if (q.palette.empty()) return q;
+
+	std::vector<short> nearest(QUANT_BINS, -1);
+	auto lookup = [&](int r, int g, int b, int a) {
+		short &n = nearest[QuantBin(r, g, b, a)];
+		if (n < 0) {
+			// Search from the bin's centre so the cache does not depend on
+			// which pixel got there first
+			int cr = (r & ~7) | 4, cg = (g & ~7) | 4, cb = (b & ~7) | 4, ca = (a & ~31) | 16;
+			int bestDist = INT32_MAX;
+			for (int i = 0; i < (int)q.palette.size(); i++) {
+				uint32_t p = q.palette[i];
+				int dr = (int)(p & 0xFF) - cr, dg = (int)(p >> 8 & 0xFF) - cg;
+				int db = (int)(p >> 16 & 0xFF) - cb, da = (int)(p >> 24) - ca;
+				int dist = dr * dr + dg * dg + db * db + da * da;
+				if (dist < bestDist) {
+					bestDist = dist;
+					n = (short)i;
+				}
+			}
+		}
+		return (int)n;
+	};
+
+	// Errors for the current and next row, 4 channels, one pixel of padding
+	// either side
+	std::vector<int> err((size_t)(q.width + 2) * 4, 0), nextErr((size_t)(q.width + 2) * 4, 0);
+
+	for (int y = 0; y < q.height; y++) {
+		const RGBA *row = im.Row(y);
+		std::fill(nextErr.begin(), nextErr.end(), 0);
+
+		for (int x = 0; x < q.width; x++) {
+			const Byte *px = (const Byte*)&row[x];
+			int want[4];
+			for (int k = 0; k < 4; k++) {
+				want[k] = dither ? std::clamp(px[k] + err[(x + 1) * 4 + k] / 16, 0, 255) : px[k];
+			}
+
+			int index = lookup(want[0], want[1], want[2], want[3]);
+			q.indices[(size_t)y * q.width + x] = (Byte)index;
+			if (!dither) continue;
+
+			uint32_t p = q.palette[index];
+			for (int k = 0; k < 4; k++) {
+				int e = want[k] - (int)(p >> (8 * k) & 0xFF);
+				err[(x + 2) * 4 + k] += e * 7;
+				nextErr[x * 4 + k] += e * 3;
+				nextErr[(x + 1) * 4 + k] += e * 5;
+				nextErr[(x + 2) * 4 + k] += e;
+			}
+		}
+		std::swap(err, nextErr);
+	}
+	return q;
+}
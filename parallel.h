@@ -0,0 +1,125 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Number of threads the hardware can run concurrently (at least 1).
+int HardwareThreads() {
+	unsigned n = std::thread::hardware_concurrency();
+	return n == 0 ? 1 : (int)n;
+}
+
+// Fixed set of worker threads that run submitted tasks in FIFO order.
+class ThreadPool {
+public:
+
+	ThreadPool(int threads) {
+		for (int t = 0; t < threads; t++) {
+			workers.emplace_back([this]() { Work(); });
+		}
+	}
+
+	~ThreadPool() {
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			stopping = true;
+		}
+		wake.notify_all();
+		for (size_t t = 0; t < workers.size(); t++) {
+			workers[t].join();
+		}
+	}
+
+	void Submit(std::function<void()> task) {
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			tasks.push_back(std::move(task));
+		}
+		wake.notify_one();
+	}
+
+	int GetThreads() const { return (int)workers.size(); }
+
+private:
+	void Work() {
+		for (;;) {
+			std::function<void()> task;
+			{
+				std::unique_lock<std::mutex> lock(mutex);
+				wake.wait(lock, [this]() { return stopping || !tasks.empty(); });
+				if (tasks.empty()) return;
+				task = std::move(tasks.front());
+				tasks.pop_front();
+			}
+			task();
+		}
+	}
+
+	std::vector<std::thread> workers;
+	std::deque<std::function<void()>> tasks;
+	std::mutex mutex;
+	std::condition_variable wake;
+	bool stopping = false;
+};
+
+// Process-wide pool, started on first use and kept warm afterwards. The
+// calling thread always takes part in ParallelFor, so one thread fewer than
+// the core count is enough.
+ThreadPool &SharedPool() {
+	static ThreadPool pool(std::max(1, HardwareThreads() - 1));
+	return pool;
+}
+
+// Calls fn(i) for every i in [0, count) using up to `threads` threads.
+// Indices are handed out one at a time so uneven work balances out. The
+// caller works through indices too and only waits for indices other threads
+// have already claimed, so this is safe to call from inside pool tasks.
+template <typename F>
+void ParallelFor(int count, int threads, F fn) {
+	threads = std::max(1, std::min(threads, count));
+
+	if (threads == 1) {
+		for (int i = 0; i < count; i++) {
+			fn(i);
+		}
+		return;
+	}
+
+	struct State {
+		std::atomic<int> next{0};
+		int done = 0;
+		std::mutex mutex;
+		std::condition_variable finished;
+	};
+	std::shared_ptr<State> state = std::make_shared<State>();
+
+	// Helpers that start after all indices are claimed return straight away,
+	// by then fn may be gone so it is only touched for claimed indices.
+	auto worker = [state, count, &fn]() {
+		int completed = 0;
+		for (int i = state->next++; i < count; i = state->next++) {
+			fn(i);
+			completed++;
+		}
+		if (completed > 0) {
+			std::lock_guard<std::mutex> lock(state->mutex);
+			state->done += completed;
+			if (state->done == count) state->finished.notify_all();
+		}
+	};
+
+	for (int t = 1; t < threads; t++) {
+		SharedPool().Submit(worker);
+	}
+	worker();
+
+	std::unique_lock<std::mutex> lock(state->mutex);
+	state->finished.wait(lock, [&]() { return state->done == count; });
+}
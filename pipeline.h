@@ -0,0 +1,299 @@
+#pragma once
+
+// load -> render -> encode -> write as coroutines on the shared pool.
+// needs C++20 coroutines; without them this header is empty
+#if defined(__cpp_impl_coroutine) && __has_include(<coroutine>)
+
+#include "scene.h"
+#include "writer.h"
+#include <atomic>
+#include <condition_variable>
+#include <coroutine>
+#include <deque>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <mutex>
+#include <optional>
+#include <sstream>
+#include <string>
+#include <vector>
+
+// every stage is a coroutine that suspends instead of blocking: on a full
+// or empty channel, or to hop onto a pool thread. a suspended stage holds no
+// thread, so a few pool threads drive any number of stages, and the bounded
+// channels between stages give back-pressure: a fast stage stops when its
+// output fills up instead of queueing without bound
+
+// resume a suspended coroutine on a pool thread, never inline, so chains of
+// hand-offs do not grow the stack
+void resumeOnPool(std::coroutine_handle<> h) {
+  SharedPool().Submit([h]() { h.resume(); });
+}
+
+// co_await onPool() moves the rest of the coroutine onto a pool thread
+struct onPool {
+  bool await_ready() { return false; }
+  void await_suspend(std::coroutine_handle<> h) { resumeOnPool(h); }
+  void await_resume() {}
+};
+
+// coroutine that starts when start() is called and frees itself when done
+struct Task {
+  struct promise_type {
+    Task get_return_object() {
+      return Task{std::coroutine_handle<promise_type>::from_promise(*this)};
+    }
+    std::suspend_always initial_suspend() noexcept { return {}; }
+    std::suspend_never final_suspend() noexcept { return {}; }
+    void return_void() {}
+    void unhandled_exception() { std::terminate(); }
+  };
+
+  std::coroutine_handle<promise_type> handle;
+
+  void start() { resumeOnPool(handle); }
+};
+
+// lets a plain thread wait for a number of tasks to finish
+class WaitGroup {
+public:
+  explicit WaitGroup(int count) : remaining(count) {}
+
+  void done() {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (--remaining == 0)
+      finished.notify_all();
+  }
+
+  void wait() {
+    std::unique_lock<std::mutex> lock(mutex);
+    finished.wait(lock, [this]() { return remaining == 0; });
+  }
+
+private:
+  int remaining;
+  std::mutex mutex;
+  std::condition_variable finished;
+};
+
+// bounded multi producer, multi consumer queue for coroutines.
+// co_await send(v) suspends while the channel is full, co_await receive()
+// while it is empty, and gives std::nullopt once it is closed and drained
+template <typename T> class Channel {
+public:
+  explicit Channel(size_t capacity) : capacity(std::max<size_t>(1, capacity)) {}
+
+  struct SendAwaiter {
+    Channel &channel;
+    T value;
+
+    bool await_ready() { return false; }
+
+    // returning false carries on without suspending
+    bool await_suspend(std::coroutine_handle<> h) {
+      std::lock_guard<std::mutex> lock(channel.mutex);
+      if (!channel.receivers.empty()) {
+        Receiver r = channel.receivers.front();
+        channel.receivers.pop_front();
+        *r.result = std::move(value);
+        resumeOnPool(r.handle);
+        return false;
+      }
+      if (channel.items.size() < channel.capacity) {
+        channel.items.push_back(std::move(value));
+        return false;
+      }
+      channel.senders.push_back({h, &value});
+      return true;
+    }
+
+    void await_resume() {}
+  };
+
+  struct ReceiveAwaiter {
+    Channel &channel;
+    std::optional<T> result;
+
+    bool await_ready() { return false; }
+
+    bool await_suspend(std::coroutine_handle<> h) {
+      std::lock_guard<std::mutex> lock(channel.mutex);
+      if (!channel.items.empty()) {
+        result = std::move(channel.items.front());
+        channel.items.pop_front();
+        // room now for the longest waiting sender
+        if (!channel.senders.empty()) {
+          Sender s = channel.senders.front();
+          channel.senders.pop_front();
+          channel.items.push_back(std::move(*s.value));
+          resumeOnPool(s.handle);
+        }
+        return false;
+      }
+      if (channel.closed)
+        return false;
+      channel.receivers.push_back({h, &result});
+      return true;
+    }
+
+    std::optional<T> await_resume() { return std::move(result); }
+  };
+
+  SendAwaiter send(T value) { return SendAwaiter{*this, std::move(value)}; }
+
+  ReceiveAwaiter receive() { return ReceiveAwaiter{*this, std::nullopt}; }
+
+  // no more sends; waiting receivers wake up with std::nullopt
+  void close() {
+    std::lock_guard<std::mutex> lock(mutex);
+    closed = true;
+    for (Receiver &r : receivers)
+      resumeOnPool(r.handle);
+    receivers.clear();
+  }
+
+private:
+  struct Sender {
+    std::coroutine_handle<> handle;
+    T *value;
+  };
+  struct Receiver {
+    std::coroutine_handle<> handle;
+    std::optional<T> *result;
+  };
+
+  size_t capacity;
+  bool closed = false;
+  std::deque<T> items;
+  std::deque<Sender> senders;
+  std::deque<Receiver> receivers;
+  std::mutex mutex;
+};
+
+// one scene file on its way through the pipeline
+struct PipelineJob {
+  std::string input, output;
+  Scene scene;
+  ColorImage image;
+  std::vector<Byte> encoded;
+};
+
+struct PipelineOptions {
+  size_t channelCapacity = 4;
+  int renderWorkers = 2, encodeWorkers = 2;
+};
+
+// the steps, shared with the sequential path. scenes that fail to load are
+// reported and skipped
+bool loadJob(PipelineJob &job) {
+  std::ifstream in(job.input);
+  if (!in) {
+    std::cerr << job.input << ": could not read" << std::endl;
+    return false;
+  }
+  std::stringstream ss;
+  ss << in.rdbuf();
+  std::string error;
+  if (!parseScene(ss.str(), job.scene, &error)) {
+    std::cerr << job.input << ": " << error << std::endl;
+    return false;
+  }
+  return true;
+}
+
+void renderJob(PipelineJob &job, const RenderSettings &settings) {
+  renderScene(job.image, job.scene, settings);
+}
+
+void encodeJob(PipelineJob &job) {
+  job.image.Encode(job.encoded);
+  job.image = ColorImage(); // frees the pixels before the write stage
+}
+
+// render every input scene to the matching output PNG, one at a time
+void runSequential(const std::vector<std::string> &inputs,
+                   const std::vector<std::string> &outputs,
+                   const RenderSettings &settings, FileWriter &writer) {
+  for (size_t i = 0; i < inputs.size(); i++) {
+    PipelineJob job;
+    job.input = inputs[i];
+    job.output = outputs[i];
+    if (!loadJob(job))
+      continue;
+    renderJob(job, settings);
+    encodeJob(job);
+    writer.write(job.output, std::move(job.encoded));
+  }
+  writer.flush();
+}
+
+namespace pipeline {
+
+Task load(const std::vector<std::string> &inputs,
+          const std::vector<std::string> &outputs, Channel<PipelineJob> &out,
+          WaitGroup &done) {
+  for (size_t i = 0; i < inputs.size(); i++) {
+    PipelineJob job;
+    job.input = inputs[i];
+    job.output = outputs[i];
+    if (loadJob(job))
+      co_await out.send(std::move(job));
+  }
+  out.close();
+  done.done();
+}
+
+// several workers share a stage; the last to finish closes its output
+Task stage(Channel<PipelineJob> &in, Channel<PipelineJob> &out,
+           std::atomic<int> &workersLeft, WaitGroup &done,
+           std::function<void(PipelineJob &)> step) {
+  while (std::optional<PipelineJob> job = co_await in.receive()) {
+    co_await onPool();
+    step(*job);
+    co_await out.send(std::move(*job));
+  }
+  if (--workersLeft == 0)
+    out.close();
+  done.done();
+}
+
+Task write(Channel<PipelineJob> &in, FileWriter &writer, WaitGroup &done) {
+  while (std::optional<PipelineJob> job = co_await in.receive())
+    writer.write(job->output, std::move(job->encoded));
+  done.done();
+}
+
+} // namespace pipeline
+
+// same result as runSequential with the stages overlapped
+void runPipeline(const std::vector<std::string> &inputs,
+                 const std::vector<std::string> &outputs,
+                 const RenderSettings &settings, FileWriter &writer,
+                 const PipelineOptions &options = PipelineOptions()) {
+  Channel<PipelineJob> loaded(options.channelCapacity);
+  Channel<PipelineJob> rendered(options.channelCapacity);
+  Channel<PipelineJob> encoded(options.channelCapacity);
+  int renderWorkers = std::max(1, options.renderWorkers);
+  int encodeWorkers = std::max(1, options.encodeWorkers);
+  std::atomic<int> renderLeft(renderWorkers), encodeLeft(encodeWorkers);
+  WaitGroup done(2 + renderWorkers + encodeWorkers);
+
+  std::vector<Task> tasks;
+  tasks.push_back(pipeline::load(inputs, outputs, loaded, done));
+  for (int i = 0; i < renderWorkers; i++)
+    tasks.push_back(pipeline::stage(
+        loaded, rendered, renderLeft, done,
+        [&](PipelineJob &job) { renderJob(job, settings); }));
+  for (int i = 0; i < encodeWorkers; i++)
+    tasks.push_back(pipeline::stage(rendered, encoded, encodeLeft, done,
+                                    encodeJob));
+  tasks.push_back(pipeline::write(encoded, writer, done));
+
+  for (Task &t : tasks)
+    t.start();
+  done.wait();
+  writer.flush();
+}
+
+#endif
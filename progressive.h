@@ -0,0 +1,109 @@
+#pragma once
+
+#include "scene.h"
+#include <atomic>
+#include <chrono>
+
+// what a progressive render managed to do before its deadline
+struct ProgressiveResult {
+  int tileHeight = 0;
+  std::vector<bool> refined; // per tile, true if drawn at full quality
+  bool cancelled = false;
+  double elapsedMs = 0;
+
+  int refinedCount() const {
+    int n = 0;
+    for (bool r : refined)
+      n += r;
+    return n;
+  }
+};
+
+// copy of the scene with every coordinate divided by factor
+Scene scaleScene(const Scene &scene, int factor) {
+  float s = 1.0f / factor;
+  Scene small;
+  small.width = (scene.width + factor - 1) / factor;
+  small.height = (scene.height + factor - 1) / factor;
+  small.background = scene.background;
+  small.shapes = scene.shapes;
+
+  for (Shape &shape : small.shapes) {
+    for (Point &p : shape.vertices)
+      p = {p.x * s, p.y * s};
+    if (!shape.hasGradient)
+      continue;
+    shape.gradient.p1 = {shape.gradient.p1.x * s, shape.gradient.p1.y * s};
+    shape.gradient.p2 = {shape.gradient.p2.x * s, shape.gradient.p2.y * s};
+    shape.gradient.radius *= s;
+  }
+  return small;
+}
+
+// render a coarse preview of the whole frame first, then redraw row tiles at
+// full quality until the deadline (milliseconds from the call) is reached or
+// *cancel becomes true. tiles are only started when the time measured for
+// earlier tiles says they will finish in time, and a tile that has started
+// always finishes, so every tile is either all coarse or all refined
+ProgressiveResult renderProgressive(ColorImage &image, const Scene &scene,
+                                    double deadlineMs,
+                                    const std::atomic<bool> *cancel = nullptr,
+                                    const RenderSettings &settings =
+                                        RenderSettings(),
+                                    int coarseFactor = 4) {
+  typedef std::chrono::steady_clock Clock;
+  Clock::time_point start = Clock::now();
+  auto elapsed = [&]() {
+    return std::chrono::duration<double, std::milli>(Clock::now() - start)
+        .count();
+  };
+
+  if (image.GetWidth() != scene.width || image.GetHeight() != scene.height)
+    image = ColorImage(scene.width, scene.height);
+
+  ProgressiveResult result;
+  result.tileHeight = std::max(1, settings.tileHeight);
+  int tiles = (scene.height + result.tileHeight - 1) / result.tileHeight;
+
+  // coarse pass at reduced resolution, blown up with nearest neighbour
+  ColorImage coarse;
+  renderScene(coarse, scaleScene(scene, coarseFactor), settings);
+  ParallelFor(scene.height, settings.threads, [&](int y) {
+    for (int x = 0; x < scene.width; x++)
+      image(x, y) = coarse(x / coarseFactor, y / coarseFactor);
+  });
+
+  // refinement. worst tile time so far is the estimate for the next one
+  std::vector<char> refined(tiles, 0);
+  std::atomic<bool> stop(false), cancelled(false);
+  std::atomic<long long> worstTileUs(0);
+
+  ParallelFor(tiles, settings.threads, [&](int t) {
+    if (stop)
+      return;
+    if (cancel != nullptr && *cancel)
+      cancelled = true;
+    if (cancelled || elapsed() + worstTileUs / 1000.0 > deadlineMs) {
+      stop = true;
+      return;
+    }
+
+    Clock::time_point tileStart = Clock::now();
+    int y0 = t * result.tileHeight;
+    int y1 = std::min(scene.height, y0 + result.tileHeight);
+    renderTile(image, scene, y0, y1, settings.kernel);
+    refined[t] = 1;
+
+    long long us = std::chrono::duration_cast<std::chrono::microseconds>(
+                       Clock::now() - tileStart)
+                       .count();
+    long long worst = worstTileUs;
+    while (us > worst && !worstTileUs.compare_exchange_weak(worst, us)) {
+    }
+  });
+
+  result.refined.assign(refined.begin(), refined.end());
+  result.cancelled = cancelled;
+  result.elapsedMs = elapsed();
+  return result;
+}
@@ -0,0 +1,89 @@
+#pragma once
+
+#include "image.h"
+
+// Encoder for the "Quite OK Image" format (https://qoiformat.org). Much
+// cheaper than deflate, which matters when images are produced per request.
+
+// Encode as QOI (RGBA, sRGB) into memory, replacing the contents of out
+void EncodeQOI(const ColorImage &im, std::vector<Byte> &out) {
+	const Byte QOI_OP_INDEX = 0x00, QOI_OP_DIFF = 0x40, QOI_OP_LUMA = 0x80,
+		QOI_OP_RUN = 0xc0, QOI_OP_RGB = 0xfe, QOI_OP_RGBA = 0xff;
+
+	int count = im.GetWidth() * im.GetHeight();
+	out.clear();
+	out.reserve(14 + count + 8);
+
+	out.push_back('q'); out.push_back('o'); out.push_back('i'); out.push_back('f');
+	PutBigEndian32(out, im.GetWidth());
+	PutBigEndian32(out, im.GetHeight());
+	out.push_back(4); // channels
+	out.push_back(0); // sRGB with linear alpha
+
+	RGBA index[64];
+	for (int i = 0; i < 64; i++) index[i] = RGBA(0, 0, 0, 0);
+	RGBA prev(0, 0, 0, 255);
+	int run = 0;
+
+	for (int i = 0, y = 0; y < im.GetHeight(); y++) {
+		for (int x = 0; x < im.GetWidth(); x++, i++) {
+			RGBA px = im(x, y);
+
+			if (px.r == prev.r && px.g == prev.g && px.b == prev.b && px.a == prev.a) {
+				run++;
+				if (run == 62 || i == count - 1) {
+					out.push_back(QOI_OP_RUN | (run - 1));
+					run = 0;
+				}
+				continue;
+			}
+
+			if (run > 0) {
+				out.push_back(QOI_OP_RUN | (run - 1));
+				run = 0;
+			}
+
+			int hash = (px.r * 3 + px.g * 5 + px.b * 7 + px.a * 11) % 64;
+			RGBA &slot = index[hash];
+			if (slot.r == px.r && slot.g == px.g && slot.b == px.b && slot.a == px.a) {
+				out.push_back(QOI_OP_INDEX | hash);
+			}
+			else {
+				slot = px;
+
+				if (px.a == prev.a) {
+					signed char vr = px.r - prev.r;
+					signed char vg = px.g - prev.g;
+					signed char vb = px.b - prev.b;
+					signed char vg_r = vr - vg;
+					signed char vg_b = vb - vg;
+
+					if (vr > -3 && vr < 2 && vg > -3 && vg < 2 && vb > -3 && vb < 2) {
+						out.push_back(QOI_OP_DIFF | (vr + 2) << 4 | (vg + 2) << 2 | (vb + 2));
+					}
+					else if (vg_r > -9 && vg_r < 8 && vg > -33 && vg < 32 && vg_b > -9 && vg_b < 8) {
+						out.push_back(QOI_OP_LUMA | (vg + 32));
+						out.push_back((vg_r + 8) << 4 | (vg_b + 8));
+					}
+					else {
+						out.push_back(QOI_OP_RGB);
+						out.push_back(px.r);
+						out.push_back(px.g);
+						out.push_back(px.b);
+					}
+				}
+				else {
+					out.push_back(QOI_OP_RGBA);
+					out.push_back(px.r);
+					out.push_back(px.g);
+					out.push_back(px.b);
+					out.push_back(px.a);
+				}
+			}
+			prev = px;
+		}
+	}
+
+	for (int i = 0; i < 7; i++) out.push_back(0);
+	out.push_back(1);
+}
@@ -0,0 +1,413 @@
+#pragma once
+
+#include "image.h"
+#include "image16.h"
+#include "mask.h"
+#include <algorithm>
+#include <climits>
+#include <cmath>
+#include <cstring>
+#include <vector>
+
+// helper function to clamp values between min and max
+// added this because std::clamp is C++17 and I want to be safe
+float clamp_float(float val, float minVal, float maxVal) {
+  if (val < minVal)
+    return minVal;
+  if (val > maxVal)
+    return maxVal;
+  return val;
+}
+
+struct Point {
+  float x, y;
+};
+
+// helpers to make shapes
+std::vector<Point> createRect(float x, float y, float w, float h) {
+  std::vector<Point> pts;
+  pts.push_back({x, y});
+  pts.push_back({x + w, y});
+  pts.push_back({x + w, y + h});
+  pts.push_back({x, y + h});
+  return pts;
+}
+
+// color structure dealing with floats for calculation
+struct ColorF {
+  float r, g, b, a;
+
+  ColorF() : r(0), g(0), b(0), a(1) {}
+  ColorF(float _r, float _g, float _b, float _a) : r(_r), g(_g), b(_b), a(_a) {}
+
+  // convert to 0-255 rgba (had to check stackoverflow for this)
+  RGBA toRGBA() {
+    return RGBA((Byte)clamp_float(r * 255.0f, 0.0f, 255.0f),
+                (Byte)clamp_float(g * 255.0f, 0.0f, 255.0f),
+                (Byte)clamp_float(b * 255.0f, 0.0f, 255.0f),
+                (Byte)clamp_float(a * 255.0f, 0.0f, 255.0f));
+  }
+
+  // convert from 0-255 RGBA
+  static ColorF fromRGBA(RGBA c) {
+    return ColorF(c.r / 255.0f, c.g / 255.0f, c.b / 255.0f, c.a / 255.0f);
+  }
+
+  // same for 16 bit channels, truncating like toRGBA
+  RGBA16 toRGBA16() {
+    return RGBA16((uint16_t)clamp_float(r * 65535.0f, 0.0f, 65535.0f),
+                  (uint16_t)clamp_float(g * 65535.0f, 0.0f, 65535.0f),
+                  (uint16_t)clamp_float(b * 65535.0f, 0.0f, 65535.0f),
+                  (uint16_t)clamp_float(a * 65535.0f, 0.0f, 65535.0f));
+  }
+
+  static ColorF fromRGBA16(RGBA16 c) {
+    return ColorF(c.r / 65535.0f, c.g / 65535.0f, c.b / 65535.0f,
+                  c.a / 65535.0f);
+  }
+};
+
+// pixel conversions for every type drawPolygon can draw into, so the span
+// kernels can be written once for ColorImage and ColorImage16
+ColorF fromPixel(RGBA p) { return ColorF::fromRGBA(p); }
+ColorF fromPixel(RGBA16 p) { return ColorF::fromRGBA16(p); }
+void storePixel(RGBA &p, ColorF c) { p = c.toRGBA(); }
+void storePixel(RGBA16 &p, ColorF c) { p = c.toRGBA16(); }
+
+// blending modes
+enum BlendMode {
+  BLEND_NORMAL,
+  BLEND_MULTIPLY,
+  BLEND_ADD,
+  BLEND_DIFFERENCE,
+  BLEND_OVERLAY
+};
+
+// function to blend two colors based on the blend mode
+ColorF blend(ColorF src, ColorF dest, int mode) {
+  float alpha = src.a;
+  float invAlpha = 1.0f - alpha;
+
+  float r = dest.r;
+  float g = dest.g;
+  float b = dest.b;
+
+  // blend modes
+  if (mode == BLEND_NORMAL) {
+    r = src.r;
+    g = src.g;
+    b = src.b;
+  } else if (mode == BLEND_MULTIPLY) {
+    r = src.r * dest.r;
+    g = src.g * dest.g;
+    b = src.b * dest.b;
+  } else if (mode == BLEND_ADD) {
+    r = clamp_float(src.r + dest.r, 0, 1);
+    g = clamp_float(src.g + dest.g, 0, 1);
+    b = clamp_float(src.b + dest.b, 0, 1);
+  } else if (mode == BLEND_DIFFERENCE) {
+    r = std::abs(dest.r - src.r);
+    g = std::abs(dest.g - src.g);
+    b = std::abs(dest.b - src.b);
+  } else if (mode == BLEND_OVERLAY) {
+    float (*overlay_channel)(float, float) = [](float s, float d) {
+      if (d < 0.5f) {
+        return 2.0f * s * d;
+      } else {
+        return 1.0f - 2.0f * (1.0f - s) * (1.0f - d);
+      }
+    };
+    r = overlay_channel(src.r, dest.r);
+    g = overlay_channel(src.g, dest.g);
+    b = overlay_channel(src.b, dest.b);
+  }
+
+  return ColorF(r * alpha + dest.r * invAlpha, g * alpha + dest.g * invAlpha,
+                b * alpha + dest.b * invAlpha, 1.0f);
+}
+
+struct GradientStop {
+  float position;
+  ColorF color;
+};
+
+bool compareStops(const GradientStop &a, const GradientStop &b) {
+  return a.position < b.position;
+}
+
+struct Gradient {
+  bool isRadial = false;
+  Point p1 = {0, 0}, p2 = {0, 0};
+  float radius = 0;
+  std::vector<GradientStop> stops;
+
+  void addStop(float pos, ColorF col) {
+    stops.push_back({pos, col});
+    std::sort(stops.begin(), stops.end(), compareStops);
+  }
+
+  ColorF getColorAt(float t) const {
+    if (stops.empty())
+      return ColorF(0, 0, 0, 1);
+
+    if (t <= stops.front().position)
+      return stops.front().color;
+    if (t >= stops.back().position)
+      return stops.back().color;
+
+    // finding the two stops t is between
+    for (size_t i = 0; i < stops.size() - 1; i++) {
+      if (t >= stops[i].position && t <= stops[i + 1].position) {
+        float t0 = stops[i].position;
+        float t1 = stops[i + 1].position;
+        float f = (t - t0) / (t1 - t0);
+
+        ColorF c1 = stops[i].color;
+        ColorF c2 = stops[i + 1].color;
+
+        // linear interpolation
+        return ColorF(c1.r + (c2.r - c1.r) * f, c1.g + (c2.g - c1.g) * f,
+                      c1.b + (c2.b - c1.b) * f, c1.a + (c2.a - c1.a) * f);
+      }
+    }
+    return stops.back().color;
+  }
+};
+
+// edge bucket for scanline algorithm
+struct Edge {
+  int yMin, yMax;
+  float x;
+  float mInv;
+};
+
+// compare edges by x coordinate
+bool compareEdges(const Edge &a, const Edge &b) { return a.x < b.x; }
+
+// span kernels, both produce the same pixels
+enum SpanKernel {
+  KERNEL_SCALAR, // gradient and blend evaluated from scratch per pixel
+  KERNEL_SPAN    // row invariants hoisted, opaque solid spans stored directly
+};
+
+const char *kernelName(int kernel) {
+  return kernel == KERNEL_SCALAR ? "scalar" : "span";
+}
+
+// fill pixels [startX, endX) of row y, scalar kernel
+template <typename Image>
+void fillSpanScalar(Image &image, int y, int startX, int endX,
+                    ColorF color, const Gradient *grad, int blendMode) {
+  for (int x = startX; x < endX; x++) {
+    ColorF drawColor = color;
+
+    if (grad != nullptr) {
+      float t = 0;
+      if (grad->isRadial) {
+        float dx = x - grad->p1.x;
+        float dy = y - grad->p1.y;
+        float dist = sqrt(dx * dx + dy * dy);
+        t = dist / grad->radius;
+      } else {
+        float dx = grad->p2.x - grad->p1.x;
+        float dy = grad->p2.y - grad->p1.y;
+        float lenSq = dx * dx + dy * dy;
+        float pdx = x - grad->p1.x;
+        float pdy = y - grad->p1.y;
+        t = (pdx * dx + pdy * dy) / lenSq;
+      }
+      t = clamp_float(t, 0.0f, 1.0f);
+      drawColor = grad->getColorAt(t);
+    }
+    ColorF bgColor = fromPixel(image.Get(x, y));
+    ColorF finalColor = blend(drawColor, bgColor, blendMode);
+    storePixel(image(x, y), finalColor);
+  }
+}
+
+// fill pixels [startX, endX) of row y with the per-row work done once.
+// the arithmetic is kept in the same order as the scalar kernel so both
+// kernels write identical pixels
+template <typename Image>
+void fillSpanHoisted(Image &image, int y, int startX, int endX,
+                     ColorF color, const Gradient *grad, int blendMode) {
+  if (grad == nullptr) {
+    if (blendMode == BLEND_NORMAL && color.a == 1.0f) {
+      typename Image::Pixel solid;
+      storePixel(solid, ColorF(color.r, color.g, color.b, 1.0f));
+      for (int x = startX; x < endX; x++)
+        image(x, y) = solid;
+    } else {
+      for (int x = startX; x < endX; x++)
+        storePixel(image(x, y),
+                   blend(color, fromPixel(image(x, y)), blendMode));
+    }
+    return;
+  }
+
+  if (grad->isRadial) {
+    float dy = y - grad->p1.y;
+    float dySq = dy * dy;
+    for (int x = startX; x < endX; x++) {
+      float dx = x - grad->p1.x;
+      float t = clamp_float(sqrt(dx * dx + dySq) / grad->radius, 0.0f, 1.0f);
+      storePixel(image(x, y),
+                 blend(grad->getColorAt(t), fromPixel(image(x, y)), blendMode));
+    }
+  } else {
+    float dx = grad->p2.x - grad->p1.x;
+    float dy = grad->p2.y - grad->p1.y;
+    float lenSq = dx * dx + dy * dy;
+    float rowTerm = (y - grad->p1.y) * dy;
+    for (int x = startX; x < endX; x++) {
+      float pdx = x - grad->p1.x;
+      float t = clamp_float((pdx * dx + rowTerm) / lenSq, 0.0f, 1.0f);
+      storePixel(image(x, y),
+                 blend(grad->getColorAt(t), fromPixel(image(x, y)), blendMode));
+    }
+  }
+}
+
+// scanline conversion shared by every target: calls span(y, startX, endX)
+// for each run of pixels inside the polygon (even-odd rule), clipped to
+// width x height. only rows in [yBegin, yEnd) are visited
+template <typename SpanFn>
+void forEachSpan(const std::vector<Point> &vertices, int width, int height,
+                 int yBegin, int yEnd, SpanFn span) {
+  if (vertices.size() < 3)
+    return;
+
+  std::vector<Edge> edges;
+  int globalMinY = height;
+  int globalMaxY = 0;
+
+  for (size_t i = 0; i < vertices.size(); i++) {
+    Point p1 = vertices[i];
+    Point p2 = vertices[(i + 1) % vertices.size()];
+
+    if ((int)p1.y == (int)p2.y)
+      continue;
+
+    if (p1.y > p2.y) {
+      Point temp = p1;
+      p1 = p2;
+      p2 = temp;
+    }
+
+    Edge e;
+    e.yMin = (int)p1.y;
+    e.yMax = (int)p2.y;
+    e.x = p1.x;
+    e.mInv = (p2.x - p1.x) / (p2.y - p1.y);
+
+    if (e.yMax <= 0 || e.yMin >= height)
+      continue;
+    if (e.yMax <= yBegin || e.yMin >= yEnd)
+      continue;
+
+    edges.push_back(e);
+    if (e.yMin < globalMinY)
+      globalMinY = e.yMin;
+    if (e.yMax > globalMaxY)
+      globalMaxY = e.yMax;
+  }
+
+  // clamp Y range
+  if (globalMinY < std::max(0, yBegin))
+    globalMinY = std::max(0, yBegin);
+  if (globalMaxY > std::min(height, yEnd))
+    globalMaxY = std::min(height, yEnd);
+
+  // iiterate through scanlines
+  std::vector<float> nodes;
+  for (int y = globalMinY; y < globalMaxY; y++) {
+    // find intersections for this scanline
+    nodes.clear();
+    for (size_t i = 0; i < edges.size(); i++) {
+      if (y >= edges[i].yMin && y < edges[i].yMax) {
+        float intersectX =
+            edges[i].x + edges[i].mInv * (float)(y - edges[i].yMin);
+        nodes.push_back(intersectX);
+      }
+    }
+
+    // sort x intersections
+    std::sort(nodes.begin(), nodes.end());
+
+    // fill pixels between pairs of nodes (Even-Odd rule)
+    for (size_t i = 0; i < nodes.size(); i += 2) {
+      if (i + 1 >= nodes.size())
+        break;
+
+      int startX = (int)nodes[i];
+      int endX = (int)nodes[i + 1];
+
+      if (startX >= width)
+        continue;
+      if (endX <= 0)
+        continue;
+
+      if (startX < 0)
+        startX = 0;
+      if (endX > width)
+        endX = width;
+
+      span(y, startX, endX);
+    }
+  }
+}
+
+// function to fill the polygon
+// only rows in [yBegin, yEnd) are touched, which lets tiles render in parallel.
+// image is a ColorImage or ColorImage16
+template <typename Image>
+void drawPolygon(Image &image, const std::vector<Point> &vertices,
+                 ColorF color, const Gradient *grad, int blendMode,
+                 int yBegin = 0, int yEnd = INT_MAX,
+                 int kernel = KERNEL_SCALAR) {
+  forEachSpan(vertices, image.GetWidth(), image.GetHeight(), yBegin, yEnd,
+              [&](int y, int startX, int endX) {
+                if (kernel == KERNEL_SPAN)
+                  fillSpanHoisted(image, y, startX, endX, color, grad,
+                                  blendMode);
+                else
+                  fillSpanScalar(image, y, startX, endX, color, grad,
+                                 blendMode);
+              });
+}
+
+// coverage only: the polygon is composited over the mask with the given
+// opacity, a = a + alpha * (1 - a)
+void drawPolygon(AlphaImage &mask, const std::vector<Point> &vertices,
+                 float alpha = 1.0f, int yBegin = 0, int yEnd = INT_MAX) {
+  int cover = (int)clamp_float(alpha * 255.0f + 0.5f, 0.0f, 255.0f);
+  forEachSpan(vertices, mask.GetWidth(), mask.GetHeight(), yBegin, yEnd,
+              [&](int y, int startX, int endX) {
+                Byte *row = mask.Row(y);
+                if (cover == 255) {
+                  memset(row + startX, 255, endX - startX);
+                  return;
+                }
+                for (int x = startX; x < endX; x++)
+                  row[x] += (cover * (255 - row[x]) + 127) / 255;
+              });
+}
+
+// binary coverage, whole words of the mask set at once
+void drawPolygon(BitMask &mask, const std::vector<Point> &vertices,
+                 int yBegin = 0, int yEnd = INT_MAX) {
+  forEachSpan(vertices, mask.GetWidth(), mask.GetHeight(), yBegin, yEnd,
+              [&](int y, int startX, int endX) {
+                mask.SetSpan(y, startX, endX);
+              });
+}
+
+
+std::vector<Point> createCircle(float cx, float cy, float r, int segments) {
+  std::vector<Point> pts;
+  for (int i = 0; i < segments; i++) {
+    float angle = 2.0f * M_PI * (float)i / (float)segments;
+    pts.push_back({cx + r * cos(angle), cy + r * sin(angle)});
+  }
+  return pts;
+}
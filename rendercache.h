@@ -0,0 +1,255 @@
+#pragma once
+
+#include "hash.h"
+#include "qoi.h"
+#include "scene.h"
+#include <algorithm>
+#include <cctype>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <list>
+#include <mutex>
+#include <sstream>
+#include <thread>
+#include <unistd.h>
+#include <unordered_map>
+
+enum ImageFormat { FORMAT_PNG, FORMAT_QOI };
+
+const char *formatExtension(int format) {
+  return format == FORMAT_QOI ? "qoi" : "png";
+}
+
+void encodeImage(const ColorImage &image, int format, std::vector<Byte> &out) {
+  if (format == FORMAT_QOI)
+    EncodeQOI(image, out);
+  else
+    image.Encode(out);
+}
+
+// bump whenever a change to the rasterizer or encoders alters output bytes,
+// so stale cache entries stop matching
+const int RENDER_CACHE_VERSION = 3;
+
+// key for a rendered and encoded scene. the scene is hashed in its canonical
+// text form so formatting differences in the input do not matter. tile size,
+// threads and kernel are left out as they never change the pixels
+Hash128 renderKey(const Scene &scene, int format) {
+  std::string canonical = sceneToText(scene);
+  canonical += "format " + std::string(formatExtension(format)) + "\n";
+  canonical += "version " + std::to_string(RENDER_CACHE_VERSION) + "\n";
+  return HashString128(canonical);
+}
+
+struct CacheStats {
+  long long hits = 0, misses = 0, stores = 0, evictions = 0;
+  long long bytesServed = 0;
+  long long entries = 0, bytes = 0;
+};
+
+// encoded images on disk, one file per key, evicted least recently used
+// first once the directory grows past maxBytes. recency survives restarts
+// through the files' modification times, which hits refresh. the directory
+// may hold other files too: only names the cache itself makes are indexed,
+// evicted or cleaned up
+class RenderCache {
+public:
+  RenderCache(const std::string &dir, long long maxBytes)
+      : dir(dir), maxBytes(maxBytes) {
+    namespace fs = std::filesystem;
+    std::error_code ec;
+    fs::create_directories(dir, ec);
+
+    std::vector<std::pair<fs::file_time_type, Entry>> found;
+    for (const fs::directory_entry &e : fs::directory_iterator(dir, ec)) {
+      if (!e.is_regular_file(ec))
+        continue;
+      std::string name = e.path().filename().string();
+      if (isTempName(name)) {
+        fs::remove(e.path(), ec); // left behind by an interrupted store
+        continue;
+      }
+      if (!isEntryName(name))
+        continue;
+      found.push_back(
+          {e.last_write_time(ec), {name, (long long)e.file_size(ec)}});
+    }
+
+    std::sort(found.begin(), found.end(),
+              [](const auto &a, const auto &b) { return a.first > b.first; });
+    for (auto &f : found)
+      insertFront(f.second);
+    evict();
+  }
+
+  bool lookup(const Hash128 &key, int format, std::vector<Byte> &out) {
+    std::string name = fileName(key, format);
+    long long size;
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      auto it = index.find(name);
+      if (it == index.end()) {
+        counters.misses++;
+        return false;
+      }
+      size = it->second->size;
+    }
+
+    // read and touch the file without the lock so hits from many threads
+    // overlap. files are replaced by rename and never rewritten in place, so
+    // a complete read is the entry's bytes even if it was evicted meanwhile
+    bool read = false;
+    {
+      std::ifstream in(path(name), std::ios::binary);
+      if (in) {
+        out.resize(size);
+        in.read((char *)out.data(), out.size());
+        read = in && in.gcount() == (std::streamsize)out.size();
+      }
+    }
+    if (read) {
+      std::error_code ec;
+      std::filesystem::last_write_time(
+          path(name), std::filesystem::file_time_type::clock::now(), ec);
+    }
+
+    std::lock_guard<std::mutex> lock(mutex);
+    auto it = index.find(name);
+    if (read) {
+      if (it != index.end())
+        lru.splice(lru.begin(), lru, it->second);
+      counters.hits++;
+      counters.bytesServed += out.size();
+      return true;
+    }
+    // deleted or truncated behind our back, unless it was stored again
+    // while we were reading
+    if (it != index.end() && it->second->size == size)
+      remove(it);
+    counters.misses++;
+    return false;
+  }
+
+  void store(const Hash128 &key, int format, const std::vector<Byte> &data) {
+    std::string name = fileName(key, format);
+    // write under a temporary name and rename so readers never see a
+    // partial file, even from another process sharing the directory. thread
+    // ids repeat across processes, so the process id goes in too
+    std::ostringstream tmp;
+    tmp << name << ".tmp" << getpid() << "." << std::this_thread::get_id();
+    {
+      std::ofstream out(path(tmp.str()), std::ios::binary);
+      out.write((const char *)data.data(), data.size());
+      if (!out)
+        return;
+    }
+    std::error_code ec;
+    std::filesystem::rename(path(tmp.str()), path(name), ec);
+    if (ec)
+      return;
+
+    std::lock_guard<std::mutex> lock(mutex);
+    auto it = index.find(name);
+    if (it != index.end())
+      remove(it);
+    insertFront({name, (long long)data.size()});
+    counters.stores++;
+    evict();
+  }
+
+  CacheStats stats() const {
+    std::lock_guard<std::mutex> lock(mutex);
+    CacheStats s = counters;
+    s.entries = lru.size();
+    s.bytes = totalBytes;
+    return s;
+  }
+
+private:
+  struct Entry {
+    std::string name;
+    long long size;
+  };
+  typedef std::list<Entry>::iterator EntryRef;
+
+  std::string fileName(const Hash128 &key, int format) const {
+    return key.Hex() + "." + formatExtension(format);
+  }
+
+  std::string path(const std::string &name) const { return dir + "/" + name; }
+
+  // <32 hex digits>.<png|qoi>, as fileName makes them
+  static bool isEntryName(const std::string &name) {
+    if (name.size() != 36 || name[32] != '.')
+      return false;
+    for (int i = 0; i < 32; i++)
+      if (!isxdigit((unsigned char)name[i]) ||
+          isupper((unsigned char)name[i]))
+        return false;
+    std::string ext = name.substr(33);
+    return ext == formatExtension(FORMAT_PNG) ||
+           ext == formatExtension(FORMAT_QOI);
+  }
+
+  // an entry name followed by .tmp and the writer's ids, see store
+  static bool isTempName(const std::string &name) {
+    return name.size() > 40 && isEntryName(name.substr(0, 36)) &&
+           name.compare(36, 4, ".tmp") == 0;
+  }
+
+  void insertFront(const Entry &e) {
+    lru.push_front(e);
+    index[e.name] = lru.begin();
+    totalBytes += e.size;
+  }
+
+  void remove(std::unordered_map<std::string, EntryRef>::iterator it) {
+    totalBytes -= it->second->size;
+    lru.erase(it->second);
+    index.erase(it);
+  }
+
+  void evict() {
+    while (totalBytes > maxBytes && !lru.empty()) {
+      std::error_code ec;
+      std::filesystem::remove(path(lru.back().name), ec);
+      remove(index.find(lru.back().name));
+      counters.evictions++;
+    }
+  }
+
+  std::string dir;
+  long long maxBytes;
+  long long totalBytes = 0;
+  std::list<Entry> lru; // most recently used first
+  std::unordered_map<std::string, EntryRef> index;
+  CacheStats counters;
+  mutable std::mutex mutex;
+};
+
+// render and encode the scene unless the cache (optional) already has it
+void renderEncoded(const Scene &scene, int format,
+                   const RenderSettings &settings, ColorImage &canvas,
+                   std::vector<Byte> &out, RenderCache *cache = nullptr) {
+  Hash128 key;
+  if (cache != nullptr) {
+    key = renderKey(scene, format);
+    if (cache->lookup(key, format, out))
+      return;
+  }
+
+  renderScene(canvas, scene, settings);
+  encodeImage(canvas, format, out);
+
+  if (cache != nullptr)
+    cache->store(key, format, out);
+}
+
+void printCacheStats(const CacheStats &s) {
+  long long lookups = s.hits + s.misses;
+  std::cout << "cache: " << s.hits << " hits, " << s.misses << " misses ("
+            << (lookups ? 100.0 * s.hits / lookups : 0.0) << "% hit rate), "
+            << s.evictions << " evictions, " << s.entries << " entries, "
+            << s.bytes << " bytes" << std::endl;
+}
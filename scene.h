@@ -0,0 +1,298 @@
+#pragma once
+
+#include "parallel.h"
+#include "raster.h"
+#include <cstdint>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+// one filled polygon in a scene
+struct Shape {
+  std::vector<Point> vertices;
+  ColorF color;
+  bool hasGradient = false;
+  Gradient gradient;
+  int blendMode = BLEND_NORMAL;
+};
+
+// everything needed to produce a frame
+struct Scene {
+  int width = 0, height = 0;
+  RGBA background = RGBA(255, 255, 255);
+  std::vector<Shape> shapes;
+};
+
+// scene text format, one command per line ('#' starts a comment):
+//
+//   size <width> <height>
+//   background <r> <g> <b>                 0-255
+//   polygon <blend> <r> <g> <b> <a>        blend is normal, multiply, add,
+//                                          difference or overlay, color 0-1
+//   point <x> <y>                          appends a vertex to the polygon
+//   linear <x1> <y1> <x2> <y2>             gradient for the polygon
+//   radial <cx> <cy> <radius>
+//   stop <position> <r> <g> <b> <a>        gradient stop
+const char *BLEND_NAMES[] = {"normal", "multiply", "add", "difference",
+                             "overlay"};
+
+// largest frame a scene may ask for, per side and in total, so a bad size
+// is rejected instead of taking down whoever renders it
+const int MAX_SCENE_SIDE = 1 << 15;
+const int64_t MAX_SCENE_PIXELS = (int64_t)1 << 28;
+
+// returns false and sets error (if given) on malformed input
+bool parseScene(const std::string &text, Scene &scene,
+                std::string *error = nullptr) {
+  scene = Scene();
+  std::istringstream in(text);
+  std::string line;
+  int lineNo = 0;
+
+  auto fail = [&](const std::string &msg) {
+    if (error)
+      *error = "line " + std::to_string(lineNo) + ": " + msg;
+    return false;
+  };
+
+  while (std::getline(in, line)) {
+    lineNo++;
+    size_t hash = line.find('#');
+    if (hash != std::string::npos)
+      line.erase(hash);
+
+    std::istringstream ls(line);
+    std::string cmd;
+    if (!(ls >> cmd))
+      continue;
+
+    Shape *last = scene.shapes.empty() ? nullptr : &scene.shapes.back();
+    bool ok = true;
+
+    if (cmd == "size") {
+      ok = (bool)(ls >> scene.width >> scene.height) && scene.width > 0 &&
+           scene.height > 0;
+      if (ok && (scene.width > MAX_SCENE_SIDE ||
+                 scene.height > MAX_SCENE_SIDE ||
+                 (int64_t)scene.width * scene.height > MAX_SCENE_PIXELS))
+        return fail("size too large");
+    } else if (cmd == "background") {
+      int r, g, b;
+      ok = (bool)(ls >> r >> g >> b);
+      scene.background = RGBA(r, g, b);
+    } else if (cmd == "polygon") {
+      std::string mode;
+      Shape shape;
+      ok = (bool)(ls >> mode >> shape.color.r >> shape.color.g >>
+                  shape.color.b >> shape.color.a);
+      shape.blendMode = -1;
+      for (int m = 0; m < 5; m++)
+        if (mode == BLEND_NAMES[m])
+          shape.blendMode = m;
+      if (ok && shape.blendMode < 0)
+        return fail("unknown blend mode " + mode);
+      scene.shapes.push_back(shape);
+    } else if (last == nullptr) {
+      return fail(cmd + " before any polygon");
+    } else if (cmd == "point") {
+      Point p;
+      ok = (bool)(ls >> p.x >> p.y);
+      last->vertices.push_back(p);
+    } else if (cmd == "linear") {
+      last->hasGradient = true;
+      last->gradient.isRadial = false;
+      ok = (bool)(ls >> last->gradient.p1.x >> last->gradient.p1.y >>
+                  last->gradient.p2.x >> last->gradient.p2.y);
+    } else if (cmd == "radial") {
+      last->hasGradient = true;
+      last->gradient.isRadial = true;
+      ok = (bool)(ls >> last->gradient.p1.x >> last->gradient.p1.y >>
+                  last->gradient.radius);
+    } else if (cmd == "stop") {
+      float pos;
+      ColorF c;
+      ok = (bool)(ls >> pos >> c.r >> c.g >> c.b >> c.a);
+      last->gradient.addStop(pos, c);
+    } else {
+      return fail("unknown command " + cmd);
+    }
+
+    if (!ok)
+      return fail("bad arguments to " + cmd);
+  }
+
+  if (scene.width <= 0 || scene.height <= 0)
+    return fail("missing size");
+  return true;
+}
+
+// inverse of parseScene. floats are written with enough digits to round trip
+std::string sceneToText(const Scene &scene) {
+  std::ostringstream out;
+  out.precision(9);
+  out << "size " << scene.width << " " << scene.height << "\n";
+  out << "background " << (int)scene.background.r << " "
+      << (int)scene.background.g << " " << (int)scene.background.b << "\n";
+
+  for (const Shape &s : scene.shapes) {
+    out << "polygon " << BLEND_NAMES[s.blendMode] << " " << s.color.r << " "
+        << s.color.g << " " << s.color.b << " " << s.color.a << "\n";
+    for (const Point &p : s.vertices)
+      out << "point " << p.x << " " << p.y << "\n";
+    if (!s.hasGradient)
+      continue;
+
+    const Gradient &g = s.gradient;
+    if (g.isRadial)
+      out << "radial " << g.p1.x << " " << g.p1.y << " " << g.radius << "\n";
+    else
+      out << "linear " << g.p1.x << " " << g.p1.y << " " << g.p2.x << " "
+          << g.p2.y << "\n";
+    for (const GradientStop &stop : g.stops)
+      out << "stop " << stop.position << " " << stop.color.r << " "
+          << stop.color.g << " " << stop.color.b << " " << stop.color.a
+          << "\n";
+  }
+  return out.str();
+}
+
+// how a scene is split up and drawn. tiles are bands of whole rows since the
+// rasterizer works scanline by scanline
+struct RenderSettings {
+  int tileHeight = 32;
+  int threads = HardwareThreads();
+  int kernel = KERNEL_SPAN;
+
+  // reads key=value lines, unknown keys are ignored. returns false if the
+  // file is missing or was written on a machine with a different core count
+  bool load(const std::string &filename) {
+    std::ifstream in(filename);
+    if (!in)
+      return false;
+
+    RenderSettings s;
+    int hwThreads = 0;
+    std::string line;
+    while (std::getline(in, line)) {
+      size_t eq = line.find('=');
+      if (eq == std::string::npos)
+        continue;
+      std::string key = line.substr(0, eq);
+      std::string value = line.substr(eq + 1);
+
+      if (key == "tile_height")
+        s.tileHeight = std::stoi(value);
+      else if (key == "threads")
+        s.threads = std::stoi(value);
+      else if (key == "kernel")
+        s.kernel = value == "scalar" ? KERNEL_SCALAR : KERNEL_SPAN;
+      else if (key == "hardware_threads")
+        hwThreads = std::stoi(value);
+    }
+
+    if (hwThreads != HardwareThreads() || s.tileHeight <= 0 ||
+        s.threads <= 0)
+      return false;
+    *this = s;
+    return true;
+  }
+
+  bool save(const std::string &filename) const {
+    std::ofstream out(filename);
+    if (!out)
+      return false;
+    out << "tile_height=" << tileHeight << "\n";
+    out << "threads=" << threads << "\n";
+    out << "kernel=" << kernelName(kernel) << "\n";
+    out << "hardware_threads=" << HardwareThreads() << "\n";
+    return (bool)out;
+  }
+};
+
+// fill rows [y0, y1) with the background and draw every shape over them
+template <typename Image>
+void renderTile(Image &image, const Scene &scene, int y0, int y1,
+                int kernel) {
+  for (int y = y0; y < y1; y++)
+    for (int x = 0; x < image.GetWidth(); x++)
+      image(x, y) = scene.background;
+
+  for (const Shape &s : scene.shapes)
+    drawPolygon(image, s.vertices, s.color,
+                s.hasGradient ? &s.gradient : nullptr, s.blendMode, y0, y1,
+                kernel);
+}
+
+// render the whole scene into a ColorImage, or a ColorImage16 for 16 bit
+// output. the image is resized to the scene if needed
+template <typename Image>
+void renderScene(Image &image, const Scene &scene,
+                 const RenderSettings &settings) {
+  if (image.GetWidth() != scene.width || image.GetHeight() != scene.height)
+    image = Image(scene.width, scene.height);
+
+  int tileHeight = std::max(1, settings.tileHeight);
+  int tiles = (scene.height + tileHeight - 1) / tileHeight;
+
+  ParallelFor(tiles, settings.threads, [&](int t) {
+    int y0 = t * tileHeight;
+    int y1 = std::min(scene.height, y0 + tileHeight);
+    renderTile(image, scene, y0, y1, settings.kernel);
+  });
+}
+
+// the shapes main has always drawn
+Scene createDemoScene() {
+  Scene scene;
+  scene.width = 800;
+  scene.height = 600;
+
+  // red rectangle
+  Shape rect;
+  rect.vertices = createRect(50, 50, 200, 150);
+  rect.color = ColorF(1, 0, 0, 1);
+  scene.shapes.push_back(rect);
+
+  // circle with radial gradient
+  Shape circle;
+  circle.vertices = createCircle(400, 300, 100, 50);
+  circle.color = ColorF(0, 0, 0, 0);
+  circle.hasGradient = true;
+  circle.gradient.isRadial = true;
+  circle.gradient.p1 = {400, 300};
+  circle.gradient.radius = 100;
+  circle.gradient.addStop(0.0, ColorF(0, 0, 1, 1));
+  circle.gradient.addStop(1.0, ColorF(0, 0, 0, 0));
+  scene.shapes.push_back(circle);
+
+  // triangle with linear gradient
+  // using multiply blend mode so it shows up on white background
+  Shape tri;
+  tri.vertices.push_back({100, 400});
+  tri.vertices.push_back({300, 400});
+  tri.vertices.push_back({200, 250});
+  tri.color = ColorF(0, 0, 0, 0);
+  tri.hasGradient = true;
+  tri.gradient.isRadial = false;
+  tri.gradient.p1 = {100, 400};
+  tri.gradient.p2 = {300, 400};
+  tri.gradient.addStop(0.0, ColorF(0, 1, 0, 1));
+  tri.gradient.addStop(1.0, ColorF(1, 1, 0, 0.5));
+  tri.blendMode = BLEND_MULTIPLY;
+  scene.shapes.push_back(tri);
+
+  // star shape (difference mode)
+  Shape star;
+  float cx = 600, cy = 150, rOut = 80, rIn = 30;
+  for (int i = 0; i < 10; i++) {
+    float r = (i % 2 == 0) ? rOut : rIn;
+    float a = i * M_PI / 5.0f;
+    star.vertices.push_back({cx + r * sin(a), cy - r * cos(a)});
+  }
+  star.color = ColorF(1, 0.5, 0, 0.8);
+  star.blendMode = BLEND_DIFFERENCE;
+  scene.shapes.push_back(star);
+
+  return scene;
+}
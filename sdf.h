@@ -0,0 +1,423 @@
+#pragma once
+
+#include "blit.h"
+#include "distance.h"
+#include "image.h"
+#include "parallel.h"
+#include "raster.h"
+#include <cfloat>
+#include <cmath>
+#include <vector>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// shapes drawn from signed distance fields instead of polygons: negative
+// inside, positive outside, in pixels. coverage is 0.5 - distance clamped to
+// [0, 1], which antialiases every edge the same at any size.
+//
+// circles, ellipses, rounded rects and capsules have closed forms evaluated
+// four pixels at a time. any other outline can be baked once into an
+// SdfTexture and drawn at any scale from that.
+
+// coverage 0-255 from distances in pixels
+void coverageFromDistance(const float *d, Byte *coverage, int n) {
+  int x = 0;
+
+#ifdef __SSE2__
+  const __m128 half = _mm_set1_ps(0.5f), zero = _mm_setzero_ps();
+  const __m128 one = _mm_set1_ps(1.0f), c255 = _mm_set1_ps(255.0f);
+  for (; x + 4 <= n; x += 4) {
+    __m128 c = _mm_sub_ps(half, _mm_loadu_ps(d + x));
+    c = _mm_mul_ps(_mm_min_ps(_mm_max_ps(c, zero), one), c255);
+    __m128i i = _mm_cvtps_epi32(c);
+    i = _mm_packs_epi32(i, i);
+    i = _mm_packus_epi16(i, i);
+    int v = _mm_cvtsi128_si32(i);
+    memcpy(coverage + x, &v, 4);
+  }
+#endif
+
+  for (; x < n; x++)
+    coverage[x] =
+        (Byte)std::lround(clamp_float(0.5f - d[x], 0.0f, 1.0f) * 255.0f);
+}
+
+enum SdfShapeType { SDF_CIRCLE, SDF_ELLIPSE, SDF_ROUND_RECT, SDF_CAPSULE };
+
+// one analytic shape. build with the functions below
+struct SdfShape {
+  int type;
+  float cx, cy; // center, or first capsule end
+  float a, b;   // radii, rect half size, or second capsule end
+  float r;      // corner or capsule radius
+
+  static SdfShape circle(float cx, float cy, float radius) {
+    return {SDF_CIRCLE, cx, cy, radius, radius, radius};
+  }
+
+  static SdfShape ellipse(float cx, float cy, float rx, float ry) {
+    return {SDF_ELLIPSE, cx, cy, rx, ry, 0};
+  }
+
+  // x, y, w, h like createRect, with corners rounded by radius
+  static SdfShape roundRect(float x, float y, float w, float h,
+                            float radius) {
+    radius = clamp_float(radius, 0, std::min(w, h) / 2);
+    return {SDF_ROUND_RECT, x + w / 2, y + h / 2, w / 2, h / 2, radius};
+  }
+
+  // a line from (x0, y0) to (x1, y1) with round caps, radius half its width
+  static SdfShape capsule(float x0, float y0, float x1, float y1,
+                          float radius) {
+    return {SDF_CAPSULE, x0, y0, x1, y1, radius};
+  }
+
+  // rows and columns the shape can cover, with a pixel of margin
+  void bounds(int &x0, int &y0, int &x1, int &y1) const {
+    float l, t, rt, bm;
+    if (type == SDF_CAPSULE) {
+      l = std::min(cx, a) - r;
+      rt = std::max(cx, a) + r;
+      t = std::min(cy, b) - r;
+      bm = std::max(cy, b) + r;
+    } else {
+      l = cx - a;
+      rt = cx + a;
+      t = cy - b;
+      bm = cy + b;
+    }
+    x0 = (int)std::floor(l) - 1;
+    y0 = (int)std::floor(t) - 1;
+    x1 = (int)std::ceil(rt) + 1;
+    y1 = (int)std::ceil(bm) + 1;
+  }
+
+  // signed distances of pixel centers (x + i + 0.5, y + 0.5), 0 <= i < n
+  void distances(int x, int y, int n, float *d) const {
+    float py = y + 0.5f - cy;
+    int i = 0;
+
+#ifdef __SSE2__
+    const __m128 zero = _mm_setzero_ps();
+    const __m128 absMask = _mm_castsi128_ps(_mm_set1_epi32(0x7fffffff));
+    __m128 px = _mm_add_ps(_mm_set1_ps(x + 0.5f - cx),
+                           _mm_set_ps(3.0f, 2.0f, 1.0f, 0.0f));
+    const __m128 step = _mm_set1_ps(4.0f);
+    __m128 py4 = _mm_set1_ps(py);
+
+    if (type == SDF_CIRCLE) {
+      __m128 pyy = _mm_mul_ps(py4, py4), radius = _mm_set1_ps(r);
+      for (; i + 4 <= n; i += 4, px = _mm_add_ps(px, step))
+        _mm_storeu_ps(
+            d + i,
+            _mm_sub_ps(_mm_sqrt_ps(_mm_add_ps(_mm_mul_ps(px, px), pyy)),
+                       radius));
+    } else if (type == SDF_ELLIPSE) {
+      // the first order approximation k0 (k0 - 1) / k1, exact on the
+      // outline where coverage is decided. it is 0 / 0 at the centre, which
+      // gets -min(a, b) instead
+      __m128 ia = _mm_set1_ps(1 / a), ia2 = _mm_set1_ps(1 / (a * a));
+      float qy = py / b, qy2 = py / (b * b);
+      __m128 qyy = _mm_set1_ps(qy * qy), qyy2 = _mm_set1_ps(qy2 * qy2);
+      __m128 one = _mm_set1_ps(1.0f), tiny = _mm_set1_ps(1e-12f);
+      __m128 centre = _mm_set1_ps(-std::min(a, b));
+      for (; i + 4 <= n; i += 4, px = _mm_add_ps(px, step)) {
+        __m128 u = _mm_mul_ps(px, ia), u2 = _mm_mul_ps(px, ia2);
+        __m128 k0 = _mm_sqrt_ps(_mm_add_ps(_mm_mul_ps(u, u), qyy));
+        __m128 k1 = _mm_sqrt_ps(_mm_add_ps(_mm_mul_ps(u2, u2), qyy2));
+        __m128 dist = _mm_div_ps(_mm_mul_ps(k0, _mm_sub_ps(k0, one)),
+                                 _mm_max_ps(k1, tiny));
+        __m128 atCentre = _mm_cmplt_ps(k1, tiny);
+        _mm_storeu_ps(d + i, _mm_or_ps(_mm_and_ps(atCentre, centre),
+                                       _mm_andnot_ps(atCentre, dist)));
+      }
+    } else if (type == SDF_ROUND_RECT) {
+      float qy = std::fabs(py) - b + r;
+      __m128 qy4 = _mm_set1_ps(qy), oy = _mm_set1_ps(std::max(qy, 0.0f));
+      __m128 oyy = _mm_mul_ps(oy, oy);
+      __m128 ar = _mm_set1_ps(a - r), radius = _mm_set1_ps(r);
+      for (; i + 4 <= n; i += 4, px = _mm_add_ps(px, step)) {
+        __m128 qx = _mm_sub_ps(_mm_and_ps(px, absMask), ar);
+        __m128 ox = _mm_max_ps(qx, zero);
+        __m128 outside = _mm_sqrt_ps(_mm_add_ps(_mm_mul_ps(ox, ox), oyy));
+        __m128 inside = _mm_min_ps(_mm_max_ps(qx, qy4), zero);
+        _mm_storeu_ps(d + i,
+                      _mm_sub_ps(_mm_add_ps(outside, inside), radius));
+      }
+    } else {
+      // distance to the segment, from the nearest point's parameter t
+      float bx = a - cx, by = b - cy;
+      float len2 = std::max(bx * bx + by * by, 1e-12f);
+      __m128 bx4 = _mm_set1_ps(bx), by4 = _mm_set1_ps(by);
+      __m128 inv = _mm_set1_ps(1 / len2), pyb = _mm_set1_ps(py * by);
+      __m128 one = _mm_set1_ps(1.0f), radius = _mm_set1_ps(r);
+      for (; i + 4 <= n; i += 4, px = _mm_add_ps(px, step)) {
+        __m128 t = _mm_mul_ps(_mm_add_ps(_mm_mul_ps(px, bx4), pyb), inv);
+        t = _mm_min_ps(_mm_max_ps(t, zero), one);
+        __m128 ex = _mm_sub_ps(px, _mm_mul_ps(bx4, t));
+        __m128 ey = _mm_sub_ps(py4, _mm_mul_ps(by4, t));
+        _mm_storeu_ps(
+            d + i,
+            _mm_sub_ps(_mm_sqrt_ps(_mm_add_ps(_mm_mul_ps(ex, ex),
+                                              _mm_mul_ps(ey, ey))),
+                       radius));
+      }
+    }
+#endif
+
+    for (; i < n; i++)
+      d[i] = distance(x + i + 0.5f - cx, py);
+  }
+
+  // signed distance at (px, py) relative to (cx, cy)
+  float distance(float px, float py) const {
+    if (type == SDF_CIRCLE)
+      return std::sqrt(px * px + py * py) - r;
+    if (type == SDF_ELLIPSE) {
+      float ux = px / a, uy = py / b;
+      float vx = px / (a * a), vy = py / (b * b);
+      float k0 = std::sqrt(ux * ux + uy * uy);
+      float k1 = std::sqrt(vx * vx + vy * vy);
+      if (k1 < 1e-12f)
+        return -std::min(a, b);
+      return k0 * (k0 - 1) / k1;
+    }
+    if (type == SDF_ROUND_RECT) {
+      float qx = std::fabs(px) - a + r, qy = std::fabs(py) - b + r;
+      float ox = std::max(qx, 0.0f), oy = std::max(qy, 0.0f);
+      return std::sqrt(ox * ox + oy * oy) +
+             std::min(std::max(qx, qy), 0.0f) - r;
+    }
+    float bx = a - cx, by = b - cy;
+    float len2 = std::max(bx * bx + by * by, 1e-12f);
+    float t = clamp_float((px * bx + py * by) / len2, 0, 1);
+    float ex = px - bx * t, ey = py - by * t;
+    return std::sqrt(ex * ex + ey * ey) - r;
+  }
+};
+
+// run rows [y0, y1) in parallel bands when the area is large, as blit does
+template <typename RowFn>
+void sdfRows(int y0, int y1, int width, RowFn row) {
+  if (y1 <= y0 || width <= 0)
+    return;
+  int rows = y1 - y0;
+  if ((int64_t)rows * width < BLIT_PARALLEL_PIXELS) {
+    for (int y = y0; y < y1; y++)
+      row(y);
+    return;
+  }
+  int bandRows = std::max(1, BLIT_PARALLEL_PIXELS / 4 / width);
+  int bands = (rows + bandRows - 1) / bandRows;
+  ParallelFor(bands, HardwareThreads(), [&](int b) {
+    for (int y = y0 + b * bandRows; y < std::min(y1, y0 + (b + 1) * bandRows);
+         y++)
+      row(y);
+  });
+}
+
+void drawSdf(ColorImage &dst, const SdfShape &shape, RGBA color,
+             int mode = BLEND_NORMAL) {
+  int x0, y0, x1, y1;
+  shape.bounds(x0, y0, x1, y1);
+  x0 = std::max(x0, 0);
+  y0 = std::max(y0, 0);
+  x1 = std::min(x1, dst.GetWidth());
+  y1 = std::min(y1, dst.GetHeight());
+  int n = x1 - x0;
+  if (n <= 0)
+    return;
+
+  sdfRows(y0, y1, n, [&](int y) {
+    std::vector<float> d(n);
+    std::vector<Byte> coverage(n);
+    shape.distances(x0, y, n, d.data());
+    coverageFromDistance(d.data(), coverage.data(), n);
+    blendCoverage(dst.Row(y) + x0, coverage.data(), n, color, mode);
+  });
+}
+
+// signed distances of an outline sampled on a grid, so it can be drawn at
+// any scale from one bake. bilinear distances stay sharp when scaled up as
+// long as the outline's details are a few texels wide
+class SdfTexture {
+public:
+  SdfTexture() : width(0), height(0), originX(0), originY(0), texelSize(1) {}
+
+  // bake closed contours (even-odd, as drawPolygon fills them) into a
+  // texture whose longer side is `size` texels, with `padding` texels
+  // around the outline
+  static SdfTexture fromContours(const std::vector<std::vector<Point>> &contours,
+                                 int size, int padding = 4) {
+    SdfTexture tex;
+    float minX = FLT_MAX, minY = FLT_MAX, maxX = -FLT_MAX, maxY = -FLT_MAX;
+    for (const std::vector<Point> &c : contours)
+      for (const Point &p : c) {
+        minX = std::min(minX, p.x);
+        minY = std::min(minY, p.y);
+        maxX = std::max(maxX, p.x);
+        maxY = std::max(maxY, p.y);
+      }
+    if (minX > maxX || size <= 2 * padding)
+      return tex;
+
+    float extent = std::max({maxX - minX, maxY - minY, 1e-6f});
+    tex.texelSize = extent / (size - 2 * padding);
+    tex.originX = minX - padding * tex.texelSize;
+    tex.originY = minY - padding * tex.texelSize;
+    tex.width = (int)std::ceil((maxX - minX) / tex.texelSize) + 2 * padding;
+    tex.height = (int)std::ceil((maxY - minY) / tex.texelSize) + 2 * padding;
+    tex.data.resize((size_t)tex.width * tex.height);
+
+    struct Segment {
+      float x0, y0, x1, y1;
+    };
+    std::vector<Segment> segments;
+    for (const std::vector<Point> &c : contours)
+      for (size_t i = 0; i < c.size(); i++) {
+        const Point &p = c[i], &q = c[(i + 1) % c.size()];
+        segments.push_back({p.x, p.y, q.x, q.y});
+      }
+
+    // exact distance to the nearest segment, sign from the crossing count
+    // of a ray to the right
+    ParallelFor(tex.height, HardwareThreads(), [&](int ty) {
+      float py = tex.originY + (ty + 0.5f) * tex.texelSize;
+      for (int tx = 0; tx < tex.width; tx++) {
+        float px = tex.originX + (tx + 0.5f) * tex.texelSize;
+        float best = FLT_MAX;
+        bool inside = false;
+        for (const Segment &s : segments) {
+          float ex = s.x1 - s.x0, ey = s.y1 - s.y0;
+          float len2 = ex * ex + ey * ey;
+          float t = len2 > 0 ? clamp_float(((px - s.x0) * ex +
+                                            (py - s.y0) * ey) / len2,
+                                           0, 1)
+                             : 0;
+          float dx = px - s.x0 - ex * t, dy = py - s.y0 - ey * t;
+          best = std::min(best, dx * dx + dy * dy);
+          if ((s.y0 > py) != (s.y1 > py) &&
+              px < s.x0 + (py - s.y0) * ex / ey)
+            inside = !inside;
+        }
+        float d = std::sqrt(best) / tex.texelSize;
+        tex.data[(size_t)ty * tex.width + tx] = inside ? -d : d;
+      }
+    });
+    return tex;
+  }
+
+  // bake a rendered mask, one texel per pixel, with the outline where it
+  // crosses the threshold. drawn at scale 1 it covers what the mask did
+  static SdfTexture fromMask(const GrayscaleImage &mask, Byte threshold = 128) {
+    SdfTexture tex;
+    FloatImage d = SignedDistanceTransform(mask, threshold);
+    tex.width = d.GetWidth();
+    tex.height = d.GetHeight();
+    tex.data.resize((size_t)tex.width * tex.height);
+    for (int y = 0; y < tex.height; y++)
+      for (int x = 0; x < tex.width; x++) {
+        // a mask with nothing on or off has no outline to measure from
+        float v = d(x, y);
+        tex.data[(size_t)y * tex.width + x] =
+            std::isinf(v) ? (v > 0 ? FLT_MAX : -FLT_MAX) : v;
+      }
+    return tex;
+  }
+
+  int getWidth() const { return width; }
+
+  int getHeight() const { return height; }
+
+  // outline units per texel
+  float getTexelSize() const { return texelSize; }
+
+  // distance at texel coordinates (texel centers at integers), bilinear
+  // and clamped to the edge
+  float sample(float u, float v) const {
+    float fu = std::floor(u), fv = std::floor(v);
+    int x0 = (int)fu, y0 = (int)fv;
+    float tx = u - fu, ty = v - fv;
+    auto at = [&](int x, int y) {
+      x = std::min(std::max(x, 0), width - 1);
+      y = std::min(std::max(y, 0), height - 1);
+      return data[(size_t)y * width + x];
+    };
+    float top = at(x0, y0) + (at(x0 + 1, y0) - at(x0, y0)) * tx;
+    float bottom = at(x0, y0 + 1) + (at(x0 + 1, y0 + 1) - at(x0, y0 + 1)) * tx;
+    return top + (bottom - top) * ty;
+  }
+
+  // draw the outline with its unit (0, 0) at pixel (x, y) and scale pixels
+  // per unit. offset grows (> 0) or shrinks the shape by that many pixels
+  void draw(ColorImage &dst, float x, float y, float scale, RGBA color,
+            int mode = BLEND_NORMAL, float offset = 0) const {
+    if (width == 0 || scale <= 0)
+      return;
+    // pixel x maps to texel u = px * du + u0, likewise for v
+    float du = 1 / (scale * texelSize);
+    float u0 = (0.5f - x) * du - originX / texelSize - 0.5f;
+    float v0 = (0.5f - y) * du - originY / texelSize - 0.5f;
+    float pixelsPerTexel = scale * texelSize;
+
+    // the texture's footprint; outside it every distance is positive
+    int px0 = std::max(0, (int)std::floor(x + originX * scale));
+    int py0 = std::max(0, (int)std::floor(y + originY * scale));
+    int px1 = std::min(dst.GetWidth(),
+                       (int)std::ceil(x + (originX + width * texelSize) * scale));
+    int py1 = std::min(dst.GetHeight(),
+                       (int)std::ceil(y + (originY + height * texelSize) * scale));
+    int n = px1 - px0;
+    if (n <= 0)
+      return;
+
+    sdfRows(py0, py1, n, [&](int py) {
+      std::vector<float> line(width), d(n);
+      std::vector<Byte> coverage(n);
+
+      // blend the two texture rows once, then interpolate along the row
+      float v = py * du + v0;
+      float fv = std::floor(v), ty = v - fv;
+      const float *r0 = &data[(size_t)clampRow((int)fv) * width];
+      const float *r1 = &data[(size_t)clampRow((int)fv + 1) * width];
+      lerpRows(r0, r1, ty, line.data(), width);
+
+      float u = px0 * du + u0;
+      for (int i = 0; i < n; i++, u += du) {
+        float fu = std::floor(u), tx = u - fu;
+        int a = std::min(std::max((int)fu, 0), width - 1);
+        int b = std::min(std::max((int)fu + 1, 0), width - 1);
+        d[i] = (line[a] + (line[b] - line[a]) * tx) * pixelsPerTexel -
+               offset;
+      }
+      coverageFromDistance(d.data(), coverage.data(), n);
+      blendCoverage(dst.Row(py) + px0, coverage.data(), n, color, mode);
+    });
+  }
+
+private:
+  int clampRow(int y) const { return std::min(std::max(y, 0), height - 1); }
+
+  static void lerpRows(const float *a, const float *b, float t, float *out,
+                       int n) {
+    int i = 0;
+#ifdef __SSE2__
+    __m128 t4 = _mm_set1_ps(t);
+    for (; i + 4 <= n; i += 4) {
+      __m128 va = _mm_loadu_ps(a + i);
+      _mm_storeu_ps(out + i,
+                    _mm_add_ps(va, _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(b + i),
+                                                         va),
+                                              t4)));
+    }
+#endif
+    for (; i < n; i++)
+      out[i] = a[i] + (b[i] - a[i]) * t;
+  }
+
+  int width, height;
+  float originX, originY; // outline position of the texture's corner
+  float texelSize;
+  std::vector<float> data; // distances in texels, row major
+};
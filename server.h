@@ -0,0 +1,366 @@
+#pragma once
+
+#include "rendercache.h"
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <future>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <queue>
+#include <string>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+// Render server protocol over a unix stream socket, all integers are 32 bit
+// in host byte order since both ends are on the same machine.
+//
+//   request:  format, length, <length bytes of scene text>
+//   response: status, length, <length bytes of image or error message>
+//
+// A client may send any number of requests without waiting; responses come
+// back in request order.
+enum ResponseStatus { STATUS_OK, STATUS_BAD_REQUEST, STATUS_SERVER_ERROR };
+
+const uint32_t MAX_REQUEST_BYTES = 64 << 20;
+
+bool readFully(int fd, void *buf, size_t len) {
+  char *p = (char *)buf;
+  while (len > 0) {
+    ssize_t n = read(fd, p, len);
+    if (n <= 0)
+      return false;
+    p += n;
+    len -= n;
+  }
+  return true;
+}
+
+bool writeFully(int fd, const void *buf, size_t len) {
+  const char *p = (const char *)buf;
+  while (len > 0) {
+    ssize_t n = send(fd, p, len, MSG_NOSIGNAL);
+    if (n <= 0)
+      return false;
+    p += n;
+    len -= n;
+  }
+  return true;
+}
+
+bool writeMessage(int fd, uint32_t head, const std::vector<Byte> &body) {
+  uint32_t header[2] = {head, (uint32_t)body.size()};
+  return writeFully(fd, header, sizeof(header)) &&
+         writeFully(fd, body.data(), body.size());
+}
+
+// connected socket for the given path, or -1
+int connectUnix(const std::string &path) {
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0)
+    return -1;
+  sockaddr_un addr = {};
+  addr.sun_family = AF_UNIX;
+  strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+  if (connect(fd, (sockaddr *)&addr, sizeof(addr)) < 0) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+// free lists so steady state requests do not allocate frame or output memory
+template <typename T> class ObjectPool {
+public:
+  std::unique_ptr<T> acquire() {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (items.empty())
+      return std::unique_ptr<T>(new T());
+    std::unique_ptr<T> item = std::move(items.back());
+    items.pop_back();
+    return item;
+  }
+
+  void release(std::unique_ptr<T> item) {
+    std::lock_guard<std::mutex> lock(mutex);
+    items.push_back(std::move(item));
+  }
+
+private:
+  std::mutex mutex;
+  std::vector<std::unique_ptr<T>> items;
+};
+
+// counting semaphore bounding the number of renders in flight
+class Slots {
+public:
+  explicit Slots(int n) : available(n) {}
+
+  void acquire() {
+    std::unique_lock<std::mutex> lock(mutex);
+    freed.wait(lock, [this]() { return available > 0; });
+    available--;
+  }
+
+  void release() {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      available++;
+    }
+    freed.notify_one();
+  }
+
+private:
+  std::mutex mutex;
+  std::condition_variable freed;
+  int available;
+};
+
+class RenderServer {
+public:
+  RenderServer(const std::string &path, int maxInFlight,
+               const RenderSettings &settings, RenderCache *cache = nullptr)
+      : path(path), slots(std::max(1, maxInFlight)), settings(settings),
+        cache(cache) {}
+
+  // accept connections until the listening socket fails. returns false if
+  // the socket could not be set up
+  bool run() {
+    int listenFd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listenFd < 0)
+      return false;
+
+    sockaddr_un addr = {};
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+    unlink(path.c_str());
+    if (bind(listenFd, (sockaddr *)&addr, sizeof(addr)) < 0 ||
+        listen(listenFd, 64) < 0) {
+      std::cerr << "could not listen on " << path << std::endl;
+      close(listenFd);
+      return false;
+    }
+
+    for (;;) {
+      int fd = accept(listenFd, nullptr, nullptr);
+      if (fd < 0) {
+        if (errno == EINTR)
+          continue;
+        break;
+      }
+      std::thread(&RenderServer::serveConnection, this, fd).detach();
+    }
+
+    close(listenFd);
+    return true;
+  }
+
+private:
+  struct Response {
+    uint32_t status;
+    std::unique_ptr<std::vector<Byte>> body;
+  };
+
+  // reads requests and hands them to the pool while a writer thread sends
+  // the responses back in order, so a client can pipeline requests
+  void serveConnection(int fd) {
+    std::mutex mutex;
+    std::condition_variable ready;
+    std::queue<std::future<Response>> pending;
+    bool finished = false;
+
+    std::thread writer([&]() {
+      bool ok = true;
+      for (;;) {
+        std::future<Response> next;
+        {
+          std::unique_lock<std::mutex> lock(mutex);
+          ready.wait(lock, [&]() { return finished || !pending.empty(); });
+          if (pending.empty())
+            break;
+          next = std::move(pending.front());
+          pending.pop();
+        }
+        Response r = next.get();
+        ok = ok && writeMessage(fd, r.status, *r.body);
+        r.body->clear();
+        buffers.release(std::move(r.body));
+      }
+    });
+
+    for (;;) {
+      uint32_t header[2];
+      if (!readFully(fd, header, sizeof(header)) ||
+          header[1] > MAX_REQUEST_BYTES)
+        break;
+      std::shared_ptr<std::string> text =
+          std::make_shared<std::string>(header[1], '\0');
+      if (!readFully(fd, &(*text)[0], text->size()))
+        break;
+
+      slots.acquire();
+      std::shared_ptr<std::promise<Response>> promise =
+          std::make_shared<std::promise<Response>>();
+      {
+        std::lock_guard<std::mutex> lock(mutex);
+        pending.push(promise->get_future());
+      }
+      ready.notify_one();
+
+      uint32_t format = header[0];
+      SharedPool().Submit([this, promise, text, format]() {
+        // a request that cannot be rendered (out of memory, say) gets an
+        // error response instead of ending the whole server
+        Response r;
+        try {
+          r = handle(*text, format);
+        } catch (const std::exception &e) {
+          r = failure(STATUS_SERVER_ERROR,
+                      std::string("render failed: ") + e.what());
+        }
+        promise->set_value(std::move(r));
+        slots.release();
+      });
+    }
+
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      finished = true;
+    }
+    ready.notify_one();
+    writer.join();
+    close(fd);
+  }
+
+  Response failure(uint32_t status, const std::string &message) {
+    Response r;
+    r.status = status;
+    r.body = buffers.acquire();
+    r.body->assign(message.begin(), message.end());
+    return r;
+  }
+
+  Response handle(const std::string &text, uint32_t format) {
+    Scene scene;
+    std::string error;
+    if (!parseScene(text, scene, &error))
+      return failure(STATUS_BAD_REQUEST, error);
+
+    Response r;
+    r.body = buffers.acquire();
+    std::unique_ptr<ColorImage> canvas = canvases.acquire();
+    renderEncoded(scene, format, settings, *canvas, *r.body, cache);
+    canvases.release(std::move(canvas));
+
+    r.status = STATUS_OK;
+    return r;
+  }
+
+  std::string path;
+  Slots slots;
+  RenderSettings settings;
+  RenderCache *cache;
+  ObjectPool<ColorImage> canvases;
+  ObjectPool<std::vector<Byte>> buffers;
+};
+
+// send one scene and wait for the image. returns false if the server could
+// not be reached or rejected the scene (the message is left in image)
+bool renderRemote(const std::string &path, const std::string &sceneText,
+                  uint32_t format, std::vector<Byte> &image) {
+  int fd = connectUnix(path);
+  if (fd < 0)
+    return false;
+
+  std::vector<Byte> body(sceneText.begin(), sceneText.end());
+  uint32_t header[2] = {0, 0};
+  bool ok = writeMessage(fd, format, body) &&
+            readFully(fd, header, sizeof(header));
+  if (ok) {
+    image.resize(header[1]);
+    ok = readFully(fd, image.data(), image.size()) && header[0] == STATUS_OK;
+  }
+  close(fd);
+  return ok;
+}
+
+// load generator. each connection keeps `depth` requests in flight and the
+// time from sending a request to receiving its response is recorded
+void benchmarkServer(const std::string &path, const std::string &sceneText,
+                     uint32_t format, int requests, int connections,
+                     int depth) {
+  typedef std::chrono::steady_clock Clock;
+  std::vector<Byte> body(sceneText.begin(), sceneText.end());
+  std::vector<double> latencies;
+  std::mutex latencyMutex;
+  std::atomic<int> failures(0);
+
+  Clock::time_point start = Clock::now();
+  std::vector<std::thread> clients;
+  for (int c = 0; c < connections; c++) {
+    int count = requests / connections + (c < requests % connections);
+    clients.emplace_back([&, count]() {
+      int fd = connectUnix(path);
+      if (fd < 0) {
+        failures += count;
+        return;
+      }
+
+      std::queue<Clock::time_point> sent;
+      std::vector<double> mine;
+      std::vector<Byte> response;
+      int issued = 0;
+      while ((int)mine.size() < count) {
+        while (issued < count && (int)sent.size() < depth) {
+          sent.push(Clock::now());
+          if (!writeMessage(fd, format, body))
+            break;
+          issued++;
+        }
+
+        uint32_t header[2];
+        if (sent.empty() || !readFully(fd, header, sizeof(header)))
+          break;
+        response.resize(header[1]);
+        if (!readFully(fd, response.data(), response.size()))
+          break;
+        if (header[0] != STATUS_OK)
+          failures++;
+        mine.push_back(
+            std::chrono::duration<double, std::milli>(Clock::now() -
+                                                      sent.front())
+                .count());
+        sent.pop();
+      }
+      close(fd);
+
+      failures += count - (int)mine.size();
+      std::lock_guard<std::mutex> lock(latencyMutex);
+      latencies.insert(latencies.end(), mine.begin(), mine.end());
+    });
+  }
+  for (std::thread &t : clients)
+    t.join();
+  double seconds = std::chrono::duration<double>(Clock::now() - start).count();
+
+  std::sort(latencies.begin(), latencies.end());
+  auto percentile = [&](double p) {
+    if (latencies.empty())
+      return 0.0;
+    return latencies[std::min(latencies.size() - 1,
+                              (size_t)(p * latencies.size()))];
+  };
+  std::cout << latencies.size() << " requests in " << seconds << " s ("
+            << latencies.size() / seconds << " req/s), " << failures
+            << " failed" << std::endl;
+  std::cout << "latency p50 " << percentile(0.50) << " ms, p99 "
+            << percentile(0.99) << " ms" << std::endl;
+}
@@ -0,0 +1,127 @@
+#pragma once
+
+#include "blit.h"
+#include "image.h"
+#include "sdf.h"
+#include <cmath>
+#include <vector>
+
+// drop shadows for rects and rounded rects in closed form, without drawing
+// into an offscreen buffer and blurring it.
+//
+// the shadow is the shape convolved with a gaussian. for a rect that is
+// separable: a horizontal profile, the difference of two normal CDFs, made
+// once per shadow, times a vertical factor per row, so most of the cost is
+// the blend itself. rounded corners narrow the shape near its top and
+// bottom; rows whose gaussian window reaches a corner also add that corner
+// cut into strips, each weighted by the exact gaussian mass over the strip
+// and spread horizontally with the same closed form
+
+// normal CDF, tabulated over [-SHADOW_CDF_RANGE, SHADOW_CDF_RANGE] sigmas
+const float SHADOW_CDF_RANGE = 4.0f;
+const int SHADOW_CDF_STEPS = 2048;
+
+float shadowCdf(float t) {
+  static const std::vector<float> table = []() {
+    std::vector<float> t(SHADOW_CDF_STEPS + 2);
+    for (int i = 0; i <= SHADOW_CDF_STEPS + 1; i++) {
+      double x = (2.0 * i / SHADOW_CDF_STEPS - 1) * SHADOW_CDF_RANGE;
+      t[i] = (float)(0.5 * (1 + std::erf(x / std::sqrt(2.0))));
+    }
+    return t;
+  }();
+  float f = (t / SHADOW_CDF_RANGE + 1) * (SHADOW_CDF_STEPS / 2);
+  if (f <= 0)
+    return 0;
+  if (f >= SHADOW_CDF_STEPS)
+    return 1;
+  int i = (int)f;
+  return table[i] + (table[i + 1] - table[i]) * (f - i);
+}
+
+// the most corner strips per corner; enough that each is at most about a
+// quarter sigma tall
+const int SHADOW_CORNER_STRIPS = 16;
+
+// shadow of the rect x, y, w, h with corners rounded by radius, blurred
+// with standard deviation sigma pixels, drawn in color (its alpha is the
+// shadow's peak opacity). move the rect to offset the shadow
+void drawShadow(ColorImage &dst, float x, float y, float w, float h,
+                float radius, float sigma, RGBA color,
+                int mode = BLEND_NORMAL) {
+  if (w <= 0 || h <= 0)
+    return;
+  sigma = std::max(sigma, 0.05f);
+  radius = clamp_float(radius, 0, std::min(w, h) / 2);
+  float invSigma = 1 / sigma;
+  float x1 = x + w, y1 = y + h;
+
+  float reach = SHADOW_CDF_RANGE * sigma;
+  int px0 = std::max(0, (int)std::floor(x - reach));
+  int px1 = std::min(dst.GetWidth(), (int)std::ceil(x1 + reach));
+  int py0 = std::max(0, (int)std::floor(y - reach));
+  int py1 = std::min(dst.GetHeight(), (int)std::ceil(y1 + reach));
+  int n = px1 - px0;
+  if (n <= 0 || py1 <= py0)
+    return;
+
+  // horizontal profile of a span [a, b) at the pixel centers
+  auto profile = [&](float a, float b, float *out) {
+    for (int i = 0; i < n; i++) {
+      float cx = px0 + i + 0.5f;
+      out[i] = shadowCdf((cx - a) * invSigma) - shadowCdf((cx - b) * invSigma);
+    }
+  };
+  std::vector<float> full(n);
+  profile(x, x1, full.data());
+
+  // corner strips: their offset from the rect's top and bottom edges and
+  // the profile of their span, inset from both sides by the corner
+  int strips = 0;
+  float stripHeight = 0;
+  std::vector<float> stripOffset;
+  std::vector<std::vector<float>> stripProfiles;
+  if (radius > 0) {
+    strips = std::min(SHADOW_CORNER_STRIPS,
+                      std::max(1, (int)std::ceil(radius * 4 * invSigma)));
+    stripHeight = radius / strips;
+    for (int s = 0; s < strips; s++) {
+      float mid = (s + 0.5f) * stripHeight; // from the outer edge
+      float dy = radius - mid;
+      float inset =
+          radius - std::sqrt(std::max(0.0f, radius * radius - dy * dy));
+      stripOffset.push_back(s * stripHeight);
+      stripProfiles.emplace_back(n);
+      profile(x + inset, x1 - inset, stripProfiles.back().data());
+    }
+  }
+
+  sdfRows(py0, py1, n, [&](int py) {
+    float cy = py + 0.5f;
+    // gaussian mass of [a, b) as seen from this row
+    auto mass = [&](float a, float b) {
+      return shadowCdf((cy - a) * invSigma) - shadowCdf((cy - b) * invSigma);
+    };
+
+    std::vector<float> cover(n);
+    std::vector<Byte> coverage(n);
+    float straight = mass(y + radius, y1 - radius);
+    for (int i = 0; i < n; i++)
+      cover[i] = straight * full[i];
+
+    for (int s = 0; s < strips; s++) {
+      float top = y + stripOffset[s], bottom = y1 - stripOffset[s];
+      float m = mass(top, top + stripHeight) +
+                mass(bottom - stripHeight, bottom);
+      if (m < 1e-4f)
+        continue;
+      const float *p = stripProfiles[s].data();
+      for (int i = 0; i < n; i++)
+        cover[i] += m * p[i];
+    }
+
+    for (int i = 0; i < n; i++)
+      coverage[i] = (Byte)(clamp_float(cover[i], 0, 1) * 255.0f + 0.5f);
+    blendCoverage(dst.Row(py) + px0, coverage.data(), n, color, mode);
+  });
+}
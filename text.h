@@ -0,0 +1,321 @@
+#pragma once
+
+#include "blit.h"
+#include "image.h"
+#include "mask.h"
+#include "raster.h"
+#include <cmath>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// text drawing with a font compiled into the binary.
+//
+// the font is a 5x7 pixel font for printable ASCII. each glyph's outline
+// (its lit cells merged into rectangles) goes through the path rasterizer
+// once per size and quarter pixel horizontal offset, 4x4 supersampled into
+// a coverage mask. the masks are cached as runs of covered pixels, so
+// drawing a glyph is a few span blends with no rasterizing or zero pixels
+
+const int FONT_FIRST = 32, FONT_LAST = 126;
+const int FONT_COLUMNS = 5, FONT_ROWS = 7;
+
+// cells per character cell: glyph plus spacing, and per line
+const int FONT_ADVANCE = 6, FONT_LINE = 9;
+
+// one row per byte, bit 4 is the leftmost column
+const Byte FONT_5X7[FONT_LAST - FONT_FIRST + 1][FONT_ROWS] = {
+  {0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00}, // ' '
+  {0x04, 0x04, 0x04, 0x04, 0x04, 0x00, 0x04}, // '!'
+  {0x0a, 0x0a, 0x0a, 0x00, 0x00, 0x00, 0x00}, // '"'
+  {0x0a, 0x0a, 0x1f, 0x0a, 0x1f, 0x0a, 0x0a}, // '#'
+  {0x04, 0x0f, 0x14, 0x0e, 0x05, 0x1e, 0x04}, // '$'
+  {0x18, 0x19, 0x02, 0x04, 0x08, 0x13, 0x03}, // '%'
+  {0x0c, 0x12, 0x14, 0x08, 0x15, 0x12, 0x0d}, // '&'
+  {0x04, 0x04, 0x08, 0x00, 0x00, 0x00, 0x00}, // '\''
+  {0x02, 0x04, 0x08, 0x08, 0x08, 0x04, 0x02}, // '('
+  {0x08, 0x04, 0x02, 0x02, 0x02, 0x04, 0x08}, // ')'
+  {0x00, 0x04, 0x15, 0x0e, 0x15, 0x04, 0x00}, // '*'
+  {0x00, 0x04, 0x04, 0x1f, 0x04, 0x04, 0x00}, // '+'
+  {0x00, 0x00, 0x00, 0x00, 0x0c, 0x04, 0x08}, // ','
+  {0x00, 0x00, 0x00, 0x1f, 0x00, 0x00, 0x00}, // '-'
+  {0x00, 0x00, 0x00, 0x00, 0x00, 0x0c, 0x0c}, // '.'
+  {0x00, 0x01, 0x02, 0x04, 0x08, 0x10, 0x00}, // '/'
+  {0x0e, 0x11, 0x13, 0x15, 0x19, 0x11, 0x0e}, // '0'
+  {0x04, 0x0c, 0x04, 0x04, 0x04, 0x04, 0x0e}, // '1'
+  {0x0e, 0x11, 0x01, 0x02, 0x04, 0x08, 0x1f}, // '2'
+  {0x1f, 0x02, 0x04, 0x02, 0x01, 0x11, 0x0e}, // '3'
+  {0x02, 0x06, 0x0a, 0x12, 0x1f, 0x02, 0x02}, // '4'
+  {0x1f, 0x10, 0x1e, 0x01, 0x01, 0x11, 0x0e}, // '5'
+  {0x06, 0x08, 0x10, 0x1e, 0x11, 0x11, 0x0e}, // '6'
+  {0x1f, 0x01, 0x02, 0x04, 0x08, 0x08, 0x08}, // '7'
+  {0x0e, 0x11, 0x11, 0x0e, 0x11, 0x11, 0x0e}, // '8'
+  {0x0e, 0x11, 0x11, 0x0f, 0x01, 0x02, 0x0c}, // '9'
+  {0x00, 0x0c, 0x0c, 0x00, 0x0c, 0x0c, 0x00}, // ':'
+  {0x00, 0x0c, 0x0c, 0x00, 0x0c, 0x04, 0x08}, // ';'
+  {0x02, 0x04, 0x08, 0x10, 0x08, 0x04, 0x02}, // '<'
+  {0x00, 0x00, 0x1f, 0x00, 0x1f, 0x00, 0x00}, // '='
+  {0x08, 0x04, 0x02, 0x01, 0x02, 0x04, 0x08}, // '>'
+  {0x0e, 0x11, 0x01, 0x02, 0x04, 0x00, 0x04}, // '?'
+  {0x0e, 0x11, 0x01, 0x0d, 0x15, 0x15, 0x0e}, // '@'
+  {0x0e, 0x11, 0x11, 0x1f, 0x11, 0x11, 0x11}, // 'A'
+  {0x1e, 0x11, 0x11, 0x1e, 0x11, 0x11, 0x1e}, // 'B'
+  {0x0e, 0x11, 0x10, 0x10, 0x10, 0x11, 0x0e}, // 'C'
+  {0x1c, 0x12, 0x11, 0x11, 0x11, 0x12, 0x1c}, // 'D'
+  {0x1f, 0x10, 0x10, 0x1e, 0x10, 0x10, 0x1f}, // 'E'
+  {0x1f, 0x10, 0x10, 0x1e, 0x10, 0x10, 0x10}, // 'F'
+  {0x0e, 0x11, 0x10, 0x17, 0x11, 0x11, 0x0f}, // 'G'
+  {0x11, 0x11, 0x11, 0x1f, 0x11, 0x11, 0x11}, // 'H'
+  {0x0e, 0x04, 0x04, 0x04, 0x04, 0x04, 0x0e}, // 'I'
+  {0x07, 0x02, 0x02, 0x02, 0x02, 0x12, 0x0c}, // 'J'
+  {0x11, 0x12, 0x14, 0x18, 0x14, 0x12, 0x11}, // 'K'
+  {0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x1f}, // 'L'
+  {0x11, 0x1b, 0x15, 0x15, 0x11, 0x11, 0x11}, // 'M'
+  {0x11, 0x11, 0x19, 0x15, 0x13, 0x11, 0x11}, // 'N'
+  {0x0e, 0x11, 0x11, 0x11, 0x11, 0x11, 0x0e}, // 'O'
+  {0x1e, 0x11, 0x11, 0x1e, 0x10, 0x10, 0x10}, // 'P'
+  {0x0e, 0x11, 0x11, 0x11, 0x15, 0x12, 0x0d}, // 'Q'
+  {0x1e, 0x11, 0x11, 0x1e, 0x14, 0x12, 0x11}, // 'R'
+  {0x0f, 0x10, 0x10, 0x0e, 0x01, 0x01, 0x1e}, // 'S'
+  {0x1f, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04}, // 'T'
+  {0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x0e}, // 'U'
+  {0x11, 0x11, 0x11, 0x11, 0x11, 0x0a, 0x04}, // 'V'
+  {0x11, 0x11, 0x11, 0x15, 0x15, 0x15, 0x0a}, // 'W'
+  {0x11, 0x11, 0x0a, 0x04, 0x0a, 0x11, 0x11}, // 'X'
+  {0x11, 0x11, 0x11, 0x0a, 0x04, 0x04, 0x04}, // 'Y'
+  {0x1f, 0x01, 0x02, 0x04, 0x08, 0x10, 0x1f}, // 'Z'
+  {0x0e, 0x08, 0x08, 0x08, 0x08, 0x08, 0x0e}, // '['
+  {0x00, 0x10, 0x08, 0x04, 0x02, 0x01, 0x00}, // '\\'
+  {0x0e, 0x02, 0x02, 0x02, 0x02, 0x02, 0x0e}, // ']'
+  {0x04, 0x0a, 0x11, 0x00, 0x00, 0x00, 0x00}, // '^'
+  {0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x1f}, // '_'
+  {0x08, 0x04, 0x02, 0x00, 0x00, 0x00, 0x00}, // '`'
+  {0x00, 0x00, 0x0e, 0x01, 0x0f, 0x11, 0x0f}, // 'a'
+  {0x10, 0x10, 0x16, 0x19, 0x11, 0x11, 0x1e}, // 'b'
+  {0x00, 0x00, 0x0e, 0x10, 0x10, 0x11, 0x0e}, // 'c'
+  {0x01, 0x01, 0x0d, 0x13, 0x11, 0x11, 0x0f}, // 'd'
+  {0x00, 0x00, 0x0e, 0x11, 0x1f, 0x10, 0x0e}, // 'e'
+  {0x06, 0x09, 0x08, 0x1c, 0x08, 0x08, 0x08}, // 'f'
+  {0x00, 0x0f, 0x11, 0x11, 0x0f, 0x01, 0x0e}, // 'g'
+  {0x10, 0x10, 0x16, 0x19, 0x11, 0x11, 0x11}, // 'h'
+  {0x04, 0x00, 0x0c, 0x04, 0x04, 0x04, 0x0e}, // 'i'
+  {0x02, 0x00, 0x06, 0x02, 0x02, 0x12, 0x0c}, // 'j'
+  {0x10, 0x10, 0x12, 0x14, 0x18, 0x14, 0x12}, // 'k'
+  {0x0c, 0x04, 0x04, 0x04, 0x04, 0x04, 0x0e}, // 'l'
+  {0x00, 0x00, 0x1a, 0x15, 0x15, 0x11, 0x11}, // 'm'
+  {0x00, 0x00, 0x16, 0x19, 0x11, 0x11, 0x11}, // 'n'
+  {0x00, 0x00, 0x0e, 0x11, 0x11, 0x11, 0x0e}, // 'o'
+  {0x00, 0x00, 0x1e, 0x11, 0x1e, 0x10, 0x10}, // 'p'
+  {0x00, 0x00, 0x0f, 0x11, 0x0f, 0x01, 0x01}, // 'q'
+  {0x00, 0x00, 0x16, 0x19, 0x10, 0x10, 0x10}, // 'r'
+  {0x00, 0x00, 0x0e, 0x10, 0x0e, 0x01, 0x1e}, // 's'
+  {0x08, 0x08, 0x1c, 0x08, 0x08, 0x09, 0x06}, // 't'
+  {0x00, 0x00, 0x11, 0x11, 0x11, 0x13, 0x0d}, // 'u'
+  {0x00, 0x00, 0x11, 0x11, 0x11, 0x0a, 0x04}, // 'v'
+  {0x00, 0x00, 0x11, 0x11, 0x15, 0x15, 0x0a}, // 'w'
+  {0x00, 0x00, 0x11, 0x0a, 0x04, 0x0a, 0x11}, // 'x'
+  {0x00, 0x00, 0x11, 0x11, 0x0f, 0x01, 0x0e}, // 'y'
+  {0x00, 0x00, 0x1f, 0x02, 0x04, 0x08, 0x1f}, // 'z'
+  {0x02, 0x04, 0x04, 0x08, 0x04, 0x04, 0x02}, // '{'
+  {0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04}, // '|'
+  {0x08, 0x04, 0x04, 0x02, 0x04, 0x04, 0x08}, // '}'
+  {0x00, 0x00, 0x08, 0x15, 0x02, 0x00, 0x00}, // '~'
+};
+
+// horizontal positions a glyph is rasterized at, per pixel
+const int GLYPH_SUBPIXELS = 4;
+
+// supersampling per axis when rasterizing outlines
+const int GLYPH_SUPERSAMPLE = 4;
+
+// the glyph as rectangles in cell units, y down from the top row. runs of
+// lit cells in a row are merged, then identical runs in consecutive rows
+std::vector<std::vector<Point>> glyphOutline(char c) {
+  if (c < FONT_FIRST || c > FONT_LAST)
+    c = '?';
+  const Byte *rows = FONT_5X7[c - FONT_FIRST];
+
+  struct Run {
+    int x0, x1, y0, y1;
+  };
+  std::vector<Run> runs, open;
+  for (int y = 0; y <= FONT_ROWS; y++) {
+    std::vector<Run> row;
+    for (int x = 0; y < FONT_ROWS && x < FONT_COLUMNS;) {
+      if (!(rows[y] >> (FONT_COLUMNS - 1 - x) & 1)) {
+        x++;
+        continue;
+      }
+      int x0 = x;
+      while (x < FONT_COLUMNS && rows[y] >> (FONT_COLUMNS - 1 - x) & 1)
+        x++;
+      row.push_back({x0, x, y, y + 1});
+    }
+    // extend runs from the row above that match, close the others
+    for (Run &r : row)
+      for (Run &o : open)
+        if (o.x0 == r.x0 && o.x1 == r.x1 && o.y1 == y) {
+          r.y0 = o.y0;
+          o.y1 = -1;
+        }
+    for (const Run &o : open)
+      if (o.y1 >= 0)
+        runs.push_back(o);
+    open = row;
+  }
+
+  std::vector<std::vector<Point>> outline;
+  for (const Run &r : runs)
+    outline.push_back(createRect((float)r.x0, (float)r.y0,
+                                 (float)(r.x1 - r.x0), (float)(r.y1 - r.y0)));
+  return outline;
+}
+
+// a rasterized glyph: covered pixels as runs, relative to the pen position
+// on the baseline
+struct Glyph {
+  struct Span {
+    int y, x0, x1;
+    std::vector<Byte> coverage; // empty when fully covered
+  };
+  std::vector<Span> spans;
+};
+
+// rasterize c at pixel size (cell height) with the pen moved right by
+// subpixel / GLYPH_SUBPIXELS of a pixel
+void rasterizeGlyph(char c, float size, int subpixel, Glyph &glyph) {
+  float unit = size / FONT_ROWS;
+  float offset = (float)subpixel / GLYPH_SUBPIXELS;
+  int width = (int)std::ceil(FONT_COLUMNS * unit + offset) + 1;
+  int height = (int)std::ceil(size) + 1;
+
+  const int ss = GLYPH_SUPERSAMPLE;
+  BitMask mask(width * ss, height * ss);
+  for (std::vector<Point> rect : glyphOutline(c)) {
+    for (Point &p : rect) {
+      p.x = (p.x * unit + offset) * ss;
+      p.y = p.y * unit * ss;
+    }
+    drawPolygon(mask, rect);
+  }
+
+  // box filter ss x ss blocks down to coverage and keep the covered runs
+  glyph.spans.clear();
+  std::vector<Byte> row(width);
+  for (int y = 0; y < height; y++) {
+    for (int x = 0; x < width; x++) {
+      int count = 0;
+      for (int sy = 0; sy < ss; sy++)
+        for (int sx = 0; sx < ss; sx++)
+          count += mask.Get(x * ss + sx, y * ss + sy);
+      row[x] = (Byte)((count * 255 + ss * ss / 2) / (ss * ss));
+    }
+    for (int x = 0; x < width;) {
+      if (row[x] == 0) {
+        x++;
+        continue;
+      }
+      int x0 = x;
+      bool full = true;
+      for (; x < width && row[x] != 0; x++)
+        full = full && row[x] == 255;
+      Glyph::Span span = {y - (int)std::ceil(size), x0, x, {}};
+      if (!full)
+        span.coverage.assign(row.begin() + x0, row.begin() + x);
+      glyph.spans.push_back(std::move(span));
+    }
+  }
+}
+
+// rasterized glyphs by character, size and subpixel offset. safe to share
+// between threads; glyphs are never evicted, text uses few sizes
+class GlyphCache {
+public:
+  const Glyph &get(char c, float size, int subpixel) {
+    // sizes are told apart to 1/64 pixel
+    uint64_t key = (uint64_t)(Byte)c | (uint64_t)subpixel << 8 |
+                   (uint64_t)std::lround(size * 64) << 16;
+    std::lock_guard<std::mutex> lock(mutex);
+    std::unique_ptr<Glyph> &glyph = glyphs[key];
+    if (!glyph) {
+      glyph.reset(new Glyph());
+      rasterizeGlyph(c, size, subpixel, *glyph);
+    }
+    return *glyph;
+  }
+
+  size_t size() {
+    std::lock_guard<std::mutex> lock(mutex);
+    return glyphs.size();
+  }
+
+private:
+  std::mutex mutex;
+  std::unordered_map<uint64_t, std::unique_ptr<Glyph>> glyphs;
+};
+
+GlyphCache &SharedGlyphCache() {
+  static GlyphCache cache;
+  return cache;
+}
+
+// width of the longest line of text at the given size, in pixels
+float measureText(const std::string &text, float size) {
+  float unit = size / FONT_ROWS;
+  size_t longest = 0, line = 0;
+  for (char c : text) {
+    line = c == '\n' ? 0 : line + 1;
+    longest = std::max(longest, line);
+  }
+  return longest * FONT_ADVANCE * unit;
+}
+
+// draw text with the baseline of its first line at y, starting at x.
+// size is the height of a capital in pixels; '\n' starts a new line.
+// returns the pen x after the last character
+float drawText(ColorImage &dst, const std::string &text, float x, float y,
+               float size, RGBA color,
+               GlyphCache &cache = SharedGlyphCache()) {
+  float unit = size / FONT_ROWS;
+  float penX = x;
+  int baseline = (int)std::lround(y);
+  int w = dst.GetWidth(), h = dst.GetHeight();
+
+  for (char c : text) {
+    if (c == '\n') {
+      penX = x;
+      y += FONT_LINE * unit;
+      baseline = (int)std::lround(y);
+      continue;
+    }
+    float fx = std::floor(penX * GLYPH_SUBPIXELS + 0.5f) / GLYPH_SUBPIXELS;
+    int left = (int)std::floor(fx);
+    int subpixel = (int)((fx - left) * GLYPH_SUBPIXELS);
+    penX += FONT_ADVANCE * unit;
+    if (c == ' ')
+      continue;
+
+    const Glyph &glyph = cache.get(c, size, subpixel);
+    for (const Glyph::Span &s : glyph.spans) {
+      int row = baseline + s.y;
+      int x0 = std::max(left + s.x0, 0), x1 = std::min(left + s.x1, w);
+      if (row < 0 || row >= h || x0 >= x1)
+        continue;
+      RGBA *out = dst.Row(row);
+      if (s.coverage.empty()) {
+        if (color.a == 255)
+          std::fill(out + x0, out + x1, color);
+        else
+          for (int px = x0; px < x1; px++)
+            blitPixel<BLEND_NORMAL>(out[px], color, 255);
+        continue;
+      }
+      const Byte *cov = s.coverage.data() - (left + s.x0);
+      for (int px = x0; px < x1; px++)
+        blitPixel<BLEND_NORMAL>(out[px], color, cov[px]);
+    }
+  }
+  return penX;
+}
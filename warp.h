@@ -0,0 +1,330 @@
+#pragma once
+
+#include "blit.h"
+#include "image.h"
+#include "parallel.h"
+#include "raster.h"
+#include <cmath>
+#include <cstring>
+#include <vector>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// affine and perspective warps of a ColorImage onto another.
+//
+// every destination row is walked left to right with the inverse mapping
+// stepped by one column at a time (an add per coordinate, plus a divide for
+// perspective), only over the columns whose preimage can touch the source.
+// samples are composited onto the destination like a normal blit, with the
+// source edges antialiased through alpha
+
+// 3x3 matrix acting on (x, y, 1) column vectors
+struct Transform {
+  double m[3][3];
+
+  static Transform identity() {
+    return Transform{{{1, 0, 0}, {0, 1, 0}, {0, 0, 1}}};
+  }
+
+  // x' = a x + b y + c, y' = d x + e y + f
+  static Transform affine(double a, double b, double c, double d, double e,
+                          double f) {
+    return Transform{{{a, b, c}, {d, e, f}, {0, 0, 1}}};
+  }
+
+  static Transform translate(double tx, double ty) {
+    return affine(1, 0, tx, 0, 1, ty);
+  }
+
+  static Transform scale(double sx, double sy) {
+    return affine(sx, 0, 0, 0, sy, 0);
+  }
+
+  // counterclockwise on screen (y down) for positive angles
+  static Transform rotate(double radians) {
+    double c = std::cos(radians), s = std::sin(radians);
+    return affine(c, s, 0, -s, c, 0);
+  }
+
+  // maps the unit square corners (0,0) (1,0) (1,1) (0,1) to q[0..3]
+  static Transform squareToQuad(const Point q[4]) {
+    double dx1 = q[1].x - q[2].x, dx2 = q[3].x - q[2].x;
+    double dx3 = q[0].x - q[1].x + q[2].x - q[3].x;
+    double dy1 = q[1].y - q[2].y, dy2 = q[3].y - q[2].y;
+    double dy3 = q[0].y - q[1].y + q[2].y - q[3].y;
+    if (dx3 == 0 && dy3 == 0)
+      return affine(q[1].x - q[0].x, q[3].x - q[0].x, q[0].x,
+                    q[1].y - q[0].y, q[3].y - q[0].y, q[0].y);
+
+    double det = dx1 * dy2 - dx2 * dy1;
+    double g = (dx3 * dy2 - dx2 * dy3) / det;
+    double h = (dx1 * dy3 - dx3 * dy1) / det;
+    return Transform{{{q[1].x - q[0].x + g * q[1].x,
+                       q[3].x - q[0].x + h * q[3].x, q[0].x},
+                      {q[1].y - q[0].y + g * q[1].y,
+                       q[3].y - q[0].y + h * q[3].y, q[0].y},
+                      {g, h, 1}}};
+  }
+
+  // the perspective transform taking the corners from[0..3] to to[0..3].
+  // false if either quad is degenerate
+  static bool fromQuads(const Point from[4], const Point to[4],
+                        Transform &out) {
+    Transform inv;
+    if (!squareToQuad(from).inverse(inv))
+      return false;
+    out = squareToQuad(to) * inv;
+    return std::isfinite(out.m[2][2]);
+  }
+
+  Transform operator*(const Transform &o) const {
+    Transform r;
+    for (int i = 0; i < 3; i++)
+      for (int j = 0; j < 3; j++)
+        r.m[i][j] = m[i][0] * o.m[0][j] + m[i][1] * o.m[1][j] +
+                    m[i][2] * o.m[2][j];
+    return r;
+  }
+
+  bool inverse(Transform &out) const {
+    double det = m[0][0] * (m[1][1] * m[2][2] - m[1][2] * m[2][1]) -
+                 m[0][1] * (m[1][0] * m[2][2] - m[1][2] * m[2][0]) +
+                 m[0][2] * (m[1][0] * m[2][1] - m[1][1] * m[2][0]);
+    if (det == 0 || !std::isfinite(det))
+      return false;
+    for (int i = 0; i < 3; i++)
+      for (int j = 0; j < 3; j++) {
+        // cofactor of (j, i) over the determinant
+        int r0 = (j + 1) % 3, r1 = (j + 2) % 3;
+        int c0 = (i + 1) % 3, c1 = (i + 2) % 3;
+        out.m[i][j] =
+            (m[r0][c0] * m[r1][c1] - m[r0][c1] * m[r1][c0]) / det;
+      }
+    return true;
+  }
+
+  bool isAffine() const {
+    return m[2][0] == 0 && m[2][1] == 0 && m[2][2] == 1;
+  }
+
+  Point apply(Point p) const {
+    double w = m[2][0] * p.x + m[2][1] * p.y + m[2][2];
+    return Point{(float)((m[0][0] * p.x + m[0][1] * p.y + m[0][2]) / w),
+                 (float)((m[1][0] * p.x + m[1][1] * p.y + m[1][2]) / w)};
+  }
+};
+
+enum WarpFilter {
+  WARP_BILINEAR,
+  WARP_BICUBIC // Catmull-Rom, sharper when enlarging
+};
+
+// how much of a sample at texel coordinate u (texel centers at integers)
+// falls inside [0, size): bilinear weight of the inside texels
+inline float edgeCoverage(double u, int size) {
+  return clamp_float((float)(u + 1), 0, 1) *
+         clamp_float((float)(size - u), 0, 1);
+}
+
+inline int clampIndex(int i, int size) {
+  return i < 0 ? 0 : i >= size ? size - 1 : i;
+}
+
+#ifdef __SSE2__
+// one pixel in the low 4 bytes
+inline __m128i loadRGBA(const RGBA &p) {
+  int v;
+  memcpy(&v, &p, 4);
+  return _mm_cvtsi32_si128(v);
+}
+
+inline RGBA storeRGBA(__m128i c) {
+  int v = _mm_cvtsi128_si32(c);
+  RGBA p;
+  memcpy((void *)&p, &v, 4);
+  return p;
+}
+#endif
+
+// bilinear sample at texel coordinates (u, v), clamped to the edge
+RGBA sampleBilinear(const ColorImage &src, double u, double v) {
+  int w = src.GetWidth(), h = src.GetHeight();
+  double fu = std::floor(u), fv = std::floor(v);
+  int x0 = (int)fu, y0 = (int)fv;
+  int fx = (int)((u - fu) * 256), fy = (int)((v - fv) * 256);
+  const RGBA *r0 = src.Row(clampIndex(y0, h));
+  const RGBA *r1 = src.Row(clampIndex(y0 + 1, h));
+  int xa = clampIndex(x0, w), xb = clampIndex(x0 + 1, w);
+
+#ifdef __SSE2__
+  const __m128i zero = _mm_setzero_si128();
+  // lanes 0-3 the left texel, 4-7 the right one
+  __m128i top = _mm_unpacklo_epi8(
+      _mm_unpacklo_epi32(loadRGBA(r0[xa]), loadRGBA(r0[xb])), zero);
+  __m128i bottom = _mm_unpacklo_epi8(
+      _mm_unpacklo_epi32(loadRGBA(r1[xa]), loadRGBA(r1[xb])), zero);
+  __m128i wx = _mm_set_epi16(fx, fx, fx, fx, 256 - fx, 256 - fx, 256 - fx,
+                             256 - fx);
+  // at most 255 * 256 per lane, so unsigned 16 bit sums do not overflow
+  top = _mm_mullo_epi16(top, wx);
+  bottom = _mm_mullo_epi16(bottom, wx);
+  top = _mm_srli_epi16(_mm_add_epi16(top, _mm_srli_si128(top, 8)), 8);
+  bottom = _mm_srli_epi16(_mm_add_epi16(bottom, _mm_srli_si128(bottom, 8)), 8);
+  __m128i c = _mm_add_epi16(_mm_mullo_epi16(top, _mm_set1_epi16(256 - fy)),
+                            _mm_mullo_epi16(bottom, _mm_set1_epi16(fy)));
+  c = _mm_srli_epi16(_mm_add_epi16(c, _mm_set1_epi16(128)), 8);
+  return storeRGBA(_mm_packus_epi16(c, zero));
+#else
+  auto lerp = [&](int c00, int c01, int c10, int c11) {
+    int top = (c00 * (256 - fx) + c01 * fx) >> 8;
+    int bottom = (c10 * (256 - fx) + c11 * fx) >> 8;
+    return (Byte)((top * (256 - fy) + bottom * fy + 128) >> 8);
+  };
+  const RGBA &a = r0[xa], &b = r0[xb], &c = r1[xa], &d = r1[xb];
+  return RGBA(lerp(a.r, b.r, c.r, d.r), lerp(a.g, b.g, c.g, d.g),
+              lerp(a.b, b.b, c.b, d.b), lerp(a.a, b.a, c.a, d.a));
+#endif
+}
+
+// Catmull-Rom weights for the texels at -1, 0, 1, 2 from floor(u)
+inline void cubicWeights(float t, float w[4]) {
+  float t2 = t * t, t3 = t2 * t;
+  w[0] = 0.5f * (-t3 + 2 * t2 - t);
+  w[1] = 0.5f * (3 * t3 - 5 * t2 + 2);
+  w[2] = 0.5f * (-3 * t3 + 4 * t2 + t);
+  w[3] = 0.5f * (t3 - t2);
+}
+
+RGBA sampleBicubic(const ColorImage &src, double u, double v) {
+  int w = src.GetWidth(), h = src.GetHeight();
+  double fu = std::floor(u), fv = std::floor(v);
+  int x0 = (int)fu - 1, y0 = (int)fv - 1;
+  float wx[4], wy[4];
+  cubicWeights((float)(u - fu), wx);
+  cubicWeights((float)(v - fv), wy);
+  int xs[4];
+  for (int i = 0; i < 4; i++)
+    xs[i] = clampIndex(x0 + i, w);
+
+#ifdef __SSE2__
+  const __m128i zero = _mm_setzero_si128();
+  __m128 sum = _mm_setzero_ps();
+  for (int j = 0; j < 4; j++) {
+    const RGBA *row = src.Row(clampIndex(y0 + j, h));
+    __m128 line = _mm_setzero_ps();
+    for (int i = 0; i < 4; i++) {
+      __m128i p = _mm_unpacklo_epi16(
+          _mm_unpacklo_epi8(loadRGBA(row[xs[i]]), zero), zero);
+      line = _mm_add_ps(line, _mm_mul_ps(_mm_cvtepi32_ps(p),
+                                         _mm_set1_ps(wx[i])));
+    }
+    sum = _mm_add_ps(sum, _mm_mul_ps(line, _mm_set1_ps(wy[j])));
+  }
+  // the lobes overshoot, packs saturate back to 0-255
+  __m128i c = _mm_cvtps_epi32(sum);
+  c = _mm_packus_epi16(_mm_packs_epi32(c, zero), zero);
+  return storeRGBA(c);
+#else
+  float sum[4] = {0, 0, 0, 0};
+  for (int j = 0; j < 4; j++) {
+    const RGBA *row = src.Row(clampIndex(y0 + j, h));
+    for (int i = 0; i < 4; i++) {
+      const RGBA &p = row[xs[i]];
+      float k = wx[i] * wy[j];
+      sum[0] += p.r * k;
+      sum[1] += p.g * k;
+      sum[2] += p.b * k;
+      sum[3] += p.a * k;
+    }
+  }
+  return RGBA((Byte)clamp_float(std::round(sum[0]), 0, 255),
+              (Byte)clamp_float(std::round(sum[1]), 0, 255),
+              (Byte)clamp_float(std::round(sum[2]), 0, 255),
+              (Byte)clamp_float(std::round(sum[3]), 0, 255));
+#endif
+}
+
+// narrow [x0, x1) to the x where a x + b > 0
+inline void clipHalfLine(double a, double b, double &x0, double &x1) {
+  if (a > 0)
+    x0 = std::max(x0, -b / a);
+  else if (a < 0)
+    x1 = std::min(x1, -b / a);
+  else if (b <= 0)
+    x1 = x0;
+}
+
+// draw src onto dst moved by srcToDst. false if the transform can not be
+// inverted
+bool warp(ColorImage &dst, const ColorImage &src, const Transform &srcToDst,
+          int filter = WARP_BILINEAR) {
+  int sw = src.GetWidth(), sh = src.GetHeight();
+  int dw = dst.GetWidth(), dh = dst.GetHeight();
+  Transform inv;
+  if (!srcToDst.inverse(inv))
+    return false;
+  if (sw == 0 || sh == 0 || dw == 0 || dh == 0)
+    return true;
+
+  // destination pixel centers in, source texel coordinates out
+  Transform m = Transform::translate(-0.5, -0.5) * inv *
+                Transform::translate(0.5, 0.5);
+  bool affine = m.isAffine();
+  const double minW = 1e-9;
+
+  auto rows = [&](int y0, int y1) {
+    std::vector<RGBA> samples(dw);
+    for (int y = y0; y < y1; y++) {
+      // the row in source space is (U, V, W) = start + x * step
+      double u0 = m.m[0][1] * y + m.m[0][2], du = m.m[0][0];
+      double v0 = m.m[1][1] * y + m.m[1][2], dv = m.m[1][0];
+      double w0 = m.m[2][1] * y + m.m[2][2], dW = m.m[2][0];
+
+      // columns where -1 < U/W < sw, -1 < V/W < sh and W > 0, all linear
+      // in x. widened by a pixel, edge coverage takes care of the rest
+      double lo = 0, hi = dw;
+      clipHalfLine(dW, w0 - minW, lo, hi);
+      clipHalfLine(du + dW, u0 + w0, lo, hi);
+      clipHalfLine(sw * dW - du, sw * w0 - u0, lo, hi);
+      clipHalfLine(dv + dW, v0 + w0, lo, hi);
+      clipHalfLine(sh * dW - dv, sh * w0 - v0, lo, hi);
+      if (!(lo < hi))
+        continue;
+      int x0 = std::max(0, (int)std::floor(lo) - 1);
+      int x1 = std::min(dw, (int)std::ceil(hi) + 1);
+
+      double U = u0 + du * x0, V = v0 + dv * x0, W = w0 + dW * x0;
+      for (int x = x0; x < x1; x++, U += du, V += dv, W += dW) {
+        RGBA &out = samples[x - x0];
+        double u = U, v = V;
+        if (!affine) {
+          if (W <= minW) {
+            out.a = 0;
+            continue;
+          }
+          u = U / W;
+          v = V / W;
+        }
+        float coverage = edgeCoverage(u, sw) * edgeCoverage(v, sh);
+        if (coverage <= 0) {
+          out.a = 0;
+          continue;
+        }
+        out = filter == WARP_BICUBIC ? sampleBicubic(src, u, v)
+                                     : sampleBilinear(src, u, v);
+        if (coverage < 1)
+          out.a = (Byte)(out.a * coverage + 0.5f);
+      }
+      blitRow<BLEND_NORMAL>(dst.Row(y) + x0, samples.data(), x1 - x0, 255);
+    }
+  };
+
+  // bands of rows across the pool, each with its own sample buffer
+  int bandRows = std::max(1, BLIT_PARALLEL_PIXELS / 4 / dw);
+  int bands = (dh + bandRows - 1) / bandRows;
+  ParallelFor(bands, HardwareThreads(), [&](int b) {
+    rows(b * bandRows, std::min(dh, (b + 1) * bandRows));
+  });
+  return true;
+}
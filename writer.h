@@ -0,0 +1,510 @@
+#pragma once
+
+#include "image.h"
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <fcntl.h>
+#include <iostream>
+#include <linux/io_uring.h>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+// Writers for many small output files. write() takes ownership of an
+// encoded buffer and returns as soon as it is queued, so the encoding
+// thread never waits on the file system unless maxInFlight files are
+// already pending.
+//
+// The io_uring writer submits open, write and close for a file as one
+// linked chain, the open installing a direct descriptor the write and
+// close then use, so a whole batch of files costs a single syscall. Where
+// io_uring (or direct descriptors) are missing, a few threads do the usual
+// open/write/close instead.
+
+struct WriteStats {
+  long long files = 0, bytes = 0, failures = 0;
+  long long syscalls = 0;
+  std::vector<double> latenciesMs; // queued to closed, per file
+
+  double percentile(double p) const {
+    if (latenciesMs.empty())
+      return 0;
+    std::vector<double> sorted = latenciesMs;
+    size_t i = std::min(sorted.size() - 1, (size_t)(p * sorted.size()));
+    std::nth_element(sorted.begin(), sorted.begin() + i, sorted.end());
+    return sorted[i];
+  }
+};
+
+void printWriteStats(const char *backend, const WriteStats &s) {
+  std::cout << backend << ": " << s.files << " files, " << s.bytes
+            << " bytes, " << s.failures << " failed, "
+            << (s.files ? (double)s.syscalls / s.files : 0.0)
+            << " syscalls per file, latency p50 " << s.percentile(0.5)
+            << " ms, p99 " << s.percentile(0.99) << " ms" << std::endl;
+}
+
+class FileWriter {
+public:
+  virtual ~FileWriter() {}
+
+  // queue data to be written to path, replacing any existing file
+  virtual void write(const std::string &path, std::vector<Byte> data) = 0;
+
+  // wait until everything queued is on its way to disk (closed)
+  virtual void flush() = 0;
+
+  virtual WriteStats stats() = 0;
+
+  virtual const char *name() const = 0;
+};
+
+const int OUTPUT_FILE_MODE = 0644;
+
+// open, write and close on the calling thread, counting syscalls
+bool writeFileSync(const std::string &path, const std::vector<Byte> &data,
+                   long long &syscalls) {
+  syscalls++;
+  int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+                OUTPUT_FILE_MODE);
+  if (fd < 0)
+    return false;
+
+  bool ok = true;
+  for (size_t done = 0; done < data.size();) {
+    syscalls++;
+    ssize_t n = ::write(fd, data.data() + done, data.size() - done);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0) {
+      ok = false;
+      break;
+    }
+    done += n;
+  }
+  syscalls++;
+  return close(fd) == 0 && ok;
+}
+
+double millisecondsSince(std::chrono::steady_clock::time_point start) {
+  return std::chrono::duration<double, std::milli>(
+             std::chrono::steady_clock::now() - start)
+      .count();
+}
+
+class ThreadWriter : public FileWriter {
+public:
+  ThreadWriter(int threads, int maxInFlight)
+      : maxInFlight(std::max(1, maxInFlight)) {
+    for (int t = 0; t < std::max(1, threads); t++)
+      workers.emplace_back([this]() { work(); });
+  }
+
+  ~ThreadWriter() {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      stopping = true;
+    }
+    changed.notify_all();
+    for (std::thread &t : workers)
+      t.join();
+  }
+
+  void write(const std::string &path, std::vector<Byte> data) override {
+    std::unique_lock<std::mutex> lock(mutex);
+    changed.wait(lock, [this]() { return inFlight < maxInFlight; });
+    inFlight++;
+    jobs.push_back(
+        {path, std::move(data), std::chrono::steady_clock::now()});
+    changed.notify_all();
+  }
+
+  void flush() override {
+    std::unique_lock<std::mutex> lock(mutex);
+    changed.wait(lock, [this]() { return inFlight == 0; });
+  }
+
+  WriteStats stats() override {
+    std::lock_guard<std::mutex> lock(mutex);
+    return counters;
+  }
+
+  const char *name() const override { return "threads"; }
+
+private:
+  struct Job {
+    std::string path;
+    std::vector<Byte> data;
+    std::chrono::steady_clock::time_point queued;
+  };
+
+  void work() {
+    for (;;) {
+      Job job;
+      {
+        std::unique_lock<std::mutex> lock(mutex);
+        changed.wait(lock, [this]() { return stopping || !jobs.empty(); });
+        if (jobs.empty())
+          return;
+        job = std::move(jobs.front());
+        jobs.pop_front();
+      }
+
+      long long syscalls = 0;
+      bool ok = writeFileSync(job.path, job.data, syscalls);
+      double latency = millisecondsSince(job.queued);
+
+      std::lock_guard<std::mutex> lock(mutex);
+      counters.files++;
+      counters.bytes += ok ? job.data.size() : 0;
+      counters.failures += ok ? 0 : 1;
+      counters.syscalls += syscalls;
+      counters.latenciesMs.push_back(latency);
+      inFlight--;
+      changed.notify_all();
+    }
+  }
+
+  int maxInFlight;
+  int inFlight = 0;
+  bool stopping = false;
+  std::deque<Job> jobs;
+  WriteStats counters;
+  std::mutex mutex;
+  std::condition_variable changed;
+  std::vector<std::thread> workers;
+};
+
+class UringWriter : public FileWriter {
+public:
+  // nullptr if the kernel (or a seccomp policy) does not allow io_uring
+  // with direct descriptors
+  static std::unique_ptr<UringWriter> create(int maxInFlight) {
+    std::unique_ptr<UringWriter> w(new UringWriter(std::max(1, maxInFlight)));
+    if (!w->setup())
+      return nullptr;
+    return w;
+  }
+
+  ~UringWriter() {
+    if (ringFd >= 0) {
+      flush();
+      if (sqes != nullptr)
+        munmap(sqes, sqesBytes);
+      if (cqRing != nullptr && cqRing != sqRing)
+        munmap(cqRing, cqRingBytes);
+      if (sqRing != nullptr)
+        munmap(sqRing, sqRingBytes);
+      close(ringFd);
+    }
+  }
+
+  void write(const std::string &path, std::vector<Byte> data) override {
+    std::lock_guard<std::mutex> lock(mutex);
+    // out of slots: wait for a batch of files to finish, not just one, so
+    // waiting costs a syscall per batch too
+    while (!broken && freeSlots.empty())
+      enter(3 * std::min(SUBMIT_BATCH, maxInFlight));
+    if (broken) {
+      long long syscalls = 0;
+      bool ok = writeFileSync(path, data, syscalls);
+      counters.syscalls += syscalls;
+      record(ok, data.size(), std::chrono::steady_clock::now());
+      return;
+    }
+
+    int slot = freeSlots.back();
+    freeSlots.pop_back();
+    Slot &s = slots[slot];
+    s.path = path;
+    s.data = std::move(data);
+    s.queued = std::chrono::steady_clock::now();
+    s.completions = 0;
+    s.ok = true;
+    s.shortWrite = false;
+    s.opened = s.closed = false;
+
+    io_uring_sqe *openSqe = nextSqe();
+    openSqe->opcode = IORING_OP_OPENAT;
+    openSqe->flags = IOSQE_IO_LINK;
+    openSqe->fd = AT_FDCWD;
+    openSqe->addr = (uint64_t)s.path.c_str();
+    openSqe->len = OUTPUT_FILE_MODE;
+    // direct descriptors are never inherited, the kernel rejects O_CLOEXEC
+    openSqe->open_flags = O_WRONLY | O_CREAT | O_TRUNC;
+    openSqe->file_index = slot + 1; // direct descriptor slot, 1 based
+    openSqe->user_data = (uint64_t)slot << 2 | OP_OPEN;
+
+    io_uring_sqe *writeSqe = nextSqe();
+    writeSqe->opcode = IORING_OP_WRITE;
+    writeSqe->flags = IOSQE_FIXED_FILE | IOSQE_IO_LINK;
+    writeSqe->fd = slot;
+    writeSqe->addr = (uint64_t)s.data.data();
+    writeSqe->len = (uint32_t)s.data.size();
+    writeSqe->off = 0;
+    writeSqe->user_data = (uint64_t)slot << 2 | OP_WRITE;
+
+    io_uring_sqe *closeSqe = nextSqe();
+    closeSqe->opcode = IORING_OP_CLOSE;
+    closeSqe->file_index = slot + 1;
+    closeSqe->user_data = (uint64_t)slot << 2 | OP_CLOSE;
+    outstanding += 3;
+
+    if (++unsubmittedFiles >= SUBMIT_BATCH)
+      enter(0);
+  }
+
+  void flush() override {
+    std::lock_guard<std::mutex> lock(mutex);
+    while (!broken &&
+           (unsubmittedFiles > 0 || (int)freeSlots.size() < maxInFlight))
+      enter(1);
+  }
+
+  WriteStats stats() override {
+    std::lock_guard<std::mutex> lock(mutex);
+    return counters;
+  }
+
+  const char *name() const override { return "io_uring"; }
+
+private:
+  enum { OP_OPEN, OP_WRITE, OP_CLOSE };
+
+  // files queued before a submit, trading a little latency for fewer
+  // syscalls
+  static constexpr int SUBMIT_BATCH = 16;
+
+  struct Slot {
+    std::string path;
+    std::vector<Byte> data;
+    std::chrono::steady_clock::time_point queued;
+    int completions;
+    bool ok, shortWrite;
+    bool opened, closed; // whether the direct descriptor was installed, and
+                         // removed again by the chain's close
+  };
+
+  UringWriter(int maxInFlight)
+      : maxInFlight(maxInFlight), slots(maxInFlight) {
+    for (int i = maxInFlight - 1; i >= 0; i--)
+      freeSlots.push_back(i);
+  }
+
+  bool setup() {
+    // three entries per file in flight, so the rings never fill up
+    unsigned entries = 1;
+    while (entries < 3u * maxInFlight)
+      entries *= 2;
+
+    io_uring_params params = {};
+    ringFd = (int)syscall(__NR_io_uring_setup, entries, &params);
+    if (ringFd < 0)
+      return false;
+
+    sqRingBytes = params.sq_off.array + params.sq_entries * sizeof(uint32_t);
+    cqRingBytes =
+        params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    bool single = params.features & IORING_FEAT_SINGLE_MMAP;
+    if (single)
+      sqRingBytes = cqRingBytes = std::max(sqRingBytes, cqRingBytes);
+
+    sqRing = mmap(nullptr, sqRingBytes, PROT_READ | PROT_WRITE,
+                  MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQ_RING);
+    if (sqRing == MAP_FAILED) {
+      sqRing = nullptr;
+      return false;
+    }
+    cqRing = single ? sqRing
+                    : mmap(nullptr, cqRingBytes, PROT_READ | PROT_WRITE,
+                           MAP_SHARED | MAP_POPULATE, ringFd,
+                           IORING_OFF_CQ_RING);
+    if (cqRing == MAP_FAILED) {
+      cqRing = nullptr;
+      return false;
+    }
+    sqesBytes = params.sq_entries * sizeof(io_uring_sqe);
+    void *mapped = mmap(nullptr, sqesBytes, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQES);
+    if (mapped == MAP_FAILED)
+      return false;
+    sqes = (io_uring_sqe *)mapped;
+
+    char *sq = (char *)sqRing, *cq = (char *)cqRing;
+    sqHead = (unsigned *)(sq + params.sq_off.head);
+    sqTail = (unsigned *)(sq + params.sq_off.tail);
+    sqMask = *(unsigned *)(sq + params.sq_off.ring_mask);
+    sqArray = (unsigned *)(sq + params.sq_off.array);
+    cqHead = (unsigned *)(cq + params.cq_off.head);
+    cqTail = (unsigned *)(cq + params.cq_off.tail);
+    cqMask = *(unsigned *)(cq + params.cq_off.ring_mask);
+    cqes = (io_uring_cqe *)(cq + params.cq_off.cqes);
+
+    // every operation the chain uses must be supported
+    std::vector<char> probeBytes(sizeof(io_uring_probe) +
+                                 256 * sizeof(io_uring_probe_op));
+    io_uring_probe *probe = (io_uring_probe *)probeBytes.data();
+    if (syscall(__NR_io_uring_register, ringFd, IORING_REGISTER_PROBE, probe,
+                256) < 0)
+      return false;
+    for (int op : {IORING_OP_OPENAT, IORING_OP_WRITE, IORING_OP_CLOSE}) {
+      if (op > probe->last_op ||
+          !(probe->ops[op].flags & IO_URING_OP_SUPPORTED))
+        return false;
+    }
+
+    // empty table for the direct descriptors, one per slot
+    io_uring_rsrc_register files = {};
+    files.nr = maxInFlight;
+    files.flags = IORING_RSRC_REGISTER_SPARSE;
+    return syscall(__NR_io_uring_register, ringFd, IORING_REGISTER_FILES2,
+                   &files, sizeof(files)) == 0;
+  }
+
+  io_uring_sqe *nextSqe() {
+    unsigned tail = *sqTail;
+    unsigned index = tail & sqMask;
+    io_uring_sqe *sqe = &sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sqArray[index] = index;
+    __atomic_store_n(sqTail, tail + 1, __ATOMIC_RELEASE);
+    unsubmitted++;
+    return sqe;
+  }
+
+  // submit everything queued and block until up to wait completions are in.
+  // never more than are still to come, as part of a chain may have been
+  // reaped already and the kernel would wait forever for the rest
+  void enter(unsigned wait) {
+    wait = std::min(wait, outstanding);
+    counters.syscalls++;
+    int n = (int)syscall(__NR_io_uring_enter, ringFd, unsubmitted, wait,
+                         wait ? IORING_ENTER_GETEVENTS : 0, nullptr, 0);
+    if (n >= 0) {
+      unsubmitted -= std::min<unsigned>(n, unsubmitted);
+      if (unsubmitted == 0)
+        unsubmittedFiles = 0;
+    } else if (errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+      std::cerr << "io_uring_enter: " << strerror(errno) << std::endl;
+      abandon();
+      return;
+    }
+    reap();
+  }
+
+  void reap() {
+    unsigned head = *cqHead;
+    unsigned tail = __atomic_load_n(cqTail, __ATOMIC_ACQUIRE);
+    for (; head != tail; head++) {
+      io_uring_cqe &cqe = cqes[head & cqMask];
+      int slot = (int)(cqe.user_data >> 2);
+      int op = (int)(cqe.user_data & 3);
+      Slot &s = slots[slot];
+      outstanding--;
+      if (op == OP_OPEN)
+        s.opened = cqe.res >= 0;
+      if (op == OP_CLOSE)
+        s.closed = cqe.res >= 0;
+
+      if (op == OP_WRITE && cqe.res >= 0 && (size_t)cqe.res < s.data.size())
+        s.shortWrite = true;
+      // a close cancelled because an earlier link failed or wrote short says
+      // nothing new, that link's own completion decides
+      else if (cqe.res < 0 && !(op == OP_CLOSE && cqe.res == -ECANCELED))
+        s.ok = false;
+      if (++s.completions == 3)
+        finish(slot);
+    }
+    __atomic_store_n(cqHead, head, __ATOMIC_RELEASE);
+  }
+
+  void finish(int slot) {
+    Slot &s = slots[slot];
+    // the close never ran if the chain broke after the open, so the file is
+    // still open in the slot
+    if (s.opened && !s.closed)
+      releaseDescriptor(slot);
+    // a short write (rare for regular files) breaks the chain and is redone
+    // the ordinary way
+    if (s.ok && s.shortWrite)
+      s.ok = writeFileSync(s.path, s.data, counters.syscalls);
+
+    record(s.ok, s.data.size(), s.queued);
+    s.data = std::vector<Byte>();
+    freeSlots.push_back(slot);
+  }
+
+  void record(bool ok, size_t bytes,
+              std::chrono::steady_clock::time_point queued) {
+    counters.files++;
+    counters.bytes += ok ? bytes : 0;
+    counters.failures += ok ? 0 : 1;
+    counters.latenciesMs.push_back(millisecondsSince(queued));
+  }
+
+  void releaseDescriptor(int slot) {
+    int none = -1;
+    io_uring_files_update update = {};
+    update.offset = slot;
+    update.fds = (uint64_t)&none;
+    counters.syscalls++;
+    if (syscall(__NR_io_uring_register, ringFd, IORING_REGISTER_FILES_UPDATE,
+                &update, 1) == 1)
+      slots[slot].closed = true;
+  }
+
+  // the ring is unusable: write whatever is left synchronously and do every
+  // later file that way too. the kernel may still be reading the paths and
+  // buffers of busy slots, so they are kept as they are and never reused
+  void abandon() {
+    broken = true;
+    for (int slot = 0; slot < maxInFlight; slot++) {
+      if (std::find(freeSlots.begin(), freeSlots.end(), slot) !=
+          freeSlots.end())
+        continue;
+      Slot &s = slots[slot];
+      bool ok = writeFileSync(s.path, s.data, counters.syscalls);
+      record(ok, s.data.size(), s.queued);
+    }
+    unsubmitted = unsubmittedFiles = 0;
+  }
+
+  int maxInFlight;
+  std::vector<Slot> slots;
+  std::vector<int> freeSlots;
+  unsigned unsubmitted = 0; // sqes
+  int unsubmittedFiles = 0;
+  unsigned outstanding = 0; // completions still to come for queued chains
+  bool broken = false;      // ring failed, files are written synchronously
+
+  int ringFd = -1;
+  void *sqRing = nullptr, *cqRing = nullptr;
+  size_t sqRingBytes = 0, cqRingBytes = 0, sqesBytes = 0;
+  io_uring_sqe *sqes = nullptr;
+  unsigned *sqHead = nullptr, *sqTail = nullptr, *sqArray = nullptr;
+  unsigned *cqHead = nullptr, *cqTail = nullptr;
+  unsigned sqMask = 0, cqMask = 0;
+  io_uring_cqe *cqes = nullptr;
+
+  WriteStats counters;
+  std::mutex mutex;
+};
+
+// io_uring when available, otherwise writer threads
+std::unique_ptr<FileWriter> createFileWriter(int maxInFlight = 64) {
+  std::unique_ptr<FileWriter> writer = UringWriter::create(maxInFlight);
+  if (!writer)
+    writer.reset(new ThreadWriter(4, maxInFlight));
+  return writer;
+}